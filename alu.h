@@ -0,0 +1,468 @@
+/* This file is part of the Team 28 Project
+ * Licensing information can be found in the LICENSE file
+ * (C) 2014 The Team 28 Authors. All rights reserved.
+ */
+#ifndef __ALU_H__
+#define __ALU_H__
+
+/* Bodies of the data processing and single data transfer instructions.
+ * They are shared by the interpreter and the block dispatcher, which
+ * executes them without going through the predecoded handlers. */
+
+/**
+ * Records the result of an instruction setting N and Z
+ * @param cpu Reference to the CPU structure
+ * @param res Result of the operation
+ */
+static inline void
+set_flags_nz(cpu_t* cpu, int32_t res)
+{
+  cpu->flags.res = res;
+  cpu->flags.nz = 1;
+
+  if (cpu->flags.eager)
+  {
+    cpu_eval_flags(cpu);
+  }
+}
+
+/**
+ * Records an addition or subtraction setting all four flags
+ * @param cpu Reference to the CPU structure
+ * @param op  FLAGS_ADD or FLAGS_SUB
+ * @param op1 First operand
+ * @param op2 Second operand
+ * @param res Result of the operation
+ */
+static inline void
+set_flags_arith(cpu_t* cpu, cpu_flags_op_t op, int32_t op1, int32_t op2,
+                int32_t res)
+{
+  cpu->flags.res = res;
+  cpu->flags.op1 = op1;
+  cpu->flags.op2 = op2;
+  cpu->flags.nz = 1;
+  cpu->flags.cv = op;
+
+  if (cpu->flags.eager)
+  {
+    cpu_eval_flags(cpu);
+  }
+}
+
+/**
+ * Sets the carry flag, applying pending updates first
+ * @param cpu Reference to the CPU structure
+ * @param c   New value of the flag
+ */
+static inline void
+set_flag_c(cpu_t* cpu, uint32_t c)
+{
+  cpu_sync_flags(cpu);
+  cpu->cpsr.b.c = c;
+}
+
+/**
+ * Rotates a number to the right
+ *
+ * @param value Number to be rotated
+ * @param shift Number of bits shifted
+ * @return Rotated number
+ */
+static inline int32_t
+rotate_right(int32_t value, uint8_t shift)
+{
+  shift &= 0x1F;
+  return (value >> shift) | (value << (32 - shift));
+}
+
+/**
+ * Applies the barrel shifter to a register value
+ * @param cpu          Reference to the cpu structure
+ * @param rm_data      Value of the shifted register
+ * @param shift_type   Type of the shift (LSL, LSR, ASR, ROR)
+ * @param shift_amount Number of bits to shift by
+ * @param s            Bit used to set flags if necessary
+ * @return shifted value
+ */
+static inline int32_t
+compute_shift(cpu_t *cpu, uint32_t rm_data, uint32_t shift_type,
+              uint32_t shift_amount, uint8_t s)
+{
+  int32_t res = 0;
+
+  if (shift_amount == 0)
+  {
+    res = rm_data;
+  }
+  else
+  {
+    switch (shift_type)
+    {
+      case 0x0:
+      {
+        /* Logical left */
+        if (shift_amount >= 32)
+        {
+          res = 0;
+          if (s)
+          {
+            set_flag_c(cpu, shift_amount == 32 && (rm_data & 0x1));
+          }
+        }
+        else
+        {
+          if (s)
+          {
+            set_flag_c(cpu, (rm_data >> (32 - shift_amount)) & 0x1);
+          }
+          res = rm_data << shift_amount;
+        }
+        break;
+      }
+      case 0x1:
+      {
+        /* Logical right */
+        if (shift_amount >= 32)
+        {
+          res = 0;
+          if (s)
+          {
+            set_flag_c(cpu, shift_amount == 32 && (rm_data >> 31));
+          }
+        }
+        else
+        {
+          if (s)
+          {
+            set_flag_c(cpu, (rm_data >> (shift_amount - 1)) & 0x1);
+          }
+          res = rm_data >> shift_amount;
+        }
+        break;
+      }
+      case 0x2:
+      {
+        /* Arithmetic right */
+        if (shift_amount >= 32)
+        {
+          uint32_t bit31 = (rm_data >> 31);
+          res = bit31 ? 0xFFFFFFFF : 0x0;
+          if (s)
+          {
+            set_flag_c(cpu, bit31);
+          }
+        }
+        else
+        {
+          if (s)
+          {
+            set_flag_c(cpu, (rm_data >> (shift_amount - 1)) & 0x1);
+          }
+          res = ((int32_t) rm_data) >> shift_amount;
+        }
+        break;
+      }
+      case 0x3:
+      {
+        /* Rotate right */
+        while (shift_amount > 32)
+        {
+          shift_amount -= 32;
+        }
+
+        if (shift_amount == 32)
+        {
+         res = rm_data;
+          if (s)
+          {
+            set_flag_c(cpu, rm_data >> 31);
+          }
+        }
+        else
+        {
+          if (s)
+          {
+            set_flag_c(cpu, (rm_data >> (shift_amount - 1)) & 0x1);
+          }
+          res = rotate_right(rm_data, shift_amount);
+        }
+        break;
+      }
+    }
+  }
+  return res;
+}
+
+/**
+ * Executes the ALU operation of a data processing instruction
+ *
+ * @param cpu Reference to the CPU structure
+ * @param op  ALU opcode
+ * @param s   Set if condition codes are updated
+ * @param rd  Destination register
+ * @param op1 First operand
+ * @param op2 Second operand, after the barrel shifter
+ */
+static inline void
+data_processing(cpu_t* cpu, uint32_t op, uint32_t s, uint32_t rd,
+                int32_t op1, int32_t op2)
+{
+  int32_t res;
+  int64_t res64;
+
+  /* Examine the opcode and execute the operation */
+  switch (op)
+  {
+    case 0x0: /* AND */
+    case 0x8: /* TST */
+    {
+      res = op1 & op2;
+
+      if (s || op == 0x08)
+      {
+        set_flags_nz(cpu, res);
+      }
+
+      if (op == 0x0)
+      {
+        cpu_write_register(cpu, rd, res);
+      }
+      return;
+    }
+    case 0x1: /* EOR */
+    case 0x9: /* TEQ */
+    {
+      res = op1 ^ op2;
+      if (s || op == 0x09)
+      {
+        set_flags_nz(cpu, res);
+      }
+
+      if (op == 0x1)
+      {
+        cpu_write_register(cpu, rd, res);
+      }
+      return;
+    }
+    case 0x2: /* SUB */
+    case 0xA: /* CMP */
+    case 0x3: /* RSB */
+    {
+      if (op == 0x3)
+      {
+        op1 ^= op2;
+        op2 ^= op1;
+        op1 ^= op2;
+      }
+
+      res64 = (int64_t)op1 - (int64_t)op2;
+      res = res64 & ((1LL << 32) - 1);
+
+      if (s || op == 0x0A)
+      {
+        set_flags_arith(cpu, FLAGS_SUB, op1, op2, res);
+      }
+
+      if (op == 0x2 || op == 0x3)
+      {
+        cpu_write_register(cpu, rd, res);
+      }
+
+      return;
+    }
+    case 0x4: /* ADD */
+    case 0xB: /* CMN */
+    {
+      res64 = (int64_t)op1 + (int64_t)op2;
+      res = res64 & ((1LL << 32) - 1);
+
+      if (s || op == 0xB)
+      {
+        set_flags_arith(cpu, FLAGS_ADD, op1, op2, res);
+      }
+      if (op == 0x4)
+      {
+        cpu_write_register(cpu, rd, res);
+      }
+      return;
+    }
+    case 0x5: /* ADC */
+    {
+      /* Carry is an input, so pending updates are applied first */
+      cpu_sync_flags(cpu);
+      res64 = (int64_t)op1 + (int64_t)op2 + (int64_t)cpu->cpsr.b.c;
+      res = res64 & ((1LL << 32) - 1);
+
+      if (s)
+      {
+        cpu->cpsr.b.z = res == 0;
+        cpu->cpsr.b.n = res >> 31;
+        if (op1 < 0 && op2 < 0 && res > 0)
+        {
+          /* negative + negative = positive => overflow */
+          cpu->cpsr.b.v = 1;
+        }
+
+        if (op1 > 0 && op2 > 0 && res < 0)
+        {
+          /* positive + positive = negative => overflow */
+          cpu->cpsr.b.v = 1;
+        }
+        cpu->cpsr.b.c = res64 >> 32 != 0;
+      }
+      cpu_write_register(cpu, rd, res);
+      return ;
+    }
+    case 0x6: /* SBC  => op1 - op2 + carry - 1 */
+    case 0x7: /* RSC  => op2 - op1 + carry - 1 */
+    {
+      if (op == 0x7){
+        int32_t t;
+
+        t = op1;
+        op1 = op2;
+        op2 = t;
+      }
+
+      cpu_sync_flags(cpu);
+      res64 = (int64_t)op1 - (int64_t)op2 + (int64_t)cpu->cpsr.b.c - 1LL;
+      res = res64 & ((1LL << 32) - 1);
+
+      if (s)
+      {
+        cpu->cpsr.b.z = res == 0;
+        cpu->cpsr.b.n = (res & (1 << 31)) != 0;
+        cpu->cpsr.b.c = (~(res64 >> 32)) != 0;
+
+        cpu->cpsr.b.v = 0;
+        if (op1 >= 0 && op2 < 0 && res < 0)
+        {
+          /* positive - negative = negative => overflow */
+          cpu->cpsr.b.v = 1;
+        }
+        else if (op1 < 0 && op2 >= 0 && res >= 0)
+        {
+          /* negative - positive = positive => overflow */
+          cpu->cpsr.b.v = 1;
+        }
+      }
+      cpu_write_register(cpu, rd, res);
+      return;
+    }
+    case 0xC: /* ORR */
+    {
+      res = op1 | op2;
+      if (s)
+      {
+        set_flags_nz(cpu, res);
+      }
+
+      cpu_write_register(cpu, rd, res);
+      return;
+    }
+    case 0xD: /* MOV */
+    {
+      if (s)
+      {
+        set_flags_nz(cpu, op2);
+      }
+
+      cpu_write_register(cpu, rd, op2);
+      return;
+    }
+    case 0xE: /* BIC */
+    {
+      res = op1 & (~op2);
+
+      if (s)
+      {
+        set_flags_nz(cpu, res);
+      }
+
+      cpu_write_register(cpu, rd, res);
+      return;
+    }
+    case 0xF: /* MVN */
+    {
+      res = ~op2;
+      if (s)
+      {
+        set_flags_nz(cpu, res);
+      }
+
+      cpu_write_register(cpu, rd, res);
+      return;
+    }
+  }
+}
+
+/**
+ * Performs the memory access of a single data transfer instruction
+ * @param cpu    Reference to cpu structure
+ * @param flags  OP_L, OP_B, OP_P, OP_U and OP_W bits of the instruction
+ * @param rd     Source / destination register
+ * @param rn_reg Base register
+ * @param offset Offset added to / subtracted from the base
+ */
+static inline void
+single_data_trans(cpu_t* cpu, uint32_t flags, uint32_t rd, uint32_t rn_reg,
+                  uint32_t offset)
+{
+  uint32_t rn, addr;
+  rn = cpu_read_register(cpu, rn_reg);
+
+  /* if p bit is set perform pre-indexing, post-indexing otherwise */
+  if (flags & OP_P)
+  {
+    rn = (flags & OP_U) ? (rn + offset) : (rn - offset);
+    addr = rn;
+  }
+  else
+  {
+    addr = rn;
+    rn = (flags & OP_U) ? (rn + offset) : (rn - offset);
+  }
+
+  /* if l bit is set perform load, store otherwise */
+  if (flags & OP_L)
+  {
+     /* if b is set load byte, word otherwise */
+    if (flags & OP_B)
+    {
+      cpu_write_register(
+        cpu, rd, (uint32_t)memory_read_byte(cpu->memory, addr));
+    }
+    else
+    {
+      cpu_write_register(
+        cpu, rd, memory_read_dword_le(cpu->memory, addr));
+     }
+  }
+  else
+  {
+    /* if b is set store byte, word otherwise */
+    if (flags & OP_B)
+    {
+      memory_write_byte(cpu->memory, addr, cpu_read_register(cpu, rd));
+    }
+    else
+    {
+      memory_write_dword_le(cpu->memory, addr, cpu_read_register(cpu, rd));
+    }
+  }
+
+  /* if post-indexing or w bit is set write back into the base register */
+  if ((flags & OP_W) || !(flags & OP_P))
+  {
+    /* w must not be set if PC is specified as the base register */
+    if (rn_reg == PC)
+    {
+      emulator_fatal(cpu->emu, "Writeback to PC not allowed");
+    }
+
+    cpu_write_register(cpu, rn_reg, rn);
+  }
+}
+
+#endif /* __ALU_H__ */
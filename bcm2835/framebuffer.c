@@ -4,68 +4,277 @@
  */
 #include "common.h"
 
-/**
- * Initialises the framebuffer interface
- * @param fb  Reference to the framebuffer structure
- * @param emu Reference to the emulator structure
+#ifdef PIEMU_HEADLESS
+#include <unistd.h>
+#endif
+
+#if defined(PIEMU_HEADLESS) || defined(PIEMU_SDL2)
+/*
+ * Set the pixel at (x, y) to the given value
  */
 void
-fb_init(framebuffer_t* fb, emulator_t* emu)
+put_pixel(fb_surface_t *surface, int x, int y, uint32_t pixel)
 {
-  assert(fb);
-  assert(emu);
+  *(uint32_t*)((uint8_t*)surface->pixels + y * surface->pitch + x * 4) = pixel;
+}
 
-  fb->emu = emu;
+/**
+ * Maps 8 bit channels to a pixel of the in-memory surface
+ */
+static inline uint32_t
+fb_map_rgb(framebuffer_t* UNUSED(fb), uint32_t r, uint32_t g, uint32_t b)
+{
+  return (r << 16) | (g << 8) | b;
+}
 
-  /* If not in graphic mode, do not create a window */
-  if (!fb->emu->graphics)
+/**
+ * Resizes the in-memory surface, clearing it
+ * @param fb     Reference to the framebuffer structure
+ * @param width  Width in pixels
+ * @param height Height in pixels
+ * @param bpp    Bytes per guest pixel, 0 if there is no guest framebuffer
+ */
+static void
+fb_surface_resize(framebuffer_t* fb, uint32_t width, uint32_t height,
+                  size_t bpp)
+{
+  if (!fb->surface)
   {
-    return;
+    fb->surface = (fb_surface_t*)calloc(1, sizeof(fb_surface_t));
+    assert(fb->surface);
   }
 
-  /* Create the window */
-  SDL_Init(SDL_INIT_EVERYTHING);
-  fb->width = 640;
-  fb->height = 480;
-  fb->depth = 32;
-  fb->surface =
-    SDL_SetVideoMode(fb->width, fb->height, fb->depth, SDL_SWSURFACE);
+  free(fb->surface->pixels);
+  fb->surface->w = width;
+  fb->surface->h = height;
+  fb->surface->pitch = width * 4;
+  fb->surface->pixels = calloc(height, fb->surface->pitch);
+  assert(fb->surface->pixels || !height);
 
-  /* Set the window caption */
-  SDL_WM_SetCaption("Raspberry Pi Emulator", NULL);
+  fb->format.rshift = 16;
+  fb->format.gshift = 8;
+  fb->format.bshift = 0;
+  fb->format.alpha = 0;
+  fb->convert = pixel_select(bpp);
 }
+#endif
 
+#if defined(PIEMU_HEADLESS)
 /**
- * Cleans up memory used by the framebuffer
- * @param fb  Reference to the framebuffer structure
+ * Resizes the in-memory surface which stands in for the window
+ * @param fb     Reference to the framebuffer structure
+ * @param width  Width in pixels
+ * @param height Height in pixels
+ * @param bpp    Bytes per guest pixel, 0 if there is no guest framebuffer
  */
-void
-fb_destroy(framebuffer_t* fb)
+static inline void
+fb_surface_open(framebuffer_t* fb, uint32_t width, uint32_t height, size_t bpp)
+{
+  fb_surface_resize(fb, width, height, bpp);
+}
+
+static inline void
+fb_surface_lock(framebuffer_t* UNUSED(fb))
+{
+}
+
+static inline void
+fb_surface_unlock(framebuffer_t* UNUSED(fb))
+{
+}
+
+/**
+ * Stands in for showing the frame. Frames are hashed and dumped by
+ * fb_record on the emulator thread instead.
+ */
+static inline void
+fb_surface_flip(framebuffer_t* UNUSED(fb), uint32_t UNUSED(first),
+                uint32_t UNUSED(count))
+{
+}
+
+/**
+ * Frees the in-memory surface
+ * @param fb Reference to the framebuffer structure
+ */
+static void
+fb_surface_close(framebuffer_t* fb)
+{
+  if (fb->surface)
+  {
+    free(fb->surface->pixels);
+    free(fb->surface);
+    fb->surface = NULL;
+  }
+}
+
+/**
+ * Waits a little while the emulator produces no frames
+ */
+static inline void
+fb_idle()
+{
+  usleep(1000);
+}
+#elif defined(PIEMU_SDL2)
+/**
+ * Creates the window or changes the size of the guest framebuffer. The
+ * window keeps its size, the renderer scales the texture by a whole factor.
+ * @param fb     Reference to the framebuffer structure
+ * @param width  Width in pixels
+ * @param height Height in pixels
+ * @param bpp    Bytes per guest pixel, 0 if there is no guest framebuffer
+ */
+static void
+fb_surface_open(framebuffer_t* fb, uint32_t width, uint32_t height, size_t bpp)
+{
+  fb_surface_t* surface;
+
+  fb_surface_resize(fb, width, height, bpp);
+  surface = fb->surface;
+
+  if (!surface->window)
+  {
+    SDL_Init(SDL_INIT_VIDEO);
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "nearest");
+    surface->window = SDL_CreateWindow("Raspberry Pi Emulator",
+      SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, width, height,
+      SDL_WINDOW_RESIZABLE);
+    if (!surface->window)
+    {
+      return;
+    }
+
+    /* Fall back to the software renderer if there is no GPU */
+    surface->renderer = SDL_CreateRenderer(surface->window, -1,
+                                           SDL_RENDERER_ACCELERATED);
+    if (!surface->renderer)
+    {
+      surface->renderer = SDL_CreateRenderer(surface->window, -1,
+                                             SDL_RENDERER_SOFTWARE);
+    }
+    if (!surface->renderer)
+    {
+      return;
+    }
+  }
+
+  if (surface->texture)
+  {
+    SDL_DestroyTexture(surface->texture);
+  }
+  surface->texture = SDL_CreateTexture(surface->renderer,
+    SDL_PIXELFORMAT_RGB888, SDL_TEXTUREACCESS_STREAMING, width, height);
+  SDL_RenderSetLogicalSize(surface->renderer, width, height);
+  SDL_RenderSetIntegerScale(surface->renderer, SDL_TRUE);
+}
+
+static inline void
+fb_surface_lock(framebuffer_t* UNUSED(fb))
+{
+}
+
+static inline void
+fb_surface_unlock(framebuffer_t* UNUSED(fb))
+{
+}
+
+/**
+ * Draws the texture to the window
+ * @param fb Reference to the framebuffer structure
+ */
+static void
+fb_surface_render(framebuffer_t* fb)
 {
-  if (!fb || !fb->emu->graphics)
+  fb_surface_t* surface = fb->surface;
+
+  if (!surface || !surface->renderer || !surface->texture)
   {
     return;
   }
 
-  /* Destroy SDL */
-  SDL_FreeSurface(fb->surface);
-  SDL_Quit();
-  fb->surface = 0;
+  SDL_RenderClear(surface->renderer);
+  SDL_RenderCopy(surface->renderer, surface->texture, NULL, NULL);
+  SDL_RenderPresent(surface->renderer);
+}
 
-  /* Free framebuffer */
-  if (fb->framebuffer)
+/**
+ * Uploads the rows which changed to the texture in one go, then shows it
+ * @param fb    Reference to the framebuffer structure
+ * @param first First row which changed
+ * @param count Number of rows from first which might have changed
+ */
+static void
+fb_surface_flip(framebuffer_t* fb, uint32_t first, uint32_t count)
+{
+  fb_surface_t* surface = fb->surface;
+  SDL_Rect rect;
+
+  if (!surface->texture)
   {
-    free(fb->framebuffer);
-    fb->framebuffer = NULL;
+    return;
   }
+
+  if (count > 0)
+  {
+    rect.x = 0;
+    rect.y = first;
+    rect.w = surface->w;
+    rect.h = count;
+    SDL_UpdateTexture(surface->texture, &rect,
+                      (uint8_t*)surface->pixels + first * surface->pitch,
+                      surface->pitch);
+  }
+
+  fb_surface_render(fb);
 }
 
+/**
+ * Closes the window
+ * @param fb Reference to the framebuffer structure
+ */
+static void
+fb_surface_close(framebuffer_t* fb)
+{
+  fb_surface_t* surface = fb->surface;
+
+  if (surface)
+  {
+    if (surface->texture)
+    {
+      SDL_DestroyTexture(surface->texture);
+    }
+    if (surface->renderer)
+    {
+      SDL_DestroyRenderer(surface->renderer);
+    }
+    if (surface->window)
+    {
+      SDL_DestroyWindow(surface->window);
+    }
+    free(surface->pixels);
+    free(surface);
+    fb->surface = NULL;
+  }
+
+  SDL_Quit();
+}
+
+/**
+ * Waits a little while the emulator produces no frames
+ */
+static inline void
+fb_idle()
+{
+  SDL_Delay(1);
+}
+#else
 /*
  * Set the pixel at (x, y) to the given value
  * NOTE: The surface must be locked before calling this!
  */
 void
-put_pixel(SDL_Surface *surface, int x, int y, uint32_t pixel)
+put_pixel(fb_surface_t *surface, int x, int y, uint32_t pixel)
 {
   int bpp = surface->format->BytesPerPixel;
 
@@ -108,29 +317,126 @@ put_pixel(SDL_Surface *surface, int x, int y, uint32_t pixel)
   }
 }
 
+/**
+ * Maps 8 bit channels to a pixel of the window
+ */
+static inline uint32_t
+fb_map_rgb(framebuffer_t* fb, uint32_t r, uint32_t g, uint32_t b)
+{
+  return SDL_MapRGB(fb->surface->format, r, g, b);
+}
+
+/**
+ * Creates or resizes the window
+ * @param fb     Reference to the framebuffer structure
+ * @param width  Width in pixels
+ * @param height Height in pixels
+ * @param bpp    Bytes per guest pixel, 0 if there is no guest framebuffer
+ */
+static void
+fb_surface_open(framebuffer_t* fb, uint32_t width, uint32_t height, size_t bpp)
+{
+  SDL_PixelFormat *format;
+
+  if (!SDL_WasInit(SDL_INIT_VIDEO))
+  {
+    SDL_Init(SDL_INIT_EVERYTHING);
+  }
+
+  fb->surface = SDL_SetVideoMode(width, height, fb->depth, SDL_SWSURFACE);
+  SDL_WM_SetCaption("Raspberry Pi Emulator", NULL);
+
+  /* Rows are converted straight to 32 bit windows */
+  fb->convert = NULL;
+  if (!fb->surface)
+  {
+    return;
+  }
+
+  format = fb->surface->format;
+  if (format->BytesPerPixel == 4 &&
+      !format->Rloss && !format->Gloss && !format->Bloss)
+  {
+    fb->format.rshift = format->Rshift;
+    fb->format.gshift = format->Gshift;
+    fb->format.bshift = format->Bshift;
+    fb->format.alpha = format->Amask;
+    fb->convert = pixel_select(bpp);
+  }
+}
+
+static inline void
+fb_surface_lock(framebuffer_t* fb)
+{
+  if (SDL_MUSTLOCK(fb->surface))
+  {
+    SDL_LockSurface(fb->surface);
+  }
+}
+
+static inline void
+fb_surface_unlock(framebuffer_t* fb)
+{
+  if (SDL_MUSTLOCK(fb->surface))
+  {
+    SDL_UnlockSurface(fb->surface);
+  }
+}
+
+static inline void
+fb_surface_flip(framebuffer_t* fb, uint32_t UNUSED(first),
+                uint32_t UNUSED(count))
+{
+  SDL_Flip(fb->surface);
+}
+
+/**
+ * Closes the window
+ * @param fb Reference to the framebuffer structure
+ */
+static void
+fb_surface_close(framebuffer_t* fb)
+{
+  SDL_FreeSurface(fb->surface);
+  SDL_Quit();
+  fb->surface = NULL;
+}
+
+/**
+ * Waits a little while the emulator produces no frames
+ */
+static inline void
+fb_idle()
+{
+  SDL_Delay(1);
+}
+#endif
+
 /**
  * Gets the specified pixel colour at a particular location and converts
  * it to the output format.
  *
- * @param fb Reference to the framebuffer structure
+ * @param fb    Reference to the framebuffer structure
+ * @param frame Frame being presented, NULL if there is none yet
  * @param x X position
  * @param y Y position
  */
-uint32_t fb_get_pixel(framebuffer_t* fb, uint32_t x, uint32_t y)
+uint32_t fb_get_pixel(framebuffer_t* fb, const fb_frame_t* frame, uint32_t x,
+                      uint32_t y)
 {
   assert(fb);
 
-  if (!fb->framebuffer)
+  if (!frame)
   {
-    return SDL_MapRGB(fb->surface->format, 0xff, 0x00, 0xff);
+    return fb_map_rgb(fb, 0xff, 0x00, 0xff);
   }
 
-  switch (fb->fb_bpp)
+  switch (frame->bpp)
   {
     case 1: // 1 byte per pixel - 8 bit colour
     {
-      uint8_t key = fb->framebuffer[y * fb->fb_pitch + x * fb->fb_bpp];
-      uint16_t value = fb->fb_palette[key];
+      uint8_t key = frame->pixels[y * frame->pitch + x * frame->bpp];
+      uint16_t value = frame->palette[key];
 
       /* Format: RRRRRGGGGGGBBBBB */
       uint32_t r = (value >> 11) & 0x1F;
@@ -143,13 +449,13 @@ uint32_t fb_get_pixel(framebuffer_t* fb, uint32_t x, uint32_t y)
       b = (b * 255) / 31;
 
       /* Return colour */
-      return SDL_MapRGB(fb->surface->format, r, g, b);
+      return fb_map_rgb(fb, r, g, b);
     }
     case 2: // 2 bytes per pixel - R5G6B5
     {
       uint16_t value =
-        fb->framebuffer[y * fb->fb_pitch + x * fb->fb_bpp] +
-        (fb->framebuffer[y * fb->fb_pitch + x * fb->fb_bpp + 1] << 8);
+        frame->pixels[y * frame->pitch + x * frame->bpp] +
+        (frame->pixels[y * frame->pitch + x * frame->bpp + 1] << 8);
 
       /* Format: BBBBBGGGGGGRRRRR */
       uint32_t r = value & 0x1F;
@@ -162,19 +468,20 @@ uint32_t fb_get_pixel(framebuffer_t* fb, uint32_t x, uint32_t y)
       b = (b * 255) / 31;
 
       /* Return colour */
-      return SDL_MapRGB(fb->surface->format, r, g, b);
+      return fb_map_rgb(fb, r, g, b);
     }
     case 3: // 3 bytes per pixel - RGB8
     case 4: // 4 bytes per pixel - XRGB8
     {
+      /* The fourth byte is not read, the last pixel of a 24 bit buffer
+       * might end the SDRAM */
       uint32_t value =
-        fb->framebuffer[y * fb->fb_pitch + x * fb->fb_bpp] +
-        (fb->framebuffer[y * fb->fb_pitch + x * fb->fb_bpp + 1] << 8) +
-        (fb->framebuffer[y * fb->fb_pitch + x * fb->fb_bpp + 2] << 16) +
-        (fb->framebuffer[y * fb->fb_pitch + x * fb->fb_bpp + 3] << 24);
+        frame->pixels[y * frame->pitch + x * frame->bpp] +
+        (frame->pixels[y * frame->pitch + x * frame->bpp + 1] << 8) +
+        (frame->pixels[y * frame->pitch + x * frame->bpp + 2] << 16);
 
       /* Format: BBBBBBBBGGGGGGGGRRRRRRRR */
-      return SDL_MapRGB(fb->surface->format,
+      return fb_map_rgb(fb,
         value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF);
     }
     default:
@@ -188,230 +495,670 @@ uint32_t fb_get_pixel(framebuffer_t* fb, uint32_t x, uint32_t y)
 }
 
 /**
- * Updates the display, displaying the framebuffer and handling events
+ * Draws a frame into the window. Only rows which changed are converted,
+ * unless frames were skipped or the layout changed.
  *
- * @param fb Reference to the framebuffer structure
+ * @param fb    Reference to the framebuffer structure
+ * @param frame Frame to be presented, NULL to clear the window
  */
-void
-fb_tick(framebuffer_t* fb)
+static void
+fb_present(framebuffer_t* fb, fb_frame_t* frame)
 {
-  assert(fb);
-  assert(fb->emu->graphics);
+  uint32_t width = 640, height = 480, first = 0, last = 0;
+  int full;
 
-  /* Handle all SDL events */
-  SDL_Event event;
-  while (SDL_PollEvent(&event))
+  /* Resize the window when the guest changes its framebuffer */
+  full = !frame || frame->seq != fb->shown + 1;
+  if (frame && (!fb->surface || fb->shown_bpp != frame->bpp ||
+                fb->surface->w != (int)frame->width ||
+                fb->surface->h != (int)frame->height))
+  {
+    fb_surface_open(fb, frame->width, frame->height, frame->bpp);
+    fb->shown_bpp = frame->bpp;
+    full = 1;
+
+    if (fb->convert)
+    {
+      pixel_palette(&fb->format, frame->palette);
+      memcpy(fb->shown_palette, frame->palette, sizeof(fb->shown_palette));
+    }
+  }
+
+  if (!fb->surface)
+  {
+    return;
+  }
+
+  /* A new palette changes every pixel */
+  if (frame && frame->bpp == 1 &&
+      memcmp(fb->shown_palette, frame->palette, sizeof(fb->shown_palette)))
   {
-    if (event.type == SDL_QUIT)
+    pixel_palette(&fb->format, frame->palette);
+    memcpy(fb->shown_palette, frame->palette, sizeof(fb->shown_palette));
+    full = 1;
+  }
+
+  if (frame)
+  {
+    width = frame->width;
+    height = frame->height;
+    fb->shown = frame->seq;
+  }
+
+  fb_surface_lock(fb);
+
+  /* Copy the rows which changed to the window */
+  for (uint32_t y = 0; y < height; ++y)
+  {
+    if (!full && !frame->rows[y])
+    {
+      continue;
+    }
+
+    /* Rows [first, last) are handed to the window */
+    if (first == last)
+    {
+      first = y;
+    }
+    last = y + 1;
+
+    if (frame && fb->convert)
+    {
+      fb->convert(&fb->format,
+                  (uint32_t*)((uint8_t*)fb->surface->pixels +
+                              y * fb->surface->pitch),
+                  frame->pixels + y * frame->pitch, width);
+      continue;
+    }
+
+    for (uint32_t x = 0; x < width; ++x)
     {
-      fb->emu->terminated = 1;
+      put_pixel(fb->surface, x, y, fb_get_pixel(fb, frame, x, y));
     }
+  }
+
+  fb_surface_unlock(fb);
+  fb_surface_flip(fb, first, last - first);
+}
 
-    /* Route keyboard presses to the NES module if enabled */
-    if (event.type == SDL_KEYDOWN)
+/**
+ * Applies an input event on the emulator thread
+ *
+ * @param fb    Reference to the framebuffer structure
+ * @param event Event forwarded by the display thread
+ */
+static void
+fb_handle(framebuffer_t* fb, const fb_event_t* event)
+{
+  if (event->type == INPUT_QUIT)
+  {
+    fb->emu->terminated = 1;
+  }
+
+  /* Route keyboard presses to the NES module if enabled */
+  if (event->type == INPUT_KEY_DOWN)
+  {
+    switch (event->key)
     {
-      switch (event.key.keysym.sym)
+      case INPUT_KEY_1 ... INPUT_KEY_9:
       {
-        case SDLK_1 ... SDLK_9:
-        {
-          int port = (int)event.key.keysym.sym - SDLK_1;
-          fb->emu->gpio.ports[fb->emu->gpio_test_offset + port].state = 1;
-          break;
-        }
-        default:
+        int port = (int)event->key - INPUT_KEY_1;
+        fb->emu->gpio.ports[fb->emu->gpio_test_offset + port].state = 1;
+        break;
+      }
+      default:
+      {
+        if (fb->emu->nes_enabled)
         {
-          if (fb->emu->nes_enabled)
-          {
-            nes_on_key_down(&fb->emu->nes, event.key.keysym.sym);
-          }
-          break;
+          nes_on_key_down(&fb->emu->nes, event->key);
         }
+        break;
       }
     }
-    else if (event.type == SDL_KEYUP)
+  }
+  else if (event->type == INPUT_KEY_UP)
+  {
+    switch (event->key)
     {
-      switch (event.key.keysym.sym)
+      case INPUT_KEY_1 ... INPUT_KEY_9:
       {
-        case SDLK_1 ... SDLK_9:
-        {
-          int port = (int)event.key.keysym.sym - SDLK_1;
-          fb->emu->gpio.ports[fb->emu->gpio_test_offset + port].state = 0;
-          break;
-        }
-        default:
+        int port = (int)event->key - INPUT_KEY_1;
+        fb->emu->gpio.ports[fb->emu->gpio_test_offset + port].state = 0;
+        break;
+      }
+      default:
+      {
+        if (fb->emu->nes_enabled)
         {
-          if (fb->emu->nes_enabled)
-          {
-            nes_on_key_up(&fb->emu->nes, event.key.keysym.sym);
-          }
-          break;
+          nes_on_key_up(&fb->emu->nes, event->key);
         }
+        break;
       }
     }
   }
+}
 
-  /* Lock the surface */
-  if (SDL_MUSTLOCK(fb->surface))
+/**
+ * Takes a frame from the emulator, if there is a new one
+ * @param fb Reference to the framebuffer structure
+ * @return Frame to be presented or NULL
+ */
+static fb_frame_t*
+fb_take(framebuffer_t* fb)
+{
+  uint32_t ready;
+
+  if (!(__atomic_load_n(&fb->ready, __ATOMIC_ACQUIRE) & FB_FRESH))
   {
-    SDL_LockSurface(fb->surface);
+    return NULL;
   }
 
-  /* Copy the pixels to SDL */
-  for (uint32_t y = 0; y < fb->height; ++y)
+  ready = __atomic_exchange_n(&fb->ready, fb->front, __ATOMIC_ACQ_REL);
+  fb->front = ready & ~FB_FRESH;
+  return &fb->frames[fb->front];
+}
+
+/**
+ * Hands the back frame to the display thread, taking the shared one in
+ * exchange. Frames which were never presented are simply overwritten.
+ * @param fb Reference to the framebuffer structure
+ */
+static void
+fb_publish(framebuffer_t* fb)
+{
+  uint32_t ready;
+
+  ready = __atomic_exchange_n(&fb->ready, fb->back | FB_FRESH,
+                              __ATOMIC_ACQ_REL);
+  fb->back = ready & ~FB_FRESH;
+}
+
+#ifdef PIEMU_HEADLESS
+/**
+ * Headless builds have no input
+ */
+static inline void
+fb_poll(framebuffer_t* UNUSED(fb))
+{
+}
+
+/**
+ * Writes a converted frame to a binary PPM file named after its number
+ * @param fb    Reference to the framebuffer structure
+ * @param frame Frame being recorded
+ */
+static void
+fb_record_dump(framebuffer_t* fb, const fb_frame_t* frame)
+{
+  uint32_t pixel, x, y;
+  uint8_t *row;
+  char name[32];
+  FILE *file;
+
+  snprintf(name, sizeof(name), "frame%06u.ppm", frame->seq);
+  if (!(file = fopen(name, "wb")))
   {
-    for (uint32_t x = 0; x < fb->width; ++x)
-    {
-      put_pixel(fb->surface, x, y, fb_get_pixel(fb, x, y));
-    }
+    fprintf(stderr, "Cannot write %s\n", name);
+    return;
   }
 
-  /* Unlock the surface */
-  if (SDL_MUSTLOCK(fb->surface))
+  row = (uint8_t*)malloc(frame->width * 3 + 1);
+  assert(row);
+
+  fprintf(file, "P6\n%u %u\n255\n", frame->width, frame->height);
+  for (y = 0; y < frame->height; ++y)
   {
-    SDL_UnlockSurface(fb->surface);
+    for (x = 0; x < frame->width; ++x)
+    {
+      pixel = fb->record[y * frame->width + x];
+      row[x * 3 + 0] = (pixel >> 16) & 0xFF;
+      row[x * 3 + 1] = (pixel >> 8) & 0xFF;
+      row[x * 3 + 2] = pixel & 0xFF;
+    }
+    fwrite(row, 3, frame->width, file);
   }
 
-  /* Display to screen */
-  SDL_Flip(fb->surface);
+  free(row);
+  fclose(file);
 }
 
 /**
- * Handles a framebuffer request received through the mailbox interface
- *
- * @param fb   Framebuffer structure
- * @param addr Address received from the mailbox
+ * Prints the FNV-1a hash of a frame and dumps every few frames, if these
+ * were requested on the command line. Runs on the emulator thread once per
+ * published frame, so frames the display skips are recorded as well.
+ * @param fb    Reference to the framebuffer structure
+ * @param frame Frame about to be published
  */
-void
-fb_request(framebuffer_t *fb, uint32_t addr)
+static void
+fb_record(framebuffer_t* fb, const fb_frame_t* frame)
 {
-  size_t i;
-  framebuffer_req_t req;
+  uint32_t hash = 2166136261u, x, y, *row;
+  pixel_convert_t convert;
+  const uint8_t *bytes;
+  size_t size, i;
+  int dump;
 
-  assert(fb);
+  dump = fb->emu->frame_dump && frame->seq % fb->emu->frame_dump == 0;
+  if (!fb->emu->frame_hash && !dump)
+  {
+    return;
+  }
 
-  /* Clear error flag */
-  fb->error = 0;
+  size = (size_t)frame->width * frame->height;
+  if (fb->record_size < size)
+  {
+    free(fb->record);
+    fb->record = (uint32_t*)malloc(size * sizeof(uint32_t));
+    assert(fb->record);
+    fb->record_size = size;
+  }
 
-  /* Graphic flag must be set*/
-  if (!fb->emu->graphics)
+  /* Convert to XRGB, as the window would show it */
+  convert = pixel_select(frame->bpp);
+  fb->record_format.rshift = 16;
+  fb->record_format.gshift = 8;
+  fb->record_format.bshift = 0;
+  fb->record_format.alpha = 0;
+  if (frame->bpp == 1)
   {
-    emulator_error(fb->emu, "Graphic mode must be enabled for framebuffer");
-    fb->error = 1;
-    return;
+    pixel_palette(&fb->record_format, frame->palette);
+  }
+  for (y = 0; y < frame->height; ++y)
+  {
+    row = fb->record + y * frame->width;
+    if (convert)
+    {
+      convert(&fb->record_format, row, frame->pixels + y * frame->pitch,
+              frame->width);
+      continue;
+    }
+    for (x = 0; x < frame->width; ++x)
+    {
+      row[x] = fb_get_pixel(fb, frame, x, y);
+    }
   }
 
-  /* Check whether address is valid */
-  if (addr < 0x40000000)
+  if (fb->emu->frame_hash)
+  {
+    bytes = (const uint8_t*)fb->record;
+    for (i = 0; i < size * sizeof(uint32_t); ++i)
+    {
+      hash = (hash ^ bytes[i]) * 16777619u;
+    }
+
+    printf("frame %u %ux%u %08x\n", frame->seq, frame->width, frame->height,
+           hash);
+  }
+
+  if (dump)
+  {
+    fb_record_dump(fb, frame);
+  }
+}
+#else
+/**
+ * Queues an input event for the emulator. Events are dropped if the ring is
+ * full because the emulator does not keep up.
+ * @param fb   Reference to the framebuffer structure
+ * @param type Kind of event
+ * @param key  Key pressed or released
+ */
+static void
+fb_queue(framebuffer_t* fb, input_type_t type, input_key_t key)
+{
+  fb_event_t *slot;
+  uint32_t head;
+
+  head = fb->event_head;
+  if (head - __atomic_load_n(&fb->event_tail, __ATOMIC_ACQUIRE) >= FB_EVENTS)
   {
-    emulator_error(fb->emu, "Invalid framebuffer address");
-    fb->error = 1;
     return;
   }
 
-  /* Respond to the framebuffer request */
-  addr -= 0x40000000;
-  for (i = 0; i < sizeof(req.data) / sizeof(req.data[0]); ++i)
+  slot = &fb->events[head & (FB_EVENTS - 1)];
+  slot->type = type;
+  slot->key = key;
+  slot->time = emulator_get_system_timer(fb->emu);
+  __atomic_store_n(&fb->event_head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Translates SDL keys to the keys of the emulator
+ * @param key SDL key
+ * @return Emulator key, INPUT_KEY_NONE if it is not used
+ */
+static input_key_t
+fb_key(int key)
+{
+  switch (key)
   {
-    req.data[i] = memory_read_dword_le(&fb->emu->memory, addr + (i << 2));
+    case SDLK_1 ... SDLK_9: return INPUT_KEY_1 + (key - SDLK_1);
+    case SDLK_SPACE:        return INPUT_KEY_SPACE;
+    case SDLK_TAB:          return INPUT_KEY_TAB;
+    case SDLK_RETURN:       return INPUT_KEY_RETURN;
+    case SDLK_p:            return INPUT_KEY_P;
+    case SDLK_w:            return INPUT_KEY_W;
+    case SDLK_a:            return INPUT_KEY_A;
+    case SDLK_s:            return INPUT_KEY_S;
+    case SDLK_d:            return INPUT_KEY_D;
+    default:                return INPUT_KEY_NONE;
   }
+}
+
+/**
+ * Forwards the pending window events to the emulator
+ * @param fb Reference to the framebuffer structure
+ */
+static void
+fb_poll(framebuffer_t* fb)
+{
+  SDL_Event event;
 
-  /* Free old framebuffer */
-  if (fb->framebuffer)
+  while (SDL_PollEvent(&event))
   {
-    free(fb->framebuffer);
-    fb->framebuffer = NULL;
+    switch (event.type)
+    {
+      case SDL_QUIT:
+      {
+        fb_queue(fb, INPUT_QUIT, INPUT_KEY_NONE);
+        break;
+      }
+      case SDL_KEYDOWN:
+      {
+        fb_queue(fb, INPUT_KEY_DOWN, fb_key(event.key.keysym.sym));
+        break;
+      }
+      case SDL_KEYUP:
+      {
+        fb_queue(fb, INPUT_KEY_UP, fb_key(event.key.keysym.sym));
+        break;
+      }
+#ifdef PIEMU_SDL2
+      case SDL_WINDOWEVENT:
+      {
+        /* Redraw after the window was exposed or resized */
+        fb_surface_render(fb);
+        break;
+      }
+#endif
+    }
   }
+}
+#endif
 
-  /* Read palette if 8 bit colour
-   * We're assuming that the palette comes immediately after the request */
-  if (req.fb.depth == 8)
+/**
+ * Creates the window, then presents and exports frames and forwards input
+ * until the emulator stops. Runs on its own thread.
+ * @param opaque Reference to the framebuffer structure
+ */
+static void*
+fb_display(void* opaque)
+{
+  framebuffer_t* fb = (framebuffer_t*)opaque;
+  fb_frame_t *frame;
+  int stop;
+
+  /* Create the window */
+  fb_surface_open(fb, 640, 480, 0);
+  fb_present(fb, NULL);
+
+  while (1)
   {
-    for (i = 0; i < 256; ++i)
+    /* Frames published before the stop request are still presented */
+    stop = __atomic_load_n(&fb->stop, __ATOMIC_ACQUIRE);
+
+    fb_poll(fb);
+
+    if ((frame = fb_take(fb)))
+    {
+      fb_present(fb, frame);
+      share_frame(&fb->emu->share, frame);
+    }
+    else if (stop)
+    {
+      break;
+    }
+    else
     {
-      fb->fb_palette[i] = memory_read_word_le(&fb->emu->memory, addr + sizeof(req) + i * 2);
+      fb_idle();
     }
   }
 
-  /* Allocate a nice frame buffer, placed after the main memory */
-  fb->fb_bpp = req.fb.depth >> 3;
-  fb->fb_pitch = req.fb.virt_width * fb->fb_bpp;
-  req.fb.pitch = fb->fb_pitch + (4 - (fb->fb_pitch % 4)) % 4;
-  req.fb.size = fb->fb_size = fb->fb_pitch * req.fb.virt_height;
-  fb->framebuffer = malloc(fb->fb_size);
-  req.fb.addr = fb->fb_address = fb->emu->mem_size;
-  fb->width = req.fb.virt_width;
-  fb->height = req.fb.virt_height;
+  fb_surface_close(fb);
+  return NULL;
+}
 
-  assert(fb->framebuffer);
-  memset(fb->framebuffer, 0, fb->fb_size);
+/**
+ * Initialises the framebuffer interface
+ * @param fb  Reference to the framebuffer structure
+ * @param emu Reference to the emulator structure
+ */
+void
+fb_init(framebuffer_t* fb, emulator_t* emu)
+{
+  assert(fb);
+  assert(emu);
 
-  /* Write back structure into memory */
-  for (i = 0; i < sizeof(req.data) / sizeof(req.data[0]); ++i)
+  fb->emu = emu;
+
+  /* If not in graphic mode, do not create a window */
+  if (!fb->emu->graphics)
   {
-    memory_write_dword_le(&fb->emu->memory, addr + (i << 2), req.data[i]);
+    return;
   }
 
-  /* Change the window caption */
-  SDL_WM_SetCaption("Raspberry Pi Emulator", NULL);
+  fb->depth = 32;
+  fb->back = 0;
+  fb->ready = 1;
+  fb->front = 2;
+  fb->seq = 0;
+  fb->shown = 0;
+  fb->shown_bpp = 0;
+  fb->stop = 0;
+  fb->event_head = 0;
+  fb->event_tail = 0;
+#ifdef PIEMU_HEADLESS
+  fb->record = NULL;
+  fb->record_size = 0;
+#endif
+
+  /* The window is created and updated by the display thread */
+  if (pthread_create(&fb->thread, NULL, fb_display, fb) != 0)
+  {
+    emulator_fatal(emu, "Cannot start the display thread");
+  }
+  fb->running = 1;
+}
 
-  /* Change the window size */
-  fb->surface = SDL_SetVideoMode(fb->width, fb->height, fb->depth, SDL_SWSURFACE);
+/**
+ * Cleans up memory used by the framebuffer
+ * @param fb  Reference to the framebuffer structure
+ */
+void
+fb_destroy(framebuffer_t* fb)
+{
+  size_t i;
+
+  /* Only set once the display thread started, possibly not at all if
+   * initialisation failed before fb_init */
+  if (!fb || !fb->running)
+  {
+    return;
+  }
+
+  /* Hand over the last frame, then wait for the display thread */
+  fb_tick(fb);
+  __atomic_store_n(&fb->stop, 1, __ATOMIC_RELEASE);
+  pthread_join(fb->thread, NULL);
+  fb->running = 0;
+
+  for (i = 0; i < FB_FRAMES; ++i)
+  {
+    free(fb->frames[i].pixels);
+    free(fb->frames[i].rows);
+    fb->frames[i].pixels = NULL;
+    fb->frames[i].rows = NULL;
+  }
+
+#ifdef PIEMU_HEADLESS
+  free(fb->record);
+  fb->record = NULL;
+  fb->record_size = 0;
+#endif
+
+  /* The framebuffer is part of SDRAM */
+  fb->framebuffer = NULL;
 }
 
+/**
+ * Applies the input events received by the display thread. Called between
+ * batches, so it only costs an atomic load when there is no input.
+ *
+ * @param fb Reference to the framebuffer structure
+ */
 void
-fb_write_word(framebuffer_t* fb, uint32_t address, uint16_t data)
+fb_input(framebuffer_t* fb)
 {
-  uint32_t addr;
+  uint32_t head, tail;
 
-  assert(fb);
-  assert(fb->emu->graphics);
-  assert(fb->framebuffer);
+  head = __atomic_load_n(&fb->event_head, __ATOMIC_ACQUIRE);
+  for (tail = fb->event_tail; tail != head; ++tail)
+  {
+    fb_handle(fb, &fb->events[tail & (FB_EVENTS - 1)]);
+  }
 
-  addr = address - fb->fb_address;
-  fb->framebuffer[addr + 0] = (data >> 0) & 0xFF;
-  fb->framebuffer[addr + 1] = (data >> 8) & 0xFF;
+  __atomic_store_n(&fb->event_tail, tail, __ATOMIC_RELEASE);
 }
 
 /**
- * Handles a write to framebuffer data
+ * Hands a copy of the framebuffer over to be presented if the guest wrote
+ * it. The emulator never waits for the display.
  *
- * @param fb      Framebuffer structure
- * @param address Address of the pixel
- * @param data    Data to be written to the buffer
+ * @param fb Reference to the framebuffer structure
  */
 void
-fb_write_dword(framebuffer_t* fb, uint32_t address, uint32_t data)
+fb_tick(framebuffer_t* fb)
 {
-  uint32_t addr;
+  memory_t *memory = &fb->emu->memory;
+  fb_frame_t *frame;
+  uint32_t i;
 
   assert(fb);
   assert(fb->emu->graphics);
-  assert(fb->framebuffer);
 
-  addr = address - fb->fb_address;
-  fb->framebuffer[addr + 0] = (data >> 0) & 0xFF;
-  fb->framebuffer[addr + 1] = (data >> 8) & 0xFF;
-  fb->framebuffer[addr + 2] = (data >> 16) & 0xFF;
-  fb->framebuffer[addr + 3] = (data >> 24) & 0xFF;
+  /* Nothing to do if the guest did not write the framebuffer */
+  if (!fb->framebuffer ||
+      !memory_is_dirty(memory, fb->fb_address, fb->fb_size))
+  {
+    return;
+  }
+
+  /* Make room in the back frame */
+  frame = &fb->frames[fb->back];
+  if (frame->size < fb->fb_size)
+  {
+    free(frame->pixels);
+    frame->pixels = (uint8_t*)malloc(fb->fb_size);
+    assert(frame->pixels);
+    frame->size = fb->fb_size;
+  }
+  if (frame->row_count < fb->height)
+  {
+    free(frame->rows);
+    frame->rows = (uint8_t*)malloc(fb->height);
+    assert(frame->rows);
+    frame->row_count = fb->height;
+  }
+
+  /* Copy the framebuffer, noting the rows which changed */
+  for (i = 0; i < fb->height; ++i)
+  {
+    frame->rows[i] = memory_is_dirty(memory, fb->fb_address + i * fb->fb_pitch,
+                                     fb->fb_pitch);
+  }
+  memcpy(frame->pixels, fb->framebuffer, fb->fb_size);
+  memcpy(frame->palette, fb->fb_palette, sizeof(frame->palette));
+  memory_clean(memory);
+
+  frame->seq = ++fb->seq;
+  frame->width = fb->width;
+  frame->height = fb->height;
+  frame->bpp = fb->fb_bpp;
+  frame->pitch = fb->fb_pitch;
+#ifdef PIEMU_HEADLESS
+  fb_record(fb, frame);
+#endif
+  fb_publish(fb);
 }
 
 /**
- * Checks whether an address is in the memory range of the framebuffer
+ * Handles a framebuffer request received through the mailbox interface
  *
- * @param fb      Framebuffer structure
- * @param address Query address
- * @return        True if address is in range
+ * @param fb   Framebuffer structure
+ * @param addr Address received from the mailbox
  */
-int
-fb_is_buffer(framebuffer_t *fb, uint32_t address)
+void
+fb_request(framebuffer_t *fb, uint32_t addr)
 {
+  framebuffer_req_t req;
+
   assert(fb);
 
-  /* Graphic mode must be enabled */
+  /* Clear error flag */
+  fb->error = 0;
+
+  /* Graphic flag must be set*/
   if (!fb->emu->graphics)
   {
-    return 0;
+    emulator_error(fb->emu, "Graphic mode must be enabled for framebuffer");
+    fb->error = 1;
+    return;
   }
 
-  return fb->fb_address <= address && address < fb->fb_address + fb->fb_size;
+  /* Check whether address is valid */
+  if (addr < 0x40000000)
+  {
+    emulator_error(fb->emu, "Invalid framebuffer address");
+    fb->error = 1;
+    return;
+  }
+
+  /* Respond to the framebuffer request */
+  addr -= 0x40000000;
+  memory_read_block(&fb->emu->memory, addr, req.data, sizeof(req.data));
+
+  /* Read palette if 8 bit colour
+   * We're assuming that the palette comes immediately after the request */
+  if (req.fb.depth == 8)
+  {
+    memory_read_block(&fb->emu->memory, addr + sizeof(req), fb->fb_palette,
+                      sizeof(fb->fb_palette));
+  }
+
+  /* Carve the frame buffer out of the top of SDRAM, like the memory split
+   * of the GPU does, so guest stores to it are plain memory writes */
+  fb->fb_bpp = req.fb.depth >> 3;
+  fb->fb_pitch = req.fb.virt_width * fb->fb_bpp;
+  if (fb->fb_pitch * req.fb.virt_height > fb->emu->mem_size)
+  {
+    emulator_error(fb->emu, "Not enough memory for framebuffer");
+    memory_watch(&fb->emu->memory, 0, 0);
+    fb->framebuffer = NULL;
+    fb->error = 1;
+    return;
+  }
+
+  req.fb.pitch = fb->fb_pitch + (4 - (fb->fb_pitch % 4)) % 4;
+  req.fb.size = fb->fb_size = fb->fb_pitch * req.fb.virt_height;
+  req.fb.addr = fb->fb_address = (fb->emu->mem_size - fb->fb_size) & ~0xFFF;
+  fb->framebuffer = fb->emu->memory.data + fb->fb_address;
+  fb->width = req.fb.virt_width;
+  fb->height = req.fb.virt_height;
+  memory_fill(&fb->emu->memory, fb->fb_address, 0, fb->fb_size);
+
+  /* Stores to the framebuffer mark the rows to be presented */
+  memory_watch(&fb->emu->memory, fb->fb_address, fb->fb_size);
+
+  /* Write back structure into memory */
+  memory_write_block(&fb->emu->memory, addr, req.data, sizeof(req.data));
 }
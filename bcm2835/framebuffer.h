@@ -26,6 +26,72 @@ typedef union
   } fb;
 } framebuffer_req_t;
 
+/**
+ * Number of frames exchanged between the emulator and the display thread
+ */
+#define FB_FRAMES 3
+
+/**
+ * Set in the index of the shared frame if it was not presented yet
+ */
+#define FB_FRESH  0x4
+
+/**
+ * Size of the input event ring, a power of two
+ */
+#define FB_EVENTS 64
+
+/**
+ * Copy of the guest framebuffer handed to the display thread
+ */
+typedef struct
+{
+  /* Pixels and the rows which changed since the previous frame */
+  uint8_t*      pixels;
+  size_t        size;
+  uint8_t*      rows;
+  uint32_t      row_count;
+
+  /* Frame number and layout of the guest framebuffer */
+  uint32_t      seq;
+  uint32_t      width;
+  uint32_t      height;
+  size_t        bpp;
+  size_t        pitch;
+  uint16_t      palette[256];
+} fb_frame_t;
+
+/**
+ * Input event forwarded from the display thread
+ */
+typedef struct
+{
+  input_type_t  type;
+  input_key_t   key;
+  uint64_t      time;   /* Value of the system timer when it was received */
+} fb_event_t;
+
+#if defined(PIEMU_HEADLESS) || defined(PIEMU_SDL2)
+/**
+ * 32 bit XRGB surface in memory. Headless builds render into it instead of
+ * a window, SDL 2 builds upload it to a streaming texture.
+ */
+typedef struct
+{
+  int           w;
+  int           h;
+  int           pitch;
+  void*         pixels;
+#ifdef PIEMU_SDL2
+  SDL_Window*   window;
+  SDL_Renderer* renderer;
+  SDL_Texture*  texture;
+#endif
+} fb_surface_t;
+#else
+typedef SDL_Surface fb_surface_t;
+#endif
+
 /**
  * Framebuffer data
  */
@@ -45,21 +111,56 @@ typedef struct
   /* Flag if set if query is malformed */
   int           error;
 
-  /* Window */
-  SDL_Surface*  surface;
+  /* Guest framebuffer size */
   uint32_t      width;
   uint32_t      height;
+
+  /* Triple buffer. The emulator fills the back frame, the display thread
+   * presents the front one and they swap through ready, which holds an
+   * index and FB_FRESH. Only ready is shared. */
+  fb_frame_t    frames[FB_FRAMES];
+  uint32_t      back;
+  uint32_t      ready;
+  uint32_t      front;
+  uint32_t      seq;
+
+  /* Display thread, which owns the window */
+  pthread_t     thread;
+  int           running;
+  int           stop;
+
+  /* Window state, only touched by the display thread */
+  fb_surface_t* surface;
   uint32_t      depth;
+  uint32_t      shown;
+  size_t        shown_bpp;
+  uint16_t      shown_palette[256];
+
+  /* Row conversion to the window, NULL if the window is not 32 bit */
+  pixel_format_t format;
+  pixel_convert_t convert;
+
+#ifdef PIEMU_HEADLESS
+  /* Frames converted to XRGB for --frame-hash and --frame-dump, only
+   * touched by the emulator thread */
+  uint32_t*     record;
+  size_t        record_size;
+  pixel_format_t record_format;
+#endif
+
+  /* Single producer, single consumer ring of input events. The display
+   * thread only advances head, the emulator only advances tail. */
+  fb_event_t    events[FB_EVENTS];
+  uint32_t      event_head;
+  uint32_t      event_tail;
 } framebuffer_t;
 
 void fb_init(framebuffer_t*, emulator_t*);
 void fb_create_window(framebuffer_t*, uint32_t width, uint32_t height);
 void fb_destroy(framebuffer_t*);
 void fb_tick(framebuffer_t*);
+void fb_input(framebuffer_t*);
 void fb_dump(framebuffer_t*);
 void fb_request(framebuffer_t*, uint32_t address);
-void fb_write_word(framebuffer_t*, uint32_t address, uint16_t data);
-void fb_write_dword(framebuffer_t*, uint32_t address, uint32_t data);
-int  fb_is_buffer(framebuffer_t*, uint32_t address);
 
 #endif /* __FRAMEBUFFER_H__ */
@@ -4,6 +4,44 @@
  */
 #include "common.h"
 
+/**
+ * Reads a GPIO register on behalf of the memory module
+ * @param opaque Reference to the gpio structure
+ * @param addr   Register address
+ * @param data   Value of the register
+ * @return Nonzero if the address is a GPIO port
+ */
+static int
+gpio_mmio_read(void* opaque, uint32_t addr, uint32_t* data)
+{
+  if (!gpio_is_port(addr))
+  {
+    return 0;
+  }
+
+  *data = gpio_read_port((gpio_t*)opaque, addr);
+  return 1;
+}
+
+/**
+ * Writes a GPIO register on behalf of the memory module
+ * @param opaque Reference to the gpio structure
+ * @param addr   Register address
+ * @param data   Value to be written
+ * @return Nonzero if the address is a GPIO port
+ */
+static int
+gpio_mmio_write(void* opaque, uint32_t addr, uint32_t data)
+{
+  if (!gpio_is_port(addr))
+  {
+    return 0;
+  }
+
+  gpio_write_port((gpio_t*)opaque, addr, data);
+  return 1;
+}
+
 /**
  * Initialises memory for the gpio registers
  * @param gpio Reference to the gpio structure
@@ -21,6 +59,9 @@ gpio_init(gpio_t* gpio, emulator_t* emu)
   gpio->ports = (gpio_port_t*)malloc(size);
   assert(gpio->ports);
   memset(gpio->ports, 0, size);
+
+  memory_register(&emu->memory, GPIO_BASE, 0x1000, gpio,
+                  gpio_mmio_read, gpio_mmio_write, NULL);
 }
 
 /**
@@ -4,6 +4,44 @@
  */
 #include "common.h"
 
+/**
+ * Reads a mailbox port on behalf of the memory module
+ * @param opaque Mailbox structure
+ * @param addr   Port address
+ * @param data   Value of the port
+ * @return Nonzero if the address is a mailbox port
+ */
+static int
+mbox_mmio_read(void* opaque, uint32_t addr, uint32_t* data)
+{
+  if (!mbox_is_port(addr))
+  {
+    return 0;
+  }
+
+  *data = mbox_read((mbox_t*)opaque, addr);
+  return 1;
+}
+
+/**
+ * Writes a mailbox port on behalf of the memory module
+ * @param opaque Mailbox structure
+ * @param addr   Port address
+ * @param data   Value to be written
+ * @return Nonzero if the address is a mailbox port
+ */
+static int
+mbox_mmio_write(void* opaque, uint32_t addr, uint32_t data)
+{
+  if (!mbox_is_port(addr))
+  {
+    return 0;
+  }
+
+  mbox_write((mbox_t*)opaque, addr, data);
+  return 1;
+}
+
 /**
  * Initialises the mailbox
  */
@@ -12,6 +50,9 @@ mbox_init(mbox_t *mbox, emulator_t *emu)
 {
   mbox->emu = emu;
   mbox->last_channel = 0x0;
+
+  memory_register(&emu->memory, MBOX_BASE, MBOX_WRITE + 4 - MBOX_BASE, mbox,
+                  mbox_mmio_read, mbox_mmio_write, NULL);
 }
 
 /**
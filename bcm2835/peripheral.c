@@ -4,6 +4,44 @@
  */
 #include "common.h"
 
+/**
+ * Reads an auxiliary port on behalf of the memory module
+ * @param opaque Peripherials structure
+ * @param addr   Port address
+ * @param data   Value of the port
+ * @return Nonzero if the address is an auxiliary port
+ */
+static int
+pr_mmio_read(void* opaque, uint32_t addr, uint32_t* data)
+{
+  if (!pr_is_aux_port(addr))
+  {
+    return 0;
+  }
+
+  *data = pr_read((peripheral_t*)opaque, addr);
+  return 1;
+}
+
+/**
+ * Writes an auxiliary port on behalf of the memory module
+ * @param opaque Peripherials structure
+ * @param addr   Port address
+ * @param data   Value to be written
+ * @return Nonzero if the address is an auxiliary port
+ */
+static int
+pr_mmio_write(void* opaque, uint32_t addr, uint32_t data)
+{
+  if (!pr_is_aux_port(addr))
+  {
+    return 0;
+  }
+
+  pr_write((peripheral_t*)opaque, addr, data);
+  return 1;
+}
+
 /**
  * Initialises peripherials
  * @param pr    Peripherials structure
@@ -27,6 +65,9 @@ pr_init(peripheral_t* pr, emulator_t* emu)
   pr->uart_enable = 0;
   pr->uart_bits = 7;
   pr->uart_dlab = 0;
+
+  memory_register(&emu->memory, AUX_BASE, AUX_SPI1_CNTL1_REG + 4 - AUX_BASE,
+                  pr, pr_mmio_read, pr_mmio_write, NULL);
 }
 
 /**
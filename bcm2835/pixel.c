@@ -0,0 +1,346 @@
+/* This file is part of the Team 28 Project
+ * Licensing information can be found in the LICENSE file
+ * (C) 2014 The Team 28 Authors. All rights reserved.
+ */
+#include "common.h"
+
+#if defined(__x86_64__)
+#  include <immintrin.h>
+#endif
+
+/**
+ * Builds a host pixel out of 8 bit channels
+ * @param fmt Layout of host pixels
+ * @param r   Red channel
+ * @param g   Green channel
+ * @param b   Blue channel
+ * @return Host pixel
+ */
+static inline uint32_t
+pixel_map(const pixel_format_t* fmt, uint32_t r, uint32_t g, uint32_t b)
+{
+  return (r << fmt->rshift) | (g << fmt->gshift) | (b << fmt->bshift) |
+         fmt->alpha;
+}
+
+/**
+ * Converts the 8 bit palette, format RRRRRGGGGGGBBBBB, to host pixels
+ * @param fmt     Layout of host pixels
+ * @param palette Palette read from the framebuffer request
+ */
+void
+pixel_palette(pixel_format_t* fmt, const uint16_t* palette)
+{
+  uint32_t i, value;
+
+  for (i = 0; i < 256; ++i)
+  {
+    value = palette[i];
+    fmt->palette[i] = pixel_map(fmt,
+      PIXEL_EXPAND5((value >> 11) & 0x1F),
+      PIXEL_EXPAND6((value >> 5) & 0x3F),
+      PIXEL_EXPAND5(value & 0x1F));
+  }
+}
+
+/**
+ * Converts 8 bit palettised pixels through the host palette
+ */
+static void
+pixel_pal8(const pixel_format_t* fmt, uint32_t* dst, const uint8_t* src,
+           size_t count)
+{
+  size_t i;
+
+  for (i = 0; i < count; ++i)
+  {
+    dst[i] = fmt->palette[src[i]];
+  }
+}
+
+/**
+ * Converts 16 bit pixels, format BBBBBGGGGGGRRRRR
+ */
+static void
+pixel_rgb565(const pixel_format_t* fmt, uint32_t* dst, const uint8_t* src,
+             size_t count)
+{
+  uint32_t value;
+  size_t i;
+
+  for (i = 0; i < count; ++i)
+  {
+    value = src[(i << 1) + 0] | (src[(i << 1) + 1] << 8);
+    dst[i] = pixel_map(fmt,
+      PIXEL_EXPAND5(value & 0x1F),
+      PIXEL_EXPAND6((value >> 5) & 0x3F),
+      PIXEL_EXPAND5((value >> 11) & 0x1F));
+  }
+}
+
+/**
+ * Converts 24 bit pixels, red first
+ */
+static void
+pixel_rgb24(const pixel_format_t* fmt, uint32_t* dst, const uint8_t* src,
+            size_t count)
+{
+  size_t i;
+
+  for (i = 0; i < count; ++i)
+  {
+    dst[i] = pixel_map(fmt, src[i * 3 + 0], src[i * 3 + 1], src[i * 3 + 2]);
+  }
+}
+
+/**
+ * Converts 32 bit pixels, red first, ignoring the fourth byte
+ */
+static void
+pixel_rgb32(const pixel_format_t* fmt, uint32_t* dst, const uint8_t* src,
+            size_t count)
+{
+  size_t i;
+
+  for (i = 0; i < count; ++i)
+  {
+    dst[i] = pixel_map(fmt, src[(i << 2) + 0], src[(i << 2) + 1],
+                       src[(i << 2) + 2]);
+  }
+}
+
+#if defined(__x86_64__)
+/**
+ * Places 8 bit channels held in 32 bit lanes and stores four host pixels
+ */
+static inline void
+pixel_pack_sse2(const pixel_format_t* fmt, uint32_t* dst,
+                __m128i r, __m128i g, __m128i b)
+{
+  __m128i out;
+
+  out = _mm_or_si128(
+    _mm_or_si128(_mm_sll_epi32(r, _mm_cvtsi32_si128(fmt->rshift)),
+                 _mm_sll_epi32(g, _mm_cvtsi32_si128(fmt->gshift))),
+    _mm_or_si128(_mm_sll_epi32(b, _mm_cvtsi32_si128(fmt->bshift)),
+                 _mm_set1_epi32(fmt->alpha)));
+  _mm_storeu_si128((__m128i*)dst, out);
+}
+
+/**
+ * Converts 16 bit pixels, eight at a time
+ */
+static void
+pixel_rgb565_sse2(const pixel_format_t* fmt, uint32_t* dst,
+                  const uint8_t* src, size_t count)
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i v, r, g, b;
+  size_t i;
+
+  for (i = 0; i + 8 <= count; i += 8)
+  {
+    v = _mm_loadu_si128((const __m128i*)(src + (i << 1)));
+
+    /* Expand the channels in 16 bit lanes */
+    r = _mm_and_si128(v, _mm_set1_epi16(0x1F));
+    g = _mm_and_si128(_mm_srli_epi16(v, 5), _mm_set1_epi16(0x3F));
+    b = _mm_srli_epi16(v, 11);
+    r = _mm_srli_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(1053)), 7);
+    b = _mm_srli_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(1053)), 7);
+    g = _mm_add_epi16(_mm_slli_epi16(g, 2),
+      _mm_srli_epi16(_mm_mullo_epi16(g, _mm_set1_epi16(49)), 10));
+
+    pixel_pack_sse2(fmt, dst + i,
+      _mm_unpacklo_epi16(r, zero),
+      _mm_unpacklo_epi16(g, zero),
+      _mm_unpacklo_epi16(b, zero));
+    pixel_pack_sse2(fmt, dst + i + 4,
+      _mm_unpackhi_epi16(r, zero),
+      _mm_unpackhi_epi16(g, zero),
+      _mm_unpackhi_epi16(b, zero));
+  }
+
+  pixel_rgb565(fmt, dst + i, src + (i << 1), count - i);
+}
+
+/**
+ * Converts 32 bit pixels, four at a time
+ */
+static void
+pixel_rgb32_sse2(const pixel_format_t* fmt, uint32_t* dst,
+                 const uint8_t* src, size_t count)
+{
+  const __m128i mask = _mm_set1_epi32(0xFF);
+  __m128i v;
+  size_t i;
+
+  for (i = 0; i + 4 <= count; i += 4)
+  {
+    v = _mm_loadu_si128((const __m128i*)(src + (i << 2)));
+    pixel_pack_sse2(fmt, dst + i,
+      _mm_and_si128(v, mask),
+      _mm_and_si128(_mm_srli_epi32(v, 8), mask),
+      _mm_and_si128(_mm_srli_epi32(v, 16), mask));
+  }
+
+  pixel_rgb32(fmt, dst + i, src + (i << 2), count - i);
+}
+
+/**
+ * Places 8 bit channels held in 32 bit lanes and stores eight host pixels
+ */
+__attribute__((target("avx2")))
+static inline void
+pixel_pack_avx2(const pixel_format_t* fmt, uint32_t* dst,
+                __m256i r, __m256i g, __m256i b)
+{
+  __m256i out;
+
+  out = _mm256_or_si256(
+    _mm256_or_si256(_mm256_sll_epi32(r, _mm_cvtsi32_si128(fmt->rshift)),
+                    _mm256_sll_epi32(g, _mm_cvtsi32_si128(fmt->gshift))),
+    _mm256_or_si256(_mm256_sll_epi32(b, _mm_cvtsi32_si128(fmt->bshift)),
+                    _mm256_set1_epi32(fmt->alpha)));
+  _mm256_storeu_si256((__m256i*)dst, out);
+}
+
+/**
+ * Converts 16 bit pixels, eight at a time, in 32 bit lanes
+ */
+__attribute__((target("avx2")))
+static void
+pixel_rgb565_avx2(const pixel_format_t* fmt, uint32_t* dst,
+                  const uint8_t* src, size_t count)
+{
+  __m256i v, r, g, b;
+  size_t i;
+
+  for (i = 0; i + 8 <= count; i += 8)
+  {
+    v = _mm256_cvtepu16_epi32(
+      _mm_loadu_si128((const __m128i*)(src + (i << 1))));
+
+    r = _mm256_and_si256(v, _mm256_set1_epi32(0x1F));
+    g = _mm256_and_si256(_mm256_srli_epi32(v, 5), _mm256_set1_epi32(0x3F));
+    b = _mm256_srli_epi32(v, 11);
+    r = _mm256_srli_epi32(_mm256_mullo_epi32(r, _mm256_set1_epi32(1053)), 7);
+    b = _mm256_srli_epi32(_mm256_mullo_epi32(b, _mm256_set1_epi32(1053)), 7);
+    g = _mm256_add_epi32(_mm256_slli_epi32(g, 2),
+      _mm256_srli_epi32(_mm256_mullo_epi32(g, _mm256_set1_epi32(49)), 10));
+
+    pixel_pack_avx2(fmt, dst + i, r, g, b);
+  }
+
+  pixel_rgb565(fmt, dst + i, src + (i << 1), count - i);
+}
+
+/**
+ * Converts 24 bit pixels, eight at a time. Each half of the register gets
+ * four pixels, which are spread to 32 bit lanes by a byte shuffle.
+ */
+__attribute__((target("avx2")))
+static void
+pixel_rgb24_avx2(const pixel_format_t* fmt, uint32_t* dst,
+                 const uint8_t* src, size_t count)
+{
+  const __m256i mask = _mm256_set1_epi32(0xFF);
+  const __m256i spread = _mm256_setr_epi8(
+    0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+    0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  __m256i v;
+  size_t i;
+
+  /* Both loads read 16 bytes, so stop before they pass the end of the row */
+  for (i = 0; i + 10 <= count; i += 8)
+  {
+    v = _mm256_inserti128_si256(
+      _mm256_castsi128_si256(
+        _mm_loadu_si128((const __m128i*)(src + i * 3))),
+      _mm_loadu_si128((const __m128i*)(src + i * 3 + 12)), 1);
+    v = _mm256_shuffle_epi8(v, spread);
+
+    pixel_pack_avx2(fmt, dst + i,
+      _mm256_and_si256(v, mask),
+      _mm256_and_si256(_mm256_srli_epi32(v, 8), mask),
+      _mm256_srli_epi32(v, 16));
+  }
+
+  pixel_rgb24(fmt, dst + i, src + i * 3, count - i);
+}
+
+/**
+ * Converts 32 bit pixels, eight at a time
+ */
+__attribute__((target("avx2")))
+static void
+pixel_rgb32_avx2(const pixel_format_t* fmt, uint32_t* dst,
+                 const uint8_t* src, size_t count)
+{
+  const __m256i mask = _mm256_set1_epi32(0xFF);
+  __m256i v;
+  size_t i;
+
+  for (i = 0; i + 8 <= count; i += 8)
+  {
+    v = _mm256_loadu_si256((const __m256i*)(src + (i << 2)));
+    pixel_pack_avx2(fmt, dst + i,
+      _mm256_and_si256(v, mask),
+      _mm256_and_si256(_mm256_srli_epi32(v, 8), mask),
+      _mm256_and_si256(_mm256_srli_epi32(v, 16), mask));
+  }
+
+  pixel_rgb32(fmt, dst + i, src + (i << 2), count - i);
+}
+#endif
+
+/**
+ * Picks the fastest conversion the host supports for a guest pixel size.
+ * SSE2 is always available on x86-64, AVX2 is checked at runtime. Palette
+ * lookups do not gain from vectors, so they are always scalar.
+ * @param bpp Bytes per guest pixel
+ * @return Conversion or NULL if the size is not supported
+ */
+pixel_convert_t
+pixel_select(uint32_t bpp)
+{
+#if defined(__x86_64__)
+  int avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+  switch (bpp)
+  {
+    case 1:
+    {
+      return pixel_pal8;
+    }
+    case 2:
+    {
+#if defined(__x86_64__)
+      return avx2 ? pixel_rgb565_avx2 : pixel_rgb565_sse2;
+#else
+      return pixel_rgb565;
+#endif
+    }
+    case 3:
+    {
+#if defined(__x86_64__)
+      return avx2 ? pixel_rgb24_avx2 : pixel_rgb24;
+#else
+      return pixel_rgb24;
+#endif
+    }
+    case 4:
+    {
+#if defined(__x86_64__)
+      return avx2 ? pixel_rgb32_avx2 : pixel_rgb32_sse2;
+#else
+      return pixel_rgb32;
+#endif
+    }
+    default:
+    {
+      return NULL;
+    }
+  }
+}
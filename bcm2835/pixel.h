@@ -0,0 +1,45 @@
+/* This file is part of the Team 28 Project
+ * Licensing information can be found in the LICENSE file
+ * (C) 2014 The Team 28 Authors. All rights reserved.
+ */
+#ifndef __PIXEL_H__
+#define __PIXEL_H__
+
+/**
+ * Layout of 32 bit host pixels
+ */
+typedef struct
+{
+  /* Position of the 8 bit channels */
+  uint32_t  rshift;
+  uint32_t  gshift;
+  uint32_t  bshift;
+
+  /* Bits which are always set, usually an opaque alpha channel */
+  uint32_t  alpha;
+
+  /* Host pixels of the 8 bit palette */
+  uint32_t  palette[256];
+} pixel_format_t;
+
+/**
+ * Converts a row of guest pixels to host pixels
+ * @param fmt   Layout of host pixels
+ * @param dst   Host pixels
+ * @param src   Guest pixels
+ * @param count Number of pixels
+ */
+typedef void (*pixel_convert_t)(const pixel_format_t* fmt, uint32_t* dst,
+                                const uint8_t* src, size_t count);
+
+/**
+ * Expands 5 and 6 bit channels to 8 bits, rounding down like (c * 255) / 31
+ * and (c * 255) / 63 do, with products which fit in 16 bits
+ */
+#define PIXEL_EXPAND5(c) (((c) * 1053) >> 7)
+#define PIXEL_EXPAND6(c) (((c) << 2) + (((c) * 49) >> 10))
+
+void            pixel_palette(pixel_format_t*, const uint16_t* palette);
+pixel_convert_t pixel_select(uint32_t bpp);
+
+#endif /* __PIXEL_H__ */
@@ -0,0 +1,821 @@
+/* This file is part of the Team 28 Project
+ * Licensing information can be found in the LICENSE file
+ * (C) 2014 The Team 28 Authors. All rights reserved.
+ */
+#include "common.h"
+
+/**
+ * Initialises the block cache
+ * @param bc  Reference to the block cache
+ * @param emu Reference to the emulator structure
+ */
+void
+block_init(block_cache_t* bc, emulator_t* emu)
+{
+  assert(bc);
+  assert(emu);
+
+  bc->emu = emu;
+  bc->dead = NULL;
+  bc->epoch = 0;
+  bc->ras_top = 0;
+  memset(bc->hash, 0, sizeof(bc->hash));
+  memset(bc->lookup, 0, sizeof(bc->lookup));
+  memset(bc->ras, 0, sizeof(bc->ras));
+
+  bc->page_count = (emu->mem_size + 0xFFF) >> 12;
+  bc->pages = (block_t**)calloc(bc->page_count, sizeof(block_t*));
+  assert(bc->pages);
+}
+
+/**
+ * Frees the blocks which were invalidated. Must not be called while a block
+ * is being executed.
+ * @param bc Reference to the block cache
+ */
+static inline void
+block_free_dead(block_cache_t* bc)
+{
+  block_t *b, *next;
+
+  for (b = bc->dead; b; b = next)
+  {
+    next = b->page_next;
+    free(b);
+  }
+
+  bc->dead = NULL;
+}
+
+/**
+ * Frees all blocks
+ * @param bc Reference to the block cache
+ */
+void
+block_destroy(block_cache_t* bc)
+{
+  block_t *b, *next;
+  size_t i;
+
+  if (!bc || !bc->pages)
+  {
+    return;
+  }
+
+  for (i = 0; i < bc->page_count; ++i)
+  {
+    for (b = bc->pages[i]; b; b = next)
+    {
+      next = b->page_next;
+      free(b);
+    }
+  }
+
+  block_free_dead(bc);
+  free(bc->pages);
+  bc->pages = NULL;
+}
+
+/**
+ * Checks whether an instruction ends a basic block: branches, instructions
+ * which might write PC or change mode, SWI and coprocessor instructions
+ * @param op Predecoded instruction
+ * @return Nonzero if the block ends after this instruction
+ */
+static int
+block_is_end(const cpu_op_t* op)
+{
+  uint32_t instr = op->instr;
+
+  switch (op->kind)
+  {
+    case OPK_HALT:
+    case OPK_BRANCH:
+    {
+      return 1;
+    }
+    case OPK_NOP:
+    {
+      return 0;
+    }
+    case OPK_DP_IMM:
+    case OPK_DP_REG:
+    {
+      return op->rd == PC;
+    }
+    case OPK_SDT_IMM:
+    case OPK_SDT_REG:
+    {
+      return op->rd == PC && (op->flags & OP_L);
+    }
+    case OPK_MUL:
+    {
+      return op->rd == PC || op->rn == PC;
+    }
+    case OPK_BDT:
+    {
+      /* LDM loading PC */
+      return (op->flags & OP_L) && (op->imm & (1 << PC));
+    }
+    case OPK_BX:
+    {
+      return 1;
+    }
+  }
+
+  /* WFI breakpoint */
+  if ((instr & 0x0fff00ff) == 0x03200003)
+  {
+    return 1;
+  }
+
+  switch (cpu_classify(instr))
+  {
+    case CLS_BX:
+    case CLS_MSR:
+    case CLS_MSRF:
+    {
+      return 1;
+    }
+    case CLS_DP:
+    case CLS_MULL:
+    case CLS_SWP:
+    case CLS_MRS:
+    case CLS_HW:
+    {
+      /* Anything which names PC as a destination */
+      return ((instr >> 16) & 0xF) == PC || ((instr >> 12) & 0xF) == PC;
+    }
+    default:
+    {
+      /* Undefined, coprocessor instructions and SWI */
+      return 1;
+    }
+  }
+}
+
+/**
+ * Finds out how control leaves a block by looking at its last instruction
+ * @param b Block with all instructions decoded
+ */
+static void
+block_classify(block_t* b)
+{
+  const cpu_op_t *op = &b->ops[b->count - 1];
+
+  b->exit = EXIT_NEXT;
+  b->target = 0;
+
+  switch (op->kind % OPK_COUNT)
+  {
+    case OPK_BRANCH:
+    {
+      b->exit = (op->flags & OP_L) ? EXIT_CALL : EXIT_BRANCH;
+      b->target = b->addr + ((b->count - 1) << 2) + 8 + op->imm;
+      return;
+    }
+    case OPK_DP_IMM:
+    case OPK_DP_REG:
+    {
+      /* TST, TEQ, CMP and CMN do not write PC */
+      if (op->rd != PC || (op->alu & 0xC) == 0x8)
+      {
+        return;
+      }
+
+      b->exit = op->kind % OPK_COUNT == OPK_DP_REG && op->alu == 0xD &&
+                op->rm == LR && op->shift == 0 && op->stype == 0
+              ? EXIT_RETURN
+              : EXIT_INDIRECT;
+      return;
+    }
+    case OPK_SDT_IMM:
+    case OPK_SDT_REG:
+    {
+      if (op->rd == PC && (op->flags & OP_L))
+      {
+        b->exit = op->rn == SP ? EXIT_RETURN : EXIT_INDIRECT;
+      }
+      return;
+    }
+    case OPK_BDT:
+    {
+      /* LDM loading PC */
+      if ((op->flags & OP_L) && (op->imm & (1 << PC)))
+      {
+        b->exit = op->rn == SP ? EXIT_RETURN : EXIT_INDIRECT;
+      }
+      return;
+    }
+    case OPK_BX:
+    {
+      b->exit = op->rm == LR ? EXIT_RETURN : EXIT_INDIRECT;
+      return;
+    }
+  }
+}
+
+/**
+ * Decodes a basic block starting at a given address and adds it to the cache
+ * @param bc   Reference to the block cache
+ * @param addr Word aligned physical address inside SDRAM
+ * @return New block
+ */
+static block_t*
+block_build(block_cache_t* bc, uint32_t addr)
+{
+  cpu_op_t ops[BLOCK_MAX_OPS], *op;
+  uint32_t count, end, i;
+  block_t *b;
+
+  /* Decode instructions up to the end of the block, or the end of the page */
+  end = addr;
+  count = 0;
+  do
+  {
+    op = cpu_predecode(&bc->emu->cpu, end);
+    ops[count] = *op;
+    if (op->cond != CC_AL)
+    {
+      ops[count].kind = OPK_COND(op->kind);
+    }
+
+    end += 4;
+    count++;
+  }
+  while (!block_is_end(op) &&
+         count < BLOCK_MAX_OPS &&
+         (end & 0xFFF) != 0 &&
+         end + 3 < bc->emu->mem_size);
+
+  /* Copy the instructions, adding a terminating record */
+  b = (block_t*)malloc(sizeof(block_t) + (count + 1) * sizeof(cpu_op_t));
+  assert(b);
+
+  b->addr = addr;
+  b->count = count;
+  b->dead = 0;
+  b->hits = 0;
+  b->code = NULL;
+  b->chain[0] = b->chain[1] = NULL;
+  b->link[0] = b->link[1] = NULL;
+  b->epoch = bc->epoch;
+  memcpy(b->ops, ops, count * sizeof(cpu_op_t));
+  memset(&b->ops[count], 0, sizeof(cpu_op_t));
+  b->ops[count].kind = OPK_END;
+
+  /* Find the runs of instructions sharing a condition */
+  for (i = count; i-- > 0; )
+  {
+    b->ops[i].run = 1;
+    if (i + 1 < count && b->ops[i].cond == b->ops[i + 1].cond)
+    {
+      b->ops[i].run += b->ops[i + 1].run;
+    }
+  }
+  block_classify(b);
+
+  /* Link into the hash table and the page list */
+  b->hash_next = bc->hash[(addr >> 2) & (BLOCK_HASH_SIZE - 1)];
+  bc->hash[(addr >> 2) & (BLOCK_HASH_SIZE - 1)] = b;
+  b->page_next = bc->pages[addr >> 12];
+  bc->pages[addr >> 12] = b;
+
+  return b;
+}
+
+/**
+ * Looks up the block starting at a given address
+ * @param bc   Reference to the block cache
+ * @param addr Physical address
+ * @return Block or NULL if not cached
+ */
+static inline block_t*
+block_lookup(block_cache_t* bc, uint32_t addr)
+{
+  block_t *b;
+
+  for (b = bc->hash[(addr >> 2) & (BLOCK_HASH_SIZE - 1)]; b; b = b->hash_next)
+  {
+    if (b->addr == addr)
+    {
+      return b;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Points the first link of a B or BL block at the branch target when that
+ * block is already cached, so the branch never goes through a lookup
+ * @param bc Reference to the block cache
+ * @param b  Block whose links are reset
+ */
+static inline void
+block_resolve(block_cache_t* bc, block_t* b)
+{
+  b->link[0] = NULL;
+  if ((b->exit == EXIT_BRANCH || b->exit == EXIT_CALL) &&
+      (b->target & 0x3) == 0 &&
+      b->target + 3 < bc->emu->mem_size)
+  {
+    b->link[0] = block_lookup(bc, b->target);
+  }
+}
+
+/**
+ * Finds the block starting at a given address, building it if needed
+ * @param bc   Reference to the block cache
+ * @param addr Word aligned physical address inside SDRAM
+ * @return Block
+ */
+static inline block_t*
+block_get(block_cache_t* bc, uint32_t addr)
+{
+  block_t **slot, *b;
+
+  slot = &bc->lookup[(addr >> 2) & (BLOCK_LOOKUP_SIZE - 1)];
+  if ((b = *slot) && b->addr == addr)
+  {
+    return b;
+  }
+
+  if (!(b = block_lookup(bc, addr)))
+  {
+    b = block_build(bc, addr);
+    block_resolve(bc, b);
+  }
+
+  *slot = b;
+  return b;
+}
+
+/**
+ * Moves a block from its page list to the dead list. Blocks are only freed
+ * by block_run since the current block might be one of them.
+ * @param bc   Reference to the block cache
+ * @param link Link to the block in its page list
+ */
+static void
+block_kill(block_cache_t* bc, block_t** link)
+{
+  block_t **hash, *b = *link;
+
+  /* Unlink from the hash table */
+  hash = &bc->hash[(b->addr >> 2) & (BLOCK_HASH_SIZE - 1)];
+  while (*hash != b)
+  {
+    hash = &(*hash)->hash_next;
+  }
+  *hash = b->hash_next;
+
+  /* Move to the dead list */
+  *link = b->page_next;
+  b->page_next = bc->dead;
+  b->dead = 1;
+  bc->dead = b;
+}
+
+/**
+ * Drops every reference to blocks which might have been killed: links,
+ * chained jumps of translated code, the lookup cache and the return
+ * address stack
+ * @param bc Reference to the block cache
+ */
+static void
+block_unlink_all(block_cache_t* bc)
+{
+  if (bc->emu->engine == ENGINE_JIT)
+  {
+    jit_unchain(&bc->emu->jit);
+  }
+
+  bc->epoch++;
+  bc->ras_top = 0;
+  memset(bc->lookup, 0, sizeof(bc->lookup));
+  memset(bc->ras, 0, sizeof(bc->ras));
+}
+
+/**
+ * Removes the blocks covering a written address from the cache
+ * @param bc   Reference to the block cache
+ * @param addr Physical address inside SDRAM
+ */
+void
+block_invalidate(block_cache_t* bc, uint32_t addr)
+{
+  block_t **link, *b;
+  int killed = 0;
+
+  if (!bc->pages)
+  {
+    return;
+  }
+
+  link = &bc->pages[addr >> 12];
+  while ((b = *link))
+  {
+    if (addr < b->addr || b->addr + (b->count << 2) <= addr)
+    {
+      link = &b->page_next;
+      continue;
+    }
+
+    block_kill(bc, link);
+    killed = 1;
+  }
+
+  if (killed)
+  {
+    block_unlink_all(bc);
+  }
+}
+
+/**
+ * Removes all blocks of a page from the cache
+ * @param bc   Reference to the block cache
+ * @param addr Physical address inside the page
+ */
+void
+block_invalidate_page(block_cache_t* bc, uint32_t addr)
+{
+  block_t **link;
+
+  if (!bc->pages || !*(link = &bc->pages[addr >> 12]))
+  {
+    return;
+  }
+
+  while (*link)
+  {
+    block_kill(bc, link);
+  }
+
+  block_unlink_all(bc);
+}
+
+/**
+ * Executes a block using direct threaded dispatch. PC is kept pointing to
+ * the instruction after the current one, exactly as in cpu_tick.
+ * @param cpu Reference to the CPU structure
+ * @param b   Block to execute
+ */
+static void
+block_dispatch(cpu_t* cpu, block_t* b)
+{
+  static const void* dispatch[] =
+  {
+    [OPK_GENERIC]           = &&op_generic,
+    [OPK_HALT]              = &&op_halt,
+    [OPK_NOP]               = &&op_next,
+    [OPK_DP_IMM]            = &&op_dp_imm,
+    [OPK_DP_REG]            = &&op_dp_reg,
+    [OPK_SDT_IMM]           = &&op_sdt_imm,
+    [OPK_SDT_REG]           = &&op_sdt_reg,
+    [OPK_BRANCH]            = &&op_branch,
+    [OPK_MUL]               = &&op_exec,
+    [OPK_BDT]               = &&op_generic,
+    [OPK_BX]                = &&op_exec,
+    [OPK_COND(OPK_GENERIC)] = &&op_cond,
+    [OPK_COND(OPK_HALT)]    = &&op_cond,
+    [OPK_COND(OPK_NOP)]     = &&op_cond,
+    [OPK_COND(OPK_DP_IMM)]  = &&op_cond,
+    [OPK_COND(OPK_DP_REG)]  = &&op_cond,
+    [OPK_COND(OPK_SDT_IMM)] = &&op_cond,
+    [OPK_COND(OPK_SDT_REG)] = &&op_cond,
+    [OPK_COND(OPK_BRANCH)]  = &&op_cond,
+    [OPK_COND(OPK_MUL)]     = &&op_cond,
+    [OPK_COND(OPK_BDT)]     = &&op_cond,
+    [OPK_COND(OPK_BX)]      = &&op_cond,
+    [OPK_END]               = &&op_end
+  };
+
+  const cpu_op_t *op = b->ops;
+  uint32_t pc = cpu->regs.reg.pc;
+
+  #define DISPATCH() goto *dispatch[op->kind]
+  #define NEXT()     { ++op; pc += 4; DISPATCH(); }
+
+  cpu->regs.reg.pc = pc + 4;
+  DISPATCH();
+
+op_cond:
+  /* If the condition fails, skip the instruction and the ones following it
+   * with the same condition since the flags do not change. Otherwise run
+   * the unconditional version of its handler. */
+  if (!cpu_cond_passed(cpu, op->cond))
+  {
+    pc += op->run << 2;
+    op += op->run;
+    cpu->regs.reg.pc = pc;
+    DISPATCH();
+  }
+  cpu->regs.reg.pc = pc + 4;
+  goto *dispatch[op->kind - OPK_COUNT];
+
+op_dp_imm:
+  cpu->regs.reg.pc = pc + 4;
+  data_processing(cpu, op->alu, op->flags & OP_S, op->rd,
+                  cpu_read_register(cpu, op->rn), op->imm);
+  NEXT();
+
+op_dp_reg:
+  cpu->regs.reg.pc = pc + 4;
+  data_processing(cpu, op->alu, op->flags & OP_S, op->rd,
+                  cpu_read_register(cpu, op->rn),
+                  compute_shift(cpu, cpu_read_register(cpu, op->rm),
+                                op->stype, op->shift, op->flags & OP_S));
+  NEXT();
+
+op_sdt_imm:
+  cpu->regs.reg.pc = pc + 4;
+  single_data_trans(cpu, op->flags, op->rd, op->rn, op->imm);
+  goto op_store;
+
+op_sdt_reg:
+  cpu->regs.reg.pc = pc + 4;
+  single_data_trans(cpu, op->flags, op->rd, op->rn,
+                    compute_shift(cpu, cpu_read_register(cpu, op->rm),
+                                  op->stype, op->shift, 0));
+
+op_store:
+  /* Stores might overwrite the block */
+  if (__builtin_expect(b->dead, 0))
+  {
+    return;
+  }
+  NEXT();
+
+op_exec:
+  /* Instructions which do not touch memory */
+  cpu->regs.reg.pc = pc + 4;
+  op->exec(cpu, op);
+  NEXT();
+
+op_generic:
+  /* Instructions which might overwrite the block */
+  cpu->regs.reg.pc = pc + 4;
+  op->exec(cpu, op);
+  if (__builtin_expect(b->dead, 0))
+  {
+    return;
+  }
+  NEXT();
+
+op_branch:
+  /* Branch target is PC + 8 + offset */
+  if (op->flags & OP_L)
+  {
+    cpu_write_register(cpu, LR, pc + 4);
+  }
+  cpu->regs.reg.pc = pc + 8 + op->imm;
+  return;
+
+op_halt:
+  cpu->emu->terminated = 1;
+  cpu->regs.reg.pc = pc + 4;
+  return;
+
+op_next:
+  cpu->regs.reg.pc = pc + 4;
+  NEXT();
+
+op_end:
+  /* PC already points past the last instruction */
+  return;
+
+  #undef NEXT
+  #undef DISPATCH
+}
+
+/**
+ * Translates a block into host code. When the code cache is full, all
+ * translations are dropped and the cache is reused.
+ * @param bc Reference to the block cache
+ * @param b  Block to translate
+ */
+static void
+block_translate(block_cache_t* bc, block_t* b)
+{
+  block_t *it;
+  size_t i;
+
+  if ((b->code = jit_compile(&bc->emu->jit, b)))
+  {
+    return;
+  }
+
+  for (i = 0; i < bc->page_count; ++i)
+  {
+    for (it = bc->pages[i]; it; it = it->page_next)
+    {
+      it->code = NULL;
+      it->hits = 0;
+    }
+  }
+
+  jit_reset(&bc->emu->jit);
+  b->code = jit_compile(&bc->emu->jit, b);
+}
+
+/**
+ * Finds the successor of a block through its links or, for returns, through
+ * the return address stack. Links of the block must be up to date.
+ * @param bc   Reference to the block cache
+ * @param b    Block which was just executed
+ * @param addr Address where execution continues
+ * @return Successor or NULL if it is not known
+ */
+static inline block_t*
+block_follow(block_cache_t* bc, block_t* b, uint32_t addr)
+{
+  block_t *next;
+
+  if (b->exit == EXIT_RETURN && bc->ras_top > 0)
+  {
+    next = bc->ras[--bc->ras_top & (BLOCK_RAS_SIZE - 1)];
+    if (next && next->addr == addr)
+    {
+      return next;
+    }
+  }
+
+  if ((next = b->link[0]) && next->addr == addr)
+  {
+    return next;
+  }
+  if ((next = b->link[1]) && next->addr == addr)
+  {
+    return next;
+  }
+
+  return NULL;
+}
+
+/**
+ * Records the successor of a block. Fall through goes to the second link,
+ * taken branches and indirect targets to the first.
+ * @param b    Block which was just executed
+ * @param next Block executed after it
+ */
+static inline void
+block_link(block_t* b, block_t* next)
+{
+  b->link[next->addr == b->addr + (b->count << 2)] = next;
+}
+
+/**
+ * Pushes the block following a call onto the return address stack
+ * @param bc Reference to the block cache
+ * @param b  Block ending in BL
+ */
+static inline void
+block_push(block_cache_t* bc, block_t* b)
+{
+  uint32_t ret = b->addr + (b->count << 2);
+  block_t *next;
+
+  if (ret + 3 >= bc->emu->mem_size)
+  {
+    return;
+  }
+
+  if (!(next = b->link[1]) || next->addr != ret)
+  {
+    next = b->link[1] = block_get(bc, ret);
+  }
+
+  bc->ras[bc->ras_top++ & (BLOCK_RAS_SIZE - 1)] = next;
+}
+
+/**
+ * Executes a block, translating it first if it became hot. Translated code
+ * may run on into chained successors while the budget lasts.
+ * @param bc     Reference to the block cache
+ * @param b      Block to execute
+ * @param budget Number of instructions left in the batch
+ * @return Last block executed
+ */
+static inline block_t*
+block_exec(block_cache_t* bc, block_t* b, int32_t budget)
+{
+  cpu_t *cpu = &bc->emu->cpu;
+
+  /* Hot blocks are translated when the JIT engine is selected */
+  if (bc->emu->engine == ENGINE_JIT)
+  {
+    if (!b->code && ++b->hits == JIT_THRESHOLD)
+    {
+      block_translate(bc, b);
+    }
+    if (b->code)
+    {
+      bc->emu->jit.budget = budget;
+      return b->code(cpu);
+    }
+  }
+
+  block_dispatch(cpu, b);
+  return b;
+}
+
+/**
+ * Patches the exit of a translated block which led to another translated
+ * block into a direct jump. Chains are undone by block_unlink_all.
+ * @param bc   Reference to the block cache
+ * @param b    Block which was just executed
+ * @param next Block executed after it
+ */
+static inline void
+block_chain(block_cache_t* bc, block_t* b, block_t* next)
+{
+  if (!b->code || !next->code)
+  {
+    return;
+  }
+
+  if (b->chain[0] && next->addr == b->target)
+  {
+    jit_chain(&bc->emu->jit, b->chain[0], next->code);
+  }
+  else if (b->chain[1] && next->addr == b->addr + (b->count << 2))
+  {
+    jit_chain(&bc->emu->jit, b->chain[1], next->code);
+  }
+}
+
+/**
+ * Executes blocks until about budget instructions ran or the emulator stops.
+ * Successors are found through the links of the previous block, so the
+ * lookup is skipped on most transitions. Under the JIT engine, transitions
+ * between translated blocks are chained into direct jumps.
+ * @param bc     Reference to the block cache
+ * @param budget Number of instructions
+ */
+void
+block_run(block_cache_t* bc, uint32_t budget)
+{
+  emulator_t *emu = bc->emu;
+  cpu_t *cpu = &emu->cpu;
+  block_t *prev = NULL, *b;
+  uint32_t count = 0, addr;
+  int32_t left;
+
+  while (count < budget && !emu->terminated)
+  {
+    /* No block is running, so invalidated ones can be freed */
+    if (__builtin_expect(bc->dead != NULL, 0))
+    {
+      block_free_dead(bc);
+      prev = NULL;
+    }
+
+    /* Code outside SDRAM or at unaligned addresses is interpreted */
+    addr = cpu->regs.reg.pc & 0x3FFFFFFF;
+    if (__builtin_expect((addr & 0x3) != 0 || addr + 3 >= emu->mem_size, 0))
+    {
+      cpu_tick(cpu);
+      count++;
+      prev = NULL;
+      continue;
+    }
+
+    if (!prev || !(b = block_follow(bc, prev, addr)))
+    {
+      b = block_get(bc, addr);
+      if (prev)
+      {
+        block_link(prev, b);
+      }
+    }
+
+    /* Some block was invalidated since the links were made */
+    if (__builtin_expect(b->epoch != bc->epoch, 0))
+    {
+      block_resolve(bc, b);
+      b->link[1] = NULL;
+      b->epoch = bc->epoch;
+    }
+
+    if (prev)
+    {
+      block_chain(bc, prev, b);
+    }
+
+    if (b->exit == EXIT_CALL)
+    {
+      block_push(bc, b);
+    }
+
+    /* Blocks leaving through a chained exit take their instructions off
+     * the budget of the translator */
+    left = (int32_t)(budget - count);
+    prev = block_exec(bc, b, left);
+    count += b->count;
+    if (prev != b)
+    {
+      count += left - emu->jit.budget - b->count;
+    }
+  }
+}
@@ -0,0 +1,131 @@
+/* This file is part of the Team 28 Project
+ * Licensing information can be found in the LICENSE file
+ * (C) 2014 The Team 28 Authors. All rights reserved.
+ */
+#ifndef __BLOCK_H__
+#define __BLOCK_H__
+
+/**
+ * Maximum number of instructions in a basic block
+ */
+#define BLOCK_MAX_OPS    64
+
+/**
+ * Number of buckets in the block hash table
+ */
+#define BLOCK_HASH_SIZE  4096
+
+/**
+ * Number of entries in the direct mapped block lookup cache
+ */
+#define BLOCK_LOOKUP_SIZE 1024
+
+/**
+ * Depth of the return address stack
+ */
+#define BLOCK_RAS_SIZE   16
+
+/**
+ * Kind of a record executed with a condition check. Conditional records use
+ * the OPK_* value shifted by OPK_COUNT.
+ */
+#define OPK_COND(kind)    ((kind) + OPK_COUNT)
+#define OPK_UNCOND(kind)  ((kind) & (OPK_COUNT - 1))
+
+/**
+ * Kind of the record which terminates every block
+ */
+#define OPK_END           (2 * OPK_COUNT)
+
+/**
+ * How control leaves a block
+ */
+typedef enum
+{
+  EXIT_NEXT     = 0x0,  /* Falls through, SWI or coprocessor instruction */
+  EXIT_BRANCH   = 0x1,  /* B */
+  EXIT_CALL     = 0x2,  /* BL */
+  EXIT_RETURN   = 0x3,  /* BX LR, MOV PC, LR or a pop into PC */
+  EXIT_INDIRECT = 0x4   /* Any other write to PC */
+} block_exit_t;
+
+/**
+ * Basic block: a straight run of predecoded instructions, ending at a branch,
+ * a write to PC, an SWI, a coprocessor instruction or a page boundary
+ */
+typedef struct _block_t
+{
+  /* Physical address of the first instruction */
+  uint32_t          addr;
+
+  /* Number of instructions, not counting the terminating OPK_END record */
+  uint32_t          count;
+
+  /* Set when the code under the block was overwritten */
+  int               dead;
+
+  /* Last instruction type and branch target, which is also the first
+   * link of B and BL blocks */
+  block_exit_t      exit;
+  uint32_t          target;
+
+  /* Successors: branch target or last indirect target, and the next block.
+   * Only valid while epoch matches the one of the cache. */
+  struct _block_t  *link[2];
+  uint32_t          epoch;
+
+  /* Number of executions, used to find blocks worth translating */
+  uint32_t          hits;
+
+  /* Translated host code, NULL if not translated */
+  struct _block_t*(*code)(cpu_t*);
+
+  /* Jumps of the translated code to the successors in link, NULL if the
+   * exit cannot be chained */
+  uint8_t          *chain[2];
+
+  /* Hash bucket chain */
+  struct _block_t  *hash_next;
+
+  /* Blocks in the same page */
+  struct _block_t  *page_next;
+
+  /* Instructions */
+  cpu_op_t          ops[];
+} block_t;
+
+/**
+ * Block cache
+ */
+typedef struct
+{
+  emulator_t  *emu;
+
+  /* Blocks indexed by start address */
+  block_t     *hash[BLOCK_HASH_SIZE];
+
+  /* Blocks starting in each 4 KiB page of SDRAM */
+  block_t    **pages;
+  size_t       page_count;
+
+  /* Blocks which were invalidated while they could still be running */
+  block_t     *dead;
+
+  /* Incremented when blocks are invalidated, to drop stale links */
+  uint32_t     epoch;
+
+  /* Recently used blocks, indexed by start address */
+  block_t     *lookup[BLOCK_LOOKUP_SIZE];
+
+  /* Blocks following the BL instructions of the active calls */
+  block_t     *ras[BLOCK_RAS_SIZE];
+  uint32_t     ras_top;
+} block_cache_t;
+
+void block_init(block_cache_t*, emulator_t*);
+void block_destroy(block_cache_t*);
+void block_run(block_cache_t*, uint32_t budget);
+void block_invalidate(block_cache_t*, uint32_t addr);
+void block_invalidate_page(block_cache_t*, uint32_t addr);
+
+#endif /* __BLOCK_H__ */
@@ -8,6 +8,7 @@
 /* Standard C */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <string.h>
 #include <getopt.h>
@@ -15,9 +16,16 @@
 #include <assert.h>
 #include <time.h>
 #include <math.h>
+#include <pthread.h>
 
-/* SDL */
-#include <SDL/SDL.h>
+/* SDL, left out of headless builds */
+#if defined(PIEMU_HEADLESS)
+#elif defined(PIEMU_SDL2)
+#  define SDL_MAIN_HANDLED
+#  include <SDL.h>
+#else
+#  include <SDL/SDL.h>
+#endif
 
 /* Useful macros */
 #ifdef __GNUC__
@@ -32,17 +40,25 @@
 typedef struct _emulator_t emulator_t;
 
 /* Modules */
+#include "input.h"
 #include "memory.h"
 #include "opcode.h"
 #include "vfp.h"
 #include "cpu.h"
+#include "block.h"
+#include "jit.h"
 #include "nes.h"
 #include "bcm2835/gpio.h"
 #include "bcm2835/mbox.h"
+#include "bcm2835/pixel.h"
 #include "bcm2835/framebuffer.h"
+#include "share.h"
 #include "bcm2835/peripheral.h"
 
 /* Emulator */
 #include "emulator.h"
 
+/* Instruction bodies, which need the full emulator structure */
+#include "alu.h"
+
 #endif /*__COMMON_H__*/
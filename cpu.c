@@ -4,6 +4,30 @@
  */
 #include "common.h"
 
+/**
+ * Outcome of each condition for every value of the NZCV nibble: bit n of
+ * entry cc is set if cc passes when cpsr[31:28] is n
+ */
+const uint16_t cpu_cond_table[16] =
+{
+  [CC_EQ] = 0xF0F0,   /* Z */
+  [CC_NE] = 0x0F0F,   /* !Z */
+  [CC_CS] = 0xCCCC,   /* C */
+  [CC_CC] = 0x3333,   /* !C */
+  [CC_MI] = 0xFF00,   /* N */
+  [CC_PL] = 0x00FF,   /* !N */
+  [CC_VS] = 0xAAAA,   /* V */
+  [CC_VC] = 0x5555,   /* !V */
+  [CC_HI] = 0x0C0C,   /* C && !Z */
+  [CC_LS] = 0xF3F3,   /* !C || Z */
+  [CC_GE] = 0xAA55,   /* N == V */
+  [CC_LT] = 0x55AA,   /* N != V */
+  [CC_GT] = 0x0A05,   /* !Z && N == V */
+  [CC_LE] = 0xF5FA,   /* Z || N != V */
+  [CC_AL] = 0xFFFF,   /* Always executed */
+  [0xF]   = 0x0000    /* Never executed */
+};
+
 /**
  * Checks the condition and returns 1 if the instruction should be executed
  *
@@ -12,146 +36,167 @@
  * @return    1 if condition matches
  */
 int
-check_cond(const cpu_t* cpu, armCond_t cc)
-{
-  switch (cc)
-  {
-    case CC_EQ: return cpu->cpsr.b.z;
-    case CC_NE: return !cpu->cpsr.b.z;
-    case CC_CS: return cpu->cpsr.b.c;
-    case CC_CC: return !cpu->cpsr.b.c;
-    case CC_MI: return cpu->cpsr.b.n;
-    case CC_PL: return !cpu->cpsr.b.n;
-    case CC_VS: return cpu->cpsr.b.v;
-    case CC_VC: return !cpu->cpsr.b.v;
-    case CC_HI: return cpu->cpsr.b.c && !cpu->cpsr.b.z;
-    case CC_LS: return !cpu->cpsr.b.c || cpu->cpsr.b.z;
-    case CC_GE: return cpu->cpsr.b.n == cpu->cpsr.b.v;
-    case CC_LT: return cpu->cpsr.b.n != cpu->cpsr.b.v;
-    case CC_GT: return !cpu->cpsr.b.z && cpu->cpsr.b.n == cpu->cpsr.b.v;
-    case CC_LE: return cpu->cpsr.b.z || cpu->cpsr.b.n != cpu->cpsr.b.v;
-    case CC_AL: return 1; // Always executed
-    default:
-    {
-      return 0;//emulator_fatal(cpu->emu, "Invalid condition code: 0xF");
-    }
-  }
+check_cond(cpu_t* cpu, armCond_t cc)
+{
+  return cpu_cond_passed(cpu, cc);
 }
 
 /**
- * Reads the value of a register
+ * Applies the pending flag updates to cpsr. Carry and overflow are computed
+ * from the operands exactly as data_processing used to do it eagerly.
  * @param cpu Reference to the CPU structure
- * @param reg Register index
- * @return Value of the register
  */
-uint32_t
-cpu_read_register(const cpu_t* cpu, armReg_t reg)
+void
+cpu_eval_flags(cpu_t* cpu)
 {
-  assert(cpu != NULL);
-  assert(reg <= 0xF);
+  int32_t op1, op2, res;
+  int64_t res64;
 
-  switch (reg)
+  if (cpu->flags.nz)
+  {
+    cpu->cpsr.b.z = cpu->flags.res == 0;
+    cpu->cpsr.b.n = (cpu->flags.res >> 31) & 1;
+  }
+
+  op1 = cpu->flags.op1;
+  op2 = cpu->flags.op2;
+  switch (cpu->flags.cv)
   {
-    case R0 ... R7:
+    case FLAGS_ADD:
     {
-      /* First 8 regs not banked */
-      return cpu->r_usr.r[reg];
+      res64 = (int64_t)op1 + (int64_t)op2;
+      res = res64 & ((1LL << 32) - 1);
+
+      cpu->cpsr.b.c = (res64 >> 32) != 0;
+      cpu->cpsr.b.v = (op1 < 0 && op2 < 0 && res > 0) ||
+                      (op1 > 0 && op2 > 0 && res < 0);
+      break;
     }
-    case R8 ... R12:
+    case FLAGS_SUB:
     {
-      if (cpu->cpsr.b.m == MODE_FIQ)
-      {
-        /* FIQ banked regs */
-        return cpu->r_fiq.r[reg - 8];
-      }
-      else
-      {
-        /* USR/SYS regs */
-        return cpu->r_usr.r[reg];
-      }
+      res64 = (int64_t)op1 - (int64_t)op2;
+      res = res64 & ((1LL << 32) - 1);
+
+      cpu->cpsr.b.c = ((res64 >> 32) & 1) == 0;
+      cpu->cpsr.b.v = (op1 >= 0 && op2 < 0 && res < 0) ||
+                      (op1 < 0 && op2 >= 0 && res >= 0);
+      break;
     }
-    case SP: case LR:
+  }
+
+  cpu->flags.nz = 0;
+  cpu->flags.cv = FLAGS_NONE;
+}
+
+/**
+ * Returns the storage of SP and LR for a mode other than FIQ, while the mode
+ * is not active
+ * @param cpu  Reference to the CPU structure
+ * @param mode Mode owning the registers
+ * @return Two banked registers
+ */
+static inline int32_t*
+bank_sp_lr(cpu_t* cpu, armMode_t mode)
+{
+  switch (mode)
+  {
+    case MODE_USR: case MODE_SYS: return &cpu->r_usr.r[SP - R8];
+    case MODE_IRQ: return cpu->r_irq.r;
+    case MODE_SVC: return cpu->r_svc.r;
+    case MODE_ABT: return cpu->r_abt.r;
+    case MODE_UND: return cpu->r_und.r;
+    default: emulator_fatal(cpu->emu, "Invalid mode");
+  }
+}
+
+/**
+ * Switches to a new mode, swapping banked registers. R8-R12 are only banked
+ * in FIQ mode, SP and LR are banked in every mode except SYS.
+ * @param cpu  Reference to the CPU structure
+ * @param mode Mode to be entered
+ */
+void
+cpu_switch_mode(cpu_t* cpu, armMode_t mode)
+{
+  armMode_t old = cpu->cpsr.b.m;
+
+  if (old == mode)
+  {
+    return;
+  }
+
+  /* Save the registers of the old mode */
+  if (old == MODE_FIQ)
+  {
+    memcpy(cpu->r_fiq.r, &cpu->regs.r[R8], 7 * sizeof(int32_t));
+  }
+  else
+  {
+    if (mode == MODE_FIQ)
     {
-      /* SP/LR always banked */
-      switch (cpu->cpsr.b.m)
-      {
-        case MODE_USR: case MODE_SYS: return cpu->r_usr.r[reg];
-        case MODE_FIQ: return cpu->r_fiq.r[reg - 8];
-        case MODE_IRQ: return cpu->r_irq.r[reg - 13];
-        case MODE_SVC: return cpu->r_svc.r[reg - 13];
-        case MODE_ABT: return cpu->r_abt.r[reg - 13];
-        case MODE_UND: return cpu->r_und.r[reg - 13];
-      }
-      emulator_fatal(cpu->emu, "Invalid mode");
+      memcpy(cpu->r_usr.r, &cpu->regs.r[R8], 5 * sizeof(int32_t));
     }
-    case PC:
+    memcpy(bank_sp_lr(cpu, old), &cpu->regs.r[SP], 2 * sizeof(int32_t));
+  }
+
+  /* Load the registers of the new mode */
+  if (mode == MODE_FIQ)
+  {
+    memcpy(&cpu->regs.r[R8], cpu->r_fiq.r, 7 * sizeof(int32_t));
+  }
+  else
+  {
+    if (old == MODE_FIQ)
     {
-      /* PC not banked */
-      return cpu->r_usr.reg.pc + 4;
+      memcpy(&cpu->regs.r[R8], cpu->r_usr.r, 5 * sizeof(int32_t));
     }
+    memcpy(&cpu->regs.r[SP], bank_sp_lr(cpu, mode), 2 * sizeof(int32_t));
   }
 
-  __builtin_unreachable();
+  cpu->cpsr.b.m = mode;
+}
+
+/**
+ * Writes the whole CPSR, switching banks if the mode changes
+ * @param cpu   Reference to the CPU structure
+ * @param value New value of CPSR
+ */
+static inline void
+write_cpsr(cpu_t* cpu, uint32_t value)
+{
+  cpu_switch_mode(cpu, value & 0x1F);
+  cpu->cpsr.r = value;
 }
 
 /**
- * Writes a new value to a register
+ * Returns the user mode copy of a register, as accessed by LDM/STM with the
+ * S bit set
  * @param cpu Reference to the CPU structure
  * @param reg Register index
- * @param value Value to be written
+ * @return Storage of the register
  */
-void
-cpu_write_register(cpu_t* cpu, armReg_t reg, uint32_t value)
+static inline int32_t*
+user_register(cpu_t* cpu, armReg_t reg)
 {
-  assert(cpu != NULL);
-  assert(reg <= 0xF);
-
   switch (reg)
   {
-    case R0 ... R7:
-    {
-      /* First 8 regs not banked */
-      cpu->r_usr.r[reg] = value;
-      break;
-    }
     case R8 ... R12:
     {
-      if (cpu->cpsr.b.m == MODE_FIQ)
-      {
-        /* FIQ banked regs */
-        cpu->r_fiq.r[reg - 8] = value;
-      }
-      else
-      {
-        /* USR/SYS regs */
-        cpu->r_usr.r[reg] = value;
-      }
-      break;
+      return cpu->cpsr.b.m == MODE_FIQ ? &cpu->r_usr.r[reg - R8]
+                                       : &cpu->regs.r[reg];
     }
     case SP: case LR:
     {
-      /* SP/LR always banked */
-      switch (cpu->cpsr.b.m)
-      {
-        case MODE_USR: case MODE_SYS: cpu->r_usr.r[reg] = value; break;
-        case MODE_FIQ: cpu->r_fiq.r[reg - 8] = value; break;
-        case MODE_IRQ: cpu->r_irq.r[reg - 13] = value; break;
-        case MODE_SVC: cpu->r_svc.r[reg - 13] = value; break;
-        case MODE_ABT: cpu->r_abt.r[reg - 13] = value; break;
-        case MODE_UND: cpu->r_und.r[reg - 13] = value; break;
-      }
-      break;
+      return cpu->cpsr.b.m == MODE_USR || cpu->cpsr.b.m == MODE_SYS
+             ? &cpu->regs.r[reg] : &cpu->r_usr.r[reg - R8];
     }
-    case PC:
+    default:
     {
-      /* PC not banked */
-      cpu->r_usr.reg.pc = value;
-      break;
+      return &cpu->regs.r[reg];
     }
   }
 }
 
-
 /* Reads the current mode's SPSR.
  *
  * @param cpu Reference to the CPU structure.
@@ -203,7 +248,7 @@ change_mode(cpu_t* cpu, armMode_t mode)
   {
     case MODE_USR ... MODE_SYS:
     {
-      cpu->cpsr.b.m = mode;
+      cpu_switch_mode(cpu, mode);
       return;
     }
     default:
@@ -282,6 +327,7 @@ instr_multiply_long(cpu_t* cpu, op_multiply_long_t* opcode)
   // Set CPSR flags
   if (opcode->s)
   {
+    cpu_sync_flags(cpu);
     cpu->cpsr.b.n = output.hi >> 31;
     cpu->cpsr.b.z = output.large == 0LL;
   }
@@ -291,19 +337,29 @@ instr_multiply_long(cpu_t* cpu, op_multiply_long_t* opcode)
   cpu_write_register(cpu, opcode->RdHi, output.hi);
 }
 
+/**
+ * Executes a multiply or multiply accumulate instruction
+ * @param cpu   Reference to the CPU structure
+ * @param flags OP_S and OP_A bits of the instruction
+ * @param rd    Destination register
+ * @param rn    Accumulated register
+ * @param rm    First operand
+ * @param rs    Second operand
+ */
 static inline void
-instr_multiply(cpu_t* cpu, op_multiply_t* opcode)
+multiply(cpu_t* cpu, uint32_t flags, uint32_t rd, uint32_t rn, uint32_t rm,
+         uint32_t rs)
 {
   int32_t res;
   int32_t op1, op2, opA;
 
-  op1 = cpu_read_register(cpu, opcode->Rm);
-  op2 = cpu_read_register(cpu, opcode->Rs);
+  op1 = cpu_read_register(cpu, rm);
+  op2 = cpu_read_register(cpu, rs);
 
-  if (opcode->a)
+  if (flags & OP_A)
   {
     /* MLA */
-    opA = cpu_read_register(cpu, opcode->Rn);
+    opA = cpu_read_register(cpu, rn);
     res = opA + op1 * op2;
   }
   else
@@ -313,13 +369,19 @@ instr_multiply(cpu_t* cpu, op_multiply_t* opcode)
   }
 
   // Set flags
-  if (opcode->s)
+  if (flags & OP_S)
   {
-    cpu->cpsr.b.z = res == 0;
-    cpu->cpsr.b.n = res >> 31;
+    set_flags_nz(cpu, res);
   }
 
-  cpu_write_register(cpu, opcode->Rd, res);
+  cpu_write_register(cpu, rd, res);
+}
+
+static inline void
+instr_multiply(cpu_t* cpu, op_multiply_t* opcode)
+{
+  multiply(cpu, (opcode->s ? OP_S : 0) | (opcode->a ? OP_A : 0), opcode->Rd,
+           opcode->Rn, opcode->Rm, opcode->Rs);
 }
 
 /**
@@ -333,6 +395,7 @@ instr_mrs(cpu_t* cpu, op_mrs_t* opcode)
   // Choose the correct destination register
   if (opcode->Ps == 0)
   {
+    cpu_sync_flags(cpu);
     cpu_write_register(cpu, opcode->Rd, cpu->cpsr.r);
   }
   else
@@ -358,6 +421,8 @@ instr_mrs(cpu_t* cpu, op_mrs_t* opcode)
 static inline void
 write_psr(cpu_t* cpu, uint32_t Pd, uint32_t value, uint32_t flags)
 {
+  cpu_sync_flags(cpu);
+
   // If CPU is in user mode, always write flags
   if (flags || cpu->cpsr.b.m == MODE_USR)
   {
@@ -371,7 +436,7 @@ write_psr(cpu_t* cpu, uint32_t Pd, uint32_t value, uint32_t flags)
       // Carry over remaining bits not covered by the mask instead of
       // setting them to 0
       value |= cpu->cpsr.r & ~mask;
-      cpu->cpsr.r = value;
+      write_cpsr(cpu, value);
     }
     else
     {
@@ -391,7 +456,7 @@ write_psr(cpu_t* cpu, uint32_t Pd, uint32_t value, uint32_t flags)
     // Choose the correct destination register
     if (Pd == 0)
     {
-      cpu->cpsr.r = value;
+      write_cpsr(cpu, value);
     }
     else
     {
@@ -411,20 +476,6 @@ instr_msr_psr(cpu_t* cpu, op_msr_psr_t* opcode)
   write_psr(cpu, opcode->Pd, cpu_read_register(cpu, opcode->Rm), 0);
 }
 
-/**
- * Rotates a number to the right
- *
- * @param value Number to be rotated
- * @param shift Number of bits shifted
- * @return Rotated number
- */
-static inline int32_t
-rotate_right(int32_t value, uint8_t shift)
-{
-  shift &= 0x1F;
-  return (value >> shift) | (value << (32 - shift));
-}
-
 /**
  * Calculates operand2/offset for single data processing/transfer instructions
  * @param cpu Reference to the cpu structure
@@ -437,7 +488,6 @@ compute_offset_operand2(cpu_t *cpu, uint32_t imm, uint8_t s)
 {
   assert(cpu);
 
-  int32_t res = 0;
   uint32_t rm_data, shift_amount, shift_type;
 
   rm_data = cpu_read_register(cpu, imm & 0x0000000F);
@@ -462,107 +512,7 @@ compute_offset_operand2(cpu_t *cpu, uint32_t imm, uint8_t s)
     shift_amount = (imm >> 7) & 0x0000001F;
   }
 
-  if (shift_amount == 0)
-  {
-    res = rm_data;
-  }
-  else
-  {
-    switch (shift_type)
-    {
-      case 0x0:
-      {
-        /* Logical left */
-        if (shift_amount >= 32)
-        {
-          res = 0;
-          if (s)
-          {
-            cpu->cpsr.b.c = shift_amount == 32 && (rm_data & 0x1);
-          }
-        }
-        else
-        {
-          if (s)
-          {
-            cpu->cpsr.b.c = (rm_data >> (32 - shift_amount)) & 0x1;
-          }
-          res = rm_data << shift_amount;
-        }
-        break;
-      }
-      case 0x1:
-      {
-        /* Logical right */
-        if (shift_amount >= 32)
-        {
-          res = 0;
-          if (s)
-          {
-            cpu->cpsr.b.c = shift_amount == 32 && (rm_data >> 31);
-          }
-        }
-        else
-        {
-          if (s)
-          {
-            cpu->cpsr.b.c = (rm_data >> (shift_amount - 1)) & 0x1;
-          }
-          res = rm_data >> shift_amount;
-        }
-        break;
-      }
-      case 0x2:
-      {
-        /* Arithmetic right */
-        if (shift_amount >= 32)
-        {
-          uint32_t bit31 = (rm_data >> 31);
-          res = bit31 ? 0xFFFFFFFF : 0x0;
-          if (s)
-          {
-            cpu->cpsr.b.c = bit31;
-          }
-        }
-        else
-        {
-          if (s)
-          {
-            cpu->cpsr.b.c = (rm_data >> (shift_amount - 1)) & 0x1;
-          }
-          res = ((int32_t) rm_data) >> shift_amount;
-        }
-        break;
-      }
-      case 0x3:
-      {
-        /* Rotate right */
-        while (shift_amount > 32)
-        {
-          shift_amount -= 32;
-        }
-
-        if (shift_amount == 32)
-        {
-         res = rm_data;
-          if (s)
-          {
-            cpu->cpsr.b.c = rm_data >> 31;
-          }
-        }
-        else
-        {
-          if (s)
-          {
-            cpu->cpsr.b.c = (rm_data >> (shift_amount - 1)) & 0x1;
-          }
-          res = rotate_right(rm_data, shift_amount);
-        }
-        break;
-      }
-    }
-  }
-  return res;
+  return compute_shift(cpu, rm_data, shift_type, shift_amount, s);
 }
 
 /**
@@ -587,6 +537,20 @@ instr_msr_psrf(cpu_t* cpu, op_msr_psrf_t* opcode)
   }
 }
 
+/**
+ * Computes the immediate operand of a data processing instruction
+ * @param imm 12 bit operand field: 4 bit rotation and 8 bit value
+ * @return Rotated immediate
+ */
+static inline int32_t
+data_processing_imm(uint32_t imm)
+{
+  uint32_t rotate_amount = (imm >> 8) & 0xF;
+
+  /* Zero extend imm to 32 bits */
+  return rotate_right(imm & 0xFF, rotate_amount * 2);
+}
+
 /**
  * Emulates a data processing instruction
  *
@@ -596,8 +560,7 @@ instr_msr_psrf(cpu_t* cpu, op_msr_psrf_t* opcode)
 static inline void
 instr_single_data_processing(cpu_t* cpu, op_data_proc_t* opcode)
 {
-  int32_t op1, op2, res;
-  int64_t res64;
+  int32_t op1, op2;
 
   /* Get first operand */
   op1 = cpu_read_register(cpu, opcode->Rn);
@@ -606,236 +569,155 @@ instr_single_data_processing(cpu_t* cpu, op_data_proc_t* opcode)
   if (opcode->i)
   {
     /* Operand 2 is an immediate value */
-    uint32_t rotate_amount = (opcode->imm >> 8) & 0xF;
-    uint32_t imm = 0x0;
-
-    /* Zero extend imm to 32 bits */
-    imm |= opcode->imm & 0xFF;
-    op2 = rotate_right(imm, rotate_amount * 2);
+    op2 = data_processing_imm(opcode->imm);
   }
   else
   {
     op2 = compute_offset_operand2(cpu, ((opcode->imm) & 0x00000FFF), opcode->s);
   }
 
-  /* Examine the opcode and execute the operation */
-  switch (opcode->op)
+  data_processing(cpu, opcode->op, opcode->s, opcode->Rd, op1, op2);
+}
+
+/**
+ * Executes a block data transfer instruction
+ * @param cpu   Reference to the CPU structure
+ * @param flags OP_L, OP_S, OP_P, OP_U and OP_W bits of the instruction
+ * @param rn    Base register
+ * @param rl    Register list
+ */
+static inline void
+block_data_trans(cpu_t* cpu, uint32_t flags, uint32_t rn, uint32_t rl)
+{
+  /* The register list can't be empty */
+  if (rl == 0)
   {
-    case 0x0: /* AND */
-    case 0x8: /* TST */
-    {
-      res = op1 & op2;
+    emulator_fatal(cpu->emu, "The register list cannot be empty");
+  }
 
-      if (opcode->s || opcode->op == 0x08)
-      {
-        cpu->cpsr.b.z = res == 0;
-        cpu->cpsr.b.n = res >> 31;
-      }
+  /* The base register should never be PC */
+  if (rn == PC)
+  {
+    emulator_fatal(cpu->emu, "Base register cannot be PC");
+  }
 
-      if (opcode->op == 0x0)
-      {
-        cpu_write_register(cpu, opcode->Rd, res);
-      }
-      return;
-    }
-    case 0x1: /* EOR */
-    case 0x9: /* TEQ */
+  /* Assert the s bit is only set in privileged user mode */
+  if (flags & OP_S)
+  {
+    if (cpu->cpsr.b.m == MODE_USR || cpu->cpsr.b.m == MODE_SYS)
     {
-      res = op1 ^ op2;
-      if (opcode->s || opcode->op == 0x09)
-      {
-        cpu->cpsr.b.z = res == 0;
-        cpu->cpsr.b.n = (res & (1 << 31)) != 0;
-      }
+      emulator_fatal(cpu->emu, "Force user mode set in non-priveleged mode");
+    }
+  }
 
-      if (opcode->op == 0x1)
-      {
-        cpu_write_register(cpu, opcode->Rd, res);
-      }
-      return;
+  uint32_t address = cpu_read_register(cpu, rn) & 0xfffffffc;
+  uint32_t offset = (flags & OP_U) ? 4 : -4;
+  uint32_t count = __builtin_popcount(rl);
+  uint32_t data[16], start, value;
+  int16_t reg;
+
+  /* Registers occupy consecutive words, the lowest one at start, so the
+   * whole range is transferred at once */
+  start = (flags & OP_U)
+        ? address + ((flags & OP_P) ? 4 : 0)
+        : address - (count << 2) + ((flags & OP_P) ? 0 : 4);
+  if (flags & OP_L)
+  {
+    memory_read_block(cpu->memory, start, data, count << 2);
+  }
+
+  /* Push registers */
+  for (
+    reg = (flags & OP_U) ? 0 : 15;
+    (flags & OP_U) ? (reg < 16) : (reg >= 0);
+    reg += (flags & OP_U) ? 1 : -1)
+  {
+    /* Test whether to include register `reg` */
+    if (!(rl & (1 << reg))){
+      continue;
     }
-    case 0x2: /* SUB */
-    case 0xA: /* CMP */
-    case 0x3: /* RSB */
+
+    /* pre-increment addressing */
+    if (flags & OP_P)
     {
-      if (opcode->op == 0x3)
-      {
-        op1 ^= op2;
-        op2 ^= op1;
-        op1 ^= op2;
-      }
+      address += offset;
+    }
 
-      res64 = (int64_t)op1 - (int64_t)op2;
-      res = res64 & ((1LL << 32) - 1);
+    /* The spec is somewhat ambigous about when base is included in reg list.
+     * It's unclear what the expected behaviour is for pre-increment addressing
+     * This seems like the most logical functionality correct. */
+    if ((flags & OP_W) && (uint32_t)reg == rn)
+    {
+      cpu_write_register(cpu, rn, address);
+    }
 
-      if (opcode->s || opcode->op == 0x0A)
+    /* Load/store from the buffer */
+    if (flags & OP_L)
+    {
+      value = data[(address - start) >> 2];
+      if (flags & OP_S)
       {
-        cpu->cpsr.b.z = res == 0;
-        cpu->cpsr.b.n = (res & (1 << 31)) != 0;
-        cpu->cpsr.b.c = ((res64 >> 32) & 1) == 0;
-
-        cpu->cpsr.b.v = 0;
-        if (op1 >= 0 && op2 < 0 && res < 0)
-        {
-          /* positive - negative = negative => overflow */
-          cpu->cpsr.b.v = 1;
-        }
-        else if (op1 < 0 && op2 >= 0 && res >= 0)
-        {
-          /* negative - positive = positive => overflow */
-          cpu->cpsr.b.v = 1;
-        }
+        *user_register(cpu, reg) = value;
       }
-
-      if (opcode->op == 0x2 || opcode->op == 0x3)
+      else
       {
-        cpu_write_register(cpu, opcode->Rd, res);
+        cpu_write_register(cpu, reg, value);
       }
-
-      return;
     }
-    case 0x4: /* ADD */
-    case 0xB: /* CMN */
+    else
     {
-      res64 = (int64_t)op1 + (int64_t)op2;
-      res = res64 & ((1LL << 32) - 1);
-
-      if (opcode->s || opcode->op == 0xB)
+      /* If S bit set, transfer user bank */
+      if (flags & OP_S)
       {
-        cpu->cpsr.b.z = res == 0;
-        cpu->cpsr.b.n = (res & (1 << 31)) != 0;
-        cpu->cpsr.b.c = (res64 >> 32) != 0;
-
-        cpu->cpsr.b.v = 0;
-        if (op1 < 0 && op2 < 0 && res > 0)
-        {
-          /* negative + negative = positive => overflow */
-          cpu->cpsr.b.v = 1;
-        }
-
-        if (op1 > 0 && op2 > 0 && res < 0)
-        {
-          /* positive + positive = negative => overflow */
-          cpu->cpsr.b.v = 1;
-        }
+        value = *user_register(cpu, reg);
       }
-      if (opcode->op == 0x4)
+      else
       {
-        cpu_write_register(cpu, opcode->Rd, res);
+        value = cpu_read_register(cpu, reg);
       }
-      return;
+      data[(address - start) >> 2] = value;
     }
-    case 0x5: /* ADC */
-    {
-      res64 = (int64_t)op1 + (int64_t)op2 + (int64_t)cpu->cpsr.b.c;
-      res = res64 & ((1LL << 32) - 1);
 
-      if (opcode->s)
-      {
-        cpu->cpsr.b.z = res == 0;
-        cpu->cpsr.b.n = res >> 31;
-        if (op1 < 0 && op2 < 0 && res > 0)
-        {
-          /* negative + negative = positive => overflow */
-          cpu->cpsr.b.v = 1;
-        }
-
-        if (op1 > 0 && op2 > 0 && res < 0)
-        {
-          /* positive + positive = negative => overflow */
-          cpu->cpsr.b.v = 1;
-        }
-        cpu->cpsr.b.c = res64 >> 32 != 0;
-      }
-      cpu_write_register(cpu, opcode->Rd, res);
-      return ;
-    }
-    case 0x6: /* SBC  => op1 - op2 + carry - 1 */
-    case 0x7: /* RSC  => op2 - op1 + carry - 1 */
-    {
-      if (opcode->op == 0x7){
-        int32_t t;
-
-        t = op1;
-        op1 = op2;
-        op2 = t;
-      }
-
-      res64 = (int64_t)op1 - (int64_t)op2 + (int64_t)cpu->cpsr.b.c - 1LL;
-      res = res64 & ((1LL << 32) - 1);
-
-      if (opcode->s)
-      {
-        cpu->cpsr.b.z = res == 0;
-        cpu->cpsr.b.n = (res & (1 << 31)) != 0;
-        cpu->cpsr.b.c = (~(res64 >> 32)) != 0;
-
-        cpu->cpsr.b.v = 0;
-        if (op1 >= 0 && op2 < 0 && res < 0)
-        {
-          /* positive - negative = negative => overflow */
-          cpu->cpsr.b.v = 1;
-        }
-        else if (op1 < 0 && op2 >= 0 && res >= 0)
-        {
-          /* negative - positive = positive => overflow */
-          cpu->cpsr.b.v = 1;
-        }
-      }
-      cpu_write_register(cpu, opcode->Rd, res);
-      return;
-    }
-    case 0xC: /* ORR */
-    {
-      res = op1 | op2;
-      if (opcode->s)
-      {
-        cpu->cpsr.b.z = res == 0;
-        cpu->cpsr.b.n = res >> 31;
-      }
-
-      cpu_write_register(cpu, opcode->Rd, res);
-      return;
-    }
-    case 0xD: /* MOV */
+    /* Post-increment addressing */
+    if (!(flags & OP_P))
     {
-      if (opcode->s)
-      {
-        cpu->cpsr.b.z = op2 == 0;
-        cpu->cpsr.b.n = op2 >> 31;
-      }
-
-      cpu_write_register(cpu, opcode->Rd, op2);
-      return;
+      address += offset;
     }
-    case 0xE: /* BIC */
-    {
-      res = op1 & (~op2);
+  }
 
-      if (opcode->s)
-      {
-        cpu->cpsr.b.z = res == 0;
-        cpu->cpsr.b.n = res >> 31;
-      }
+  if (!(flags & OP_L))
+  {
+    memory_write_block(cpu->memory, start, data, count << 2);
+  }
 
-      cpu_write_register(cpu, opcode->Rd, res);
-      return;
-    }
-    case 0xF: /* MVN */
-    {
-      res = ~op2;
-      if (opcode->s)
-      {
-        cpu->cpsr.b.z = res == 0;
-        cpu->cpsr.b.n = res >> 31;
-      }
+  /* If loading PC and user bank bit is set,
+   * copy the spsr for the current mode to flags register */
+  if ((flags & OP_L) && (flags & OP_S) && rl & (1 << PC))
+  {
+    cpu_sync_flags(cpu);
+    write_cpsr(cpu, read_spsr(cpu));
+  }
 
-      cpu_write_register(cpu, opcode->Rd, res);
-      return;
-    }
+  /* Write-back if enabled and base is not in the register list*/
+  if ((flags & OP_W) && (rl & (1 << rn)) == 0)
+  {
+    cpu_write_register(cpu, rn, address);
   }
 }
 
+/**
+ * Packs the transfer bits of a block data transfer into OP_* flags
+ * @param opcode Reference to the opcode structure
+ * @return OP_* flags
+ */
+static inline uint32_t
+block_data_trans_flags(op_block_data_trans_t* opcode)
+{
+  return (opcode->l ? OP_L : 0) | (opcode->s ? OP_S : 0) |
+         (opcode->p ? OP_P : 0) | (opcode->u ? OP_U : 0) |
+         (opcode->w ? OP_W : 0);
+}
+
 /**
  * Executes a block data transfer instruction
  * @param cpu Reference to the CPU structure
@@ -844,100 +726,25 @@ instr_single_data_processing(cpu_t* cpu, op_data_proc_t* opcode)
 static inline void
 instr_block_data_transfer(cpu_t* cpu, op_block_data_trans_t* opcode)
 {
-  /* The register list can't be empty */
-  if (opcode->rl == 0)
-  {
-    emulator_fatal(cpu->emu, "The register list cannot be empty");
-  }
-
-  /* The base register should never be PC */
-  if (opcode->rn == PC)
-  {
-    emulator_fatal(cpu->emu, "Base register cannot be PC");
-  }
-
-  /* Assert the s bit is only set in privileged user mode */
-  if (opcode->s)
-  {
-    if (cpu->cpsr.b.m == MODE_USR || cpu->cpsr.b.m == MODE_SYS)
-    {
-      emulator_fatal(cpu->emu, "Force user mode set in non-priveleged mode");
-    }
-  }
-
-  uint32_t address = cpu_read_register(cpu, opcode->rn) & 0xfffffffc;
-  uint32_t offset = (opcode->u) ? 4 : -4;
-  int16_t reg;
-
-  /* Push registers */
-  for (
-    reg = opcode->u ? 0 : 15;
-    opcode->u ? (reg < 16) : (reg >= 0);
-    reg += opcode->u ? 1 : -1)
-  {
-    /* Test whether to include register `reg` */
-    if (!(opcode->rl & (1 << reg))){
-      continue;
-    }
-
-    /* pre-increment addressing */
-    if (opcode->p)
-    {
-      address += offset;
-    }
-
-    /* The spec is somewhat ambigous about when base is included in reg list.
-     * It's unclear what the expected behaviour is for pre-increment addressing
-     * This seems like the most logical functionality correct. */
-    if (opcode->w && reg == opcode->rn)
-    {
-      cpu_write_register(cpu, opcode->rn, address);
-    }
-
-    /* Load/store from memory */
-    if (opcode->l)
-    {
-      if (opcode->s)
-      {
-        cpu->r_usr.r[reg] = memory_read_dword_le(cpu->memory, address);
-      }
-      else
-      {
-        cpu_write_register(cpu, reg, memory_read_dword_le(cpu->memory, address));
-      }
-    }
-    else
-    {
-      /* If S bit set, transfer user bank */
-      if (opcode->s)
-      {
-        memory_write_dword_le(cpu->memory, address, cpu->r_usr.r[reg]);
-      }
-      else
-      {
-        memory_write_dword_le(cpu->memory, address, cpu_read_register(cpu, reg));
-      }
-    }
-
-    /* Post-increment addressing */
-    if (!opcode->p)
-    {
-      address += offset;
-    }
-  }
+  block_data_trans(cpu, block_data_trans_flags(opcode), opcode->rn,
+                   opcode->rl);
+}
 
-  /* If loading PC and user bank bit is set,
-   * copy the spsr for the current mode to flags register */
-  if (opcode->l && opcode->s && opcode->rl & (1 << PC))
+/**
+ * Sign extends the 24 bit word offset of a branch to a byte offset
+ * @param offset Offset field of the instruction
+ * @return Byte offset
+ */
+static inline uint32_t
+branch_offset(uint32_t offset)
+{
+  offset = offset << 2;
+  if (offset & (1 << 25))
   {
-    cpu->cpsr.r = read_spsr(cpu);
+    offset |= ~0x03FFFFFF;
   }
 
-  /* Write-back if enabled and base is not in the register list*/
-  if (opcode->w && (opcode->rl & (1 << opcode->rn)) == 0)
-  {
-    cpu_write_register(cpu, opcode->rn, address);
-  }
+  return offset;
 }
 
 /**
@@ -945,20 +752,14 @@ instr_block_data_transfer(cpu_t* cpu, op_block_data_trans_t* opcode)
  * BL: add offset to PC and set LR to PC + 4
  * B:  add offset to PC
  *
- * @param cpu Reference to the CPU context
- * @param opcode Opcode for the branch instruction
+ * @param cpu    Reference to the CPU context
+ * @param offset Sign extended byte offset
+ * @param l      Set for branch with link
  */
 static inline void
-instr_branch(cpu_t* cpu, op_branch_t* opcode)
+branch(cpu_t* cpu, uint32_t offset, uint32_t l)
 {
-  uint32_t offset, pc, lr;
-
-  /* Sign extend offset */
-  offset = opcode->offset << 2;
-  if (offset & (1 << 25))
-  {
-    offset |= ~0x03FFFFFF;
-  }
+  uint32_t pc, lr;
 
   /* Add offset to PC */
   pc = cpu_read_register(cpu, PC);
@@ -967,32 +768,70 @@ instr_branch(cpu_t* cpu, op_branch_t* opcode)
   cpu_write_register(cpu, PC, pc);
 
   /* Branch with link */
-  if (opcode->l)
+  if (l)
   {
     cpu_write_register(cpu, LR, lr);
   }
 }
 
 /**
- * Executes a branch with exchange operation
- * BX: Assigns PC to the contents of Rn
+ * Executes a branch or a branch with link instruction
  *
  * @param cpu Reference to the CPU context
- * @param opcode Opcode for the BX instruction
+ * @param opcode Opcode for the branch instruction
  */
 static inline void
-instr_branch_exchange(cpu_t* cpu, op_branch_exchange_t* opcode)
+instr_branch(cpu_t* cpu, op_branch_t* opcode)
+{
+  branch(cpu, branch_offset(opcode->offset), opcode->l);
+}
+
+/**
+ * Jumps to the address held in a register. Bit 0 of the address selects
+ * THUMB, which is not supported.
+ * @param cpu Reference to the CPU context
+ * @param rm  Register holding the target
+ */
+static inline void
+branch_exchange(cpu_t* cpu, uint32_t rm)
 {
-  if (opcode->Rn & 0x1)
+  uint32_t pc = cpu_read_register(cpu, rm);
+
+  if (pc & 0x1)
   {
     emulator_fatal(cpu->emu, "Cannot switch to THUMB instruction set");
   }
 
   /* Write new PC value */
-  uint32_t pc = cpu_read_register(cpu, opcode->Rn);
   cpu_write_register(cpu, PC, pc);
 }
 
+/**
+ * Executes a branch with exchange operation
+ * BX: Assigns PC to the contents of Rn
+ *
+ * @param cpu Reference to the CPU context
+ * @param opcode Opcode for the BX instruction
+ */
+static inline void
+instr_branch_exchange(cpu_t* cpu, op_branch_exchange_t* opcode)
+{
+  branch_exchange(cpu, opcode->Rn);
+}
+
+/**
+ * Packs the transfer bits of a single data transfer into OP_* flags
+ * @param opcode Reference to the opcode structure
+ * @return OP_* flags
+ */
+static inline uint32_t
+single_data_trans_flags(op_single_data_trans_t* opcode)
+{
+  return (opcode->l ? OP_L : 0) | (opcode->b ? OP_B : 0) |
+         (opcode->p ? OP_P : 0) | (opcode->u ? OP_U : 0) |
+         (opcode->w ? OP_W : 0);
+}
+
 /**
  * Emulates Single Data Transfer Instructions
  * @param cpu - Reference to cpu structure
@@ -1004,8 +843,7 @@ instr_single_data_trans(cpu_t* cpu, op_single_data_trans_t* opcode)
   assert(cpu);
   assert(opcode);
 
-  uint32_t rn, offset, addr;
-  rn = cpu_read_register(cpu, opcode->rn);
+  uint32_t offset;
 
   /* If i bit is set offset is interpreted as a shifted register,
      otherwise it is interpreted as an unsigned 12 bit immediate offset */
@@ -1018,57 +856,8 @@ instr_single_data_trans(cpu_t* cpu, op_single_data_trans_t* opcode)
     offset = (opcode->offset) & 0x00000FFF;
   }
 
-  /* if p bit is set perform pre-indexing, post-indexing otherwise */
-  if (opcode->p)
-  {
-    rn = opcode->u ? (rn + offset) : (rn - offset);
-    addr = rn;
-  }
-  else
-  {
-    addr = rn;
-    rn = opcode->u ? (rn + offset) : (rn - offset);
-  }
-
-  /* if l bit is set perform load, store otherwise */
-  if (opcode->l)
-  {
-     /* if b is set load byte, word otherwise */
-    if (opcode->b)
-    {
-      cpu_write_register(
-        cpu, opcode->rd, (uint32_t)memory_read_byte(cpu->memory, addr));
-    }
-    else
-    {
-      cpu_write_register(
-        cpu, opcode->rd, memory_read_dword_le(cpu->memory, addr));
-     }
-  }
-  else
-  {
-    /* if b is set store byte, word otherwise */
-    if (opcode->b)
-    {
-      memory_write_byte(cpu->memory, addr, cpu_read_register(cpu, opcode->rd));
-    }
-    else
-    {
-      memory_write_dword_le(cpu->memory, addr, cpu_read_register(cpu, opcode->rd));
-    }
-  }
-
-  /* if post-indexing or w bit is set write back into the base register */
-  if (opcode->w || !(opcode->p))
-  {
-    /* w must not be set if PC is specified as the base register */
-    if (opcode->rn == PC)
-    {
-      emulator_fatal(cpu->emu, "Writeback to PC not allowed");
-    }
-
-    cpu_write_register(cpu, opcode->rn, rn);
-  }
+  single_data_trans(cpu, single_data_trans_flags(opcode), opcode->rd,
+                    opcode->rn, offset);
 }
 
 /**
@@ -1343,6 +1132,44 @@ instr_coproc_data_transfer(cpu_t* cpu, op_coproc_data_transfer_t* opcode)
   }
 }
 
+/**
+ * Emulates a CP15 register transfer. I-cache invalidate operations drop the
+ * cached code, everything else is ignored.
+ * @param cpu Reference to the cpu structure
+ * @param opcode Reference to the instruction structure
+ */
+static inline void
+instr_cp15_reg_transfer(cpu_t* cpu, op_coproc_reg_transfer_t* opcode)
+{
+  uint32_t addr;
+
+  /* MCR p15, 0, Rd, c7, c5 (I-cache) or c7 (both caches), op2 */
+  if (opcode->l || opcode->CRn != 7 || (opcode->CRm != 5 && opcode->CRm != 7))
+  {
+    return;
+  }
+
+  switch (opcode->CP)
+  {
+    case 0: case 2:
+    {
+      /* Entire cache, or a set/way which cannot be mapped to an address */
+      cpu_flush_code(cpu);
+      break;
+    }
+    case 1:
+    {
+      /* Line given by its address */
+      addr = cpu_read_register(cpu, opcode->Rd) & 0x3FFFFFFF;
+      if (addr < cpu->emu->mem_size)
+      {
+        cpu_flush_page(cpu, addr);
+      }
+      break;
+    }
+  }
+}
+
 /**
  * Emulates a coprocessor data processing instruction
  * @param cpu Reference to the cpu structure
@@ -1372,7 +1199,8 @@ instr_coproc_reg_transfer(cpu_t* cpu, op_coproc_reg_transfer_t* opcode)
     }
     case 15:
     {
-      /* Ignore this coprocessor */
+      /* System control coprocessor, only cache maintenance is emulated */
+      instr_cp15_reg_transfer(cpu, opcode);
       break;
     }
     default:
@@ -1402,6 +1230,7 @@ instr_swi(cpu_t* cpu, op_swi_t* UNUSED(opcode))
   cpu_write_register(cpu, PC, 0x08);
 
   /* Save CPSR in SPSR_svc */
+  cpu_sync_flags(cpu);
   write_spsr(cpu, cpu->cpsr.r);
 }
 
@@ -1422,6 +1251,7 @@ instr_undefined(cpu_t* cpu)
   cpu_write_register(cpu, PC, 0x04);
 
   /* Save CPSR in SPSR_svc */
+  cpu_sync_flags(cpu);
   write_spsr(cpu, cpu->cpsr.r);
 }
 
@@ -1581,6 +1411,7 @@ cpu_init(cpu_t* cpu, emulator_t* emu)
   cpu->memory = &emu->memory;
 
   /* Initialise registers to zero */
+  memset(&cpu->regs, 0, sizeof(cpu->regs));
   memset(&cpu->r_usr, 0, sizeof(cpu->r_usr));
   memset(&cpu->r_fiq, 0, sizeof(cpu->r_fiq));
   memset(&cpu->r_irq, 0, sizeof(cpu->r_irq));
@@ -1591,157 +1422,641 @@ cpu_init(cpu_t* cpu, emulator_t* emu)
   /* Start in supervisor mode */
   cpu->cpsr.b.m = MODE_SVC;
 
+  /* No pending flag updates */
+  memset(&cpu->flags, 0, sizeof(cpu->flags));
+  cpu->flags.eager = emu->eager_flags;
+
   /* Initialise spsr to zero */
   memset(&cpu->spsr, 0, sizeof(cpu->spsr));
 
+  /* Pages of the instruction cache are allocated on first use */
+  cpu->icache_pages = (emu->mem_size + 0xFFF) >> 12;
+  cpu->icache = (cpu_op_t**)calloc(cpu->icache_pages, sizeof(cpu_op_t*));
+  assert(cpu->icache);
+  cpu->fetch_page = NULL;
+  cpu->fetch_base = CPU_FETCH_NONE;
+
   /* Load start address */
   cpu_write_register(cpu, PC, emu->start_addr);
 }
 
 /**
- * Fecthes, decodes and executed a single instruction
- * @param cpu   Reference to the CPU structure
+ * Class of an instruction with bits 27-26 clear, given bits 27-20 (h) and
+ * 7-4 (l). Slots where the class depends on other bits are marked as
+ * CLS_MISC: BX, SWP, MRS, MSR and halfword transfers with a register offset.
  */
-void
-cpu_tick(cpu_t* cpu)
+#define DECODE_00(h, l)                                                      \
+  ((h) >> 2 == 0x00 && (l) == 0x9 ? CLS_MUL :                                \
+   (h) >> 2 == 0x02 && (l) == 0x9 ? CLS_MULL :                               \
+   ((h) == 0x12 && (l) == 0x1) ||                                            \
+   (((h) & 0xF4) == 0x10 && (l) == 0x9) ||                                   \
+   (((h) & 0x03) == 0x00 && (l) == 0x0) ||                                   \
+   ((h) & 0xDB) == 0x12 ||                                                   \
+   (((h) & 0xE4) == 0x00 && ((l) & 0x9) == 0x9) ? CLS_MISC :                 \
+   ((h) & 0xE4) == 0x04 && ((l) & 0x9) == 0x9 ? CLS_HW :                     \
+   CLS_DP)
+
+/**
+ * Class of an instruction given bits 27-20 (h) and 7-4 (l)
+ */
+#define DECODE(h, l)                                                         \
+  ((h) >> 6 == 0x0 ? DECODE_00(h, l) :                                       \
+   (h) >> 5 == 0x3 && ((l) & 0x1) ? CLS_UNDEF :                              \
+   (h) >> 6 == 0x1 ? CLS_SDT :                                               \
+   (h) >> 5 == 0x4 ? CLS_BDT :                                               \
+   (h) >> 5 == 0x5 ? CLS_BRANCH :                                            \
+   (h) >> 5 == 0x6 ? CLS_CP_TRANS :                                          \
+   (h) >> 4 == 0xE ? ((l) & 0x1 ? CLS_CP_REG : CLS_CP_DP) :                  \
+   CLS_SWI)
+
+#define DECODE_4(i)   DECODE((i) >> 4, (i) & 0xF),                           \
+                      DECODE(((i) + 1) >> 4, ((i) + 1) & 0xF),               \
+                      DECODE(((i) + 2) >> 4, ((i) + 2) & 0xF),               \
+                      DECODE(((i) + 3) >> 4, ((i) + 3) & 0xF)
+#define DECODE_16(i)  DECODE_4(i),     DECODE_4((i) + 4),                    \
+                      DECODE_4((i) + 8),   DECODE_4((i) + 12)
+#define DECODE_64(i)  DECODE_16(i),    DECODE_16((i) + 16),                  \
+                      DECODE_16((i) + 32),  DECODE_16((i) + 48)
+#define DECODE_256(i) DECODE_64(i),    DECODE_64((i) + 64),                  \
+                      DECODE_64((i) + 128), DECODE_64((i) + 192)
+#define DECODE_1K(i)  DECODE_256(i),   DECODE_256((i) + 256),                \
+                      DECODE_256((i) + 512), DECODE_256((i) + 768)
+
+/**
+ * Instruction classes indexed by bits 27-20 and 7-4, built at compile time
+ */
+const uint8_t cpu_decode_table[4096] =
 {
-  uint32_t instr = 0;
-  uint32_t pc;
+  DECODE_1K(0x000), DECODE_1K(0x400), DECODE_1K(0x800), DECODE_1K(0xC00)
+};
 
-  /* Fetch a single instruction */
-  pc = cpu->r_usr.reg.pc;
-  instr = memory_read_dword_le(cpu->memory, pc);
-  cpu->r_usr.reg.pc = pc + 4;
+#undef DECODE_1K
+#undef DECODE_256
+#undef DECODE_64
+#undef DECODE_16
+#undef DECODE_4
+#undef DECODE
+#undef DECODE_00
 
-  /* Terminate on NOP */
-  if (instr == 0x0)
+/**
+ * Classifies the instructions of the CLS_MISC slots. The order of the tests
+ * matters since some of the encodings overlap.
+ * @param instr Instruction word, with bits 27-26 clear
+ * @return Class of the instruction
+ */
+cpu_class_t
+cpu_classify_misc(uint32_t instr)
+{
+  if ((instr & 0x0FFFFFF0) == 0x012FFF10)
   {
-    cpu->emu->terminated = 1;
-    return;
+    return CLS_BX;
   }
-
-  /* Ignore PLD */
-  if (instr == 0xf5d1f100)
+  if ((instr & 0x0F400FF0) == 0x01000090)
   {
-    return;
+    return CLS_SWP;
   }
-
-  /* Check condition */
-  if (!check_cond(cpu, instr >> 28))
+  if ((instr & 0x003F0FFF) == 0x000F0000)
   {
-    return;
+    return CLS_MRS;
   }
-
-  /* For debug purposes, let WFI be a "break here" instruction, causing the
-   * emulator to wait for input before continuing */
-  if ((instr & 0x0fff00ff) == 0x03200003)
+  if ((instr & 0x0FBFFFF0) == 0x0129F000)
   {
-    debug_break(cpu);
+    return CLS_MSR;
   }
-
-  switch ((instr >> 24) & 0xF)
+  if ((instr & 0x0DBFF000) == 0x0128F000)
   {
-    case 0x0: case 0x1: case 0x2: case 0x3:
-    {
-      if ((instr & 0x0FFFFFF0) == 0x012FFF10)
-      {
-        // Branch and exchange
-        instr_branch_exchange(cpu, (op_branch_exchange_t*)&instr);
-      }
-      else if ((instr & 0x0FC000F0) == 0x00000090)
-      {
-        /* Multiply */
-        instr_multiply(cpu, (op_multiply_t*)&instr);
-      }
-      else if ((instr & 0x0FC000F0) == 0x00800090)
-      {
-        /* Multiply Long */
-        instr_multiply_long(cpu, (op_multiply_long_t*)&instr);
-      }
-      else if ((instr & 0x0F400FF0) == 0x01000090)
-      {
-        // Single data swap
-        instr_single_data_swap(cpu, (op_single_data_swap_t*)&instr);
-      }
-      else if ((instr & 0x003F0FFF) == 0x000F0000)
-      {
-        // MRS
-        instr_mrs(cpu, (op_mrs_t*)&instr);
-      }
-      else if ((instr & 0x0FBFFFF0) == 0x0129F000)
-      {
-        // MSR
-        instr_msr_psr(cpu, (op_msr_psr_t*)&instr);
-      }
-      else if ((instr & 0x0DBFF000) == 0x0128F000)
-      {
-        // MSR flags only
-        instr_msr_psrf(cpu, (op_msr_psrf_t*)&instr);
-      }
-      else if ((instr & 0x0E400F90) == 0x00000090)
-      {
-        // Halfword and signed data transfer register offset
-        instr_hw_sd_transfer(cpu, (op_hw_sd_trans_t*)&instr);
-      }
-      else if ((instr & 0x0E400090) == 0x00400090)
-      {
-        // Halfword and singed data transfer immediate offset
-        instr_hw_sd_transfer(cpu, (op_hw_sd_trans_t*)&instr);
-      }
-      else
-      {
-        // Data processing instruction
-        instr_single_data_processing(cpu, (op_data_proc_t*) &instr);
-      }
+    return CLS_MSRF;
+  }
+  if ((instr & 0x0E400F90) == 0x00000090 ||
+      (instr & 0x0E400090) == 0x00400090)
+  {
+    return CLS_HW;
+  }
+
+  return CLS_DP;
+}
+
+/**
+ * Decodes and executes a single instruction, without checking the condition
+ * @param cpu   Reference to the CPU structure
+ * @param instr Instruction word
+ */
+static void
+cpu_execute(cpu_t* cpu, uint32_t instr)
+{
+  /* For debug purposes, let WFI be a "break here" instruction, causing the
+   * emulator to wait for input before continuing */
+  if ((instr & 0x0fff00ff) == 0x03200003)
+  {
+    debug_break(cpu);
+  }
+
+  switch (cpu_classify(instr))
+  {
+    case CLS_DP:
+    {
+      instr_single_data_processing(cpu, (op_data_proc_t*)&instr);
       break;
     }
-    case 0x4: case 0x5: case 0x6: case 0x7:
+    case CLS_MUL:
     {
-      if ((instr & 0x0E000010) == 0x06000010)
-      {
-        // Undefined
-        instr_undefined(cpu);
-      }
-      else
-      {
-        // Single data transfer
-        instr_single_data_trans(cpu, (op_single_data_trans_t*) &instr);
-      }
+      instr_multiply(cpu, (op_multiply_t*)&instr);
+      break;
+    }
+    case CLS_MULL:
+    {
+      instr_multiply_long(cpu, (op_multiply_long_t*)&instr);
+      break;
+    }
+    case CLS_SWP:
+    {
+      instr_single_data_swap(cpu, (op_single_data_swap_t*)&instr);
+      break;
+    }
+    case CLS_MRS:
+    {
+      instr_mrs(cpu, (op_mrs_t*)&instr);
+      break;
+    }
+    case CLS_MSR:
+    {
+      instr_msr_psr(cpu, (op_msr_psr_t*)&instr);
+      break;
+    }
+    case CLS_MSRF:
+    {
+      instr_msr_psrf(cpu, (op_msr_psrf_t*)&instr);
+      break;
+    }
+    case CLS_HW:
+    {
+      instr_hw_sd_transfer(cpu, (op_hw_sd_trans_t*)&instr);
+      break;
+    }
+    case CLS_BX:
+    {
+      instr_branch_exchange(cpu, (op_branch_exchange_t*)&instr);
       break;
     }
-    case 0x8: case 0x9:
+    case CLS_UNDEF:
+    {
+      instr_undefined(cpu);
+      break;
+    }
+    case CLS_SDT:
+    {
+      instr_single_data_trans(cpu, (op_single_data_trans_t*)&instr);
+      break;
+    }
+    case CLS_BDT:
     {
       instr_block_data_transfer(cpu, (op_block_data_trans_t*)&instr);
       break;
     }
-    case 0xA: case 0xB:
+    case CLS_BRANCH:
     {
       instr_branch(cpu, (op_branch_t*)&instr);
       break;
     }
-    case 0xC: case 0xD:
+    case CLS_CP_TRANS:
     {
       instr_coproc_data_transfer(cpu, (op_coproc_data_transfer_t*)&instr);
       break;
     }
-    case 0xE:
+    case CLS_CP_DP:
+    {
+      instr_coproc_data_proc(cpu, (op_coproc_data_proc_t*)&instr);
+      break;
+    }
+    case CLS_CP_REG:
+    {
+      instr_coproc_reg_transfer(cpu, (op_coproc_reg_transfer_t*)&instr);
+      break;
+    }
+    case CLS_SWI:
+    {
+      instr_swi(cpu, (op_swi_t*)&instr);
+      break;
+    }
+    case CLS_MISC:
+    {
+      /* Resolved by cpu_classify */
+      break;
+    }
+  }
+}
+
+/**
+ * Executes an instruction which does not have a specialised handler
+ */
+static void
+exec_generic(cpu_t* cpu, const cpu_op_t* op)
+{
+  cpu_execute(cpu, op->instr);
+}
+
+/**
+ * Stops the emulator (all-zero word)
+ */
+static void
+exec_halt(cpu_t* cpu, const cpu_op_t* UNUSED(op))
+{
+  cpu->emu->terminated = 1;
+}
+
+/**
+ * Executes an instruction which is ignored (PLD)
+ */
+static void
+exec_nop(cpu_t* UNUSED(cpu), const cpu_op_t* UNUSED(op))
+{
+}
+
+/**
+ * Data processing with a rotated immediate operand
+ */
+static void
+exec_dp_imm(cpu_t* cpu, const cpu_op_t* op)
+{
+  data_processing(cpu, op->alu, op->flags & OP_S, op->rd,
+                  cpu_read_register(cpu, op->rn), op->imm);
+}
+
+/**
+ * Data processing with a register operand shifted by an immediate
+ */
+static void
+exec_dp_reg(cpu_t* cpu, const cpu_op_t* op)
+{
+  int32_t op1, op2;
+
+  op1 = cpu_read_register(cpu, op->rn);
+  op2 = compute_shift(cpu, cpu_read_register(cpu, op->rm), op->stype,
+                      op->shift, op->flags & OP_S);
+  data_processing(cpu, op->alu, op->flags & OP_S, op->rd, op1, op2);
+}
+
+/**
+ * Single data transfer with an immediate offset
+ */
+static void
+exec_sdt_imm(cpu_t* cpu, const cpu_op_t* op)
+{
+  single_data_trans(cpu, op->flags, op->rd, op->rn, op->imm);
+}
+
+/**
+ * Single data transfer with a register offset shifted by an immediate
+ */
+static void
+exec_sdt_reg(cpu_t* cpu, const cpu_op_t* op)
+{
+  uint32_t offset;
+
+  offset = compute_shift(cpu, cpu_read_register(cpu, op->rm), op->stype,
+                         op->shift, 0);
+  single_data_trans(cpu, op->flags, op->rd, op->rn, offset);
+}
+
+/**
+ * Branch and branch with link
+ */
+static void
+exec_branch(cpu_t* cpu, const cpu_op_t* op)
+{
+  branch(cpu, op->imm, op->flags & OP_L);
+}
+
+/**
+ * Multiply and multiply accumulate
+ */
+static void
+exec_mul(cpu_t* cpu, const cpu_op_t* op)
+{
+  multiply(cpu, op->flags, op->rd, op->rn, op->rm, op->rs);
+}
+
+/**
+ * Block data transfer
+ */
+static void
+exec_bdt(cpu_t* cpu, const cpu_op_t* op)
+{
+  block_data_trans(cpu, op->flags, op->rn, op->imm);
+}
+
+/**
+ * Branch and exchange
+ */
+static void
+exec_bx(cpu_t* cpu, const cpu_op_t* op)
+{
+  branch_exchange(cpu, op->rm);
+}
+
+/**
+ * Decodes an instruction into a predecoded record. The class comes from the
+ * same table as in cpu_execute. Data processing, single and block data
+ * transfers, multiplies and branches get their own handler, everything else
+ * is left to the generic one.
+ * @param op    Record to fill in
+ * @param instr Instruction word
+ */
+static void
+cpu_decode(cpu_op_t* op, uint32_t instr)
+{
+  memset(op, 0, sizeof(*op));
+  op->instr = instr;
+  op->cond = instr >> 28;
+  op->exec = exec_generic;
+  op->kind = OPK_GENERIC;
+
+  /* Terminate on NOP, ignore PLD. These are not conditional. */
+  if (instr == 0x0)
+  {
+    op->cond = CC_AL;
+    op->exec = exec_halt;
+    op->kind = OPK_HALT;
+    return;
+  }
+  if (instr == 0xf5d1f100)
+  {
+    op->cond = CC_AL;
+    op->exec = exec_nop;
+    op->kind = OPK_NOP;
+    return;
+  }
+
+  /* WFI breakpoint */
+  if ((instr & 0x0fff00ff) == 0x03200003)
+  {
+    return;
+  }
+
+  switch (cpu_classify(instr))
+  {
+    case CLS_DP:
+    {
+      op->rd = (instr >> 12) & 0xF;
+      op->rn = (instr >> 16) & 0xF;
+      op->alu = (instr >> 21) & 0xF;
+      op->flags = (instr & (1 << 20)) ? OP_S : 0;
+
+      if (instr & (1 << 25))
+      {
+        op->imm = data_processing_imm(instr & 0xFFF);
+        op->exec = exec_dp_imm;
+        op->kind = OPK_DP_IMM;
+      }
+      else if ((instr & 0x10) == 0)
+      {
+        op->rm = instr & 0xF;
+        op->stype = (instr >> 5) & 0x3;
+        op->shift = (instr >> 7) & 0x1F;
+        op->exec = exec_dp_reg;
+        op->kind = OPK_DP_REG;
+      }
+      return;
+    }
+    case CLS_SDT:
     {
-      if ((instr & 0x10) == 0)
+      op->rd = (instr >> 12) & 0xF;
+      op->rn = (instr >> 16) & 0xF;
+      op->flags = single_data_trans_flags((op_single_data_trans_t*)&instr);
+
+      if (instr & (1 << 25))
       {
-        instr_coproc_data_proc(cpu, (op_coproc_data_proc_t*)&instr);
+        op->rm = instr & 0xF;
+        op->stype = (instr >> 5) & 0x3;
+        op->shift = (instr >> 7) & 0x1F;
+        op->exec = exec_sdt_reg;
+        op->kind = OPK_SDT_REG;
       }
       else
       {
-        instr_coproc_reg_transfer(cpu, (op_coproc_reg_transfer_t*)&instr);
+        op->imm = instr & 0xFFF;
+        op->exec = exec_sdt_imm;
+        op->kind = OPK_SDT_IMM;
       }
-      break;
+      return;
     }
-    case 0xF:
+    case CLS_BRANCH:
     {
-      // Software Interrupt (SWI)
-      instr_swi(cpu, (op_swi_t*)&instr);
-      break;
+      op->imm = branch_offset(instr & 0x00FFFFFF);
+      op->flags = (instr & (1 << 24)) ? OP_L : 0;
+      op->exec = exec_branch;
+      op->kind = OPK_BRANCH;
+      return;
+    }
+    case CLS_MUL:
+    {
+      op->rd = (instr >> 16) & 0xF;
+      op->rn = (instr >> 12) & 0xF;
+      op->rs = (instr >> 8) & 0xF;
+      op->rm = instr & 0xF;
+      op->flags = ((instr & (1 << 20)) ? OP_S : 0) |
+                  ((instr & (1 << 21)) ? OP_A : 0);
+      op->exec = exec_mul;
+      op->kind = OPK_MUL;
+      return;
     }
+    case CLS_BDT:
+    {
+      op->rn = (instr >> 16) & 0xF;
+      op->imm = instr & 0xFFFF;
+      op->flags = block_data_trans_flags((op_block_data_trans_t*)&instr);
+      op->exec = exec_bdt;
+      op->kind = OPK_BDT;
+      return;
+    }
+    case CLS_BX:
+    {
+      op->rm = instr & 0xF;
+      op->exec = exec_bx;
+      op->kind = OPK_BX;
+      return;
+    }
+    default:
+    {
+      return;
+    }
+  }
+}
+
+/**
+ * Returns the predecoded record of a word in SDRAM, decoding it if it was not
+ * seen before or was overwritten since
+ * @param cpu  Reference to the CPU structure
+ * @param addr Word aligned physical address, inside SDRAM
+ * @return Predecoded instruction
+ */
+static inline cpu_op_t*
+predecode(cpu_t* cpu, uint32_t addr)
+{
+  cpu_op_t *page, *op;
+
+  /* Allocate the page on first use */
+  if (__builtin_expect(!(page = cpu->icache[addr >> 12]), 0))
+  {
+    page = (cpu_op_t*)calloc(CPU_PAGE_OPS, sizeof(cpu_op_t));
+    assert(page);
+    cpu->icache[addr >> 12] = page;
+  }
+
+  op = &page[(addr >> 2) & (CPU_PAGE_OPS - 1)];
+  if (__builtin_expect(!op->exec, 0))
+  {
+    cpu_decode(op, memory_read_dword_le(cpu->memory, addr));
+    memory_set_code(cpu->memory, addr);
+  }
+
+  return op;
+}
+
+/**
+ * Returns the predecoded record of a word in SDRAM
+ * @param cpu  Reference to the CPU structure
+ * @param addr Word aligned physical address, inside SDRAM
+ * @return Predecoded instruction
+ */
+cpu_op_t*
+cpu_predecode(cpu_t* cpu, uint32_t addr)
+{
+  return predecode(cpu, addr);
+}
+
+/**
+ * Drops the predecoded record and the blocks covering a written word. Only
+ * called for pages marked as code, which always have a record page.
+ * @param cpu  Reference to the CPU structure
+ * @param addr Physical address inside SDRAM
+ */
+void
+cpu_invalidate_op(cpu_t* cpu, uint32_t addr)
+{
+  cpu->icache[addr >> 12][(addr >> 2) & (CPU_PAGE_OPS - 1)].exec = NULL;
+  block_invalidate(&cpu->emu->blocks, addr);
+}
+
+/**
+ * Drops all predecoded records and blocks of a page, which then becomes a
+ * data page until code is fetched from it again
+ * @param cpu  Reference to the CPU structure
+ * @param addr Physical address inside SDRAM
+ */
+void
+cpu_flush_page(cpu_t* cpu, uint32_t addr)
+{
+  cpu_op_t *page;
+  size_t i;
+
+  if (!memory_is_code(cpu->memory, addr))
+  {
+    return;
+  }
+
+  /* Records are cleared rather than freed since the running instruction
+   * might be one of them */
+  page = cpu->icache[addr >> 12];
+  for (i = 0; i < CPU_PAGE_OPS; ++i)
+  {
+    page[i].exec = NULL;
+  }
+
+  memory_clear_code(cpu->memory, addr);
+  block_invalidate_page(&cpu->emu->blocks, addr);
+}
+
+/**
+ * Drops all predecoded records and blocks
+ * @param cpu Reference to the CPU structure
+ */
+void
+cpu_flush_code(cpu_t* cpu)
+{
+  size_t i;
+
+  for (i = 0; i < cpu->icache_pages; ++i)
+  {
+    cpu_flush_page(cpu, i << 12);
+  }
+}
+
+/**
+ * Returns the predecoded record of the instruction at a given address. Words
+ * in SDRAM are decoded once and cached, anything else is decoded into tmp.
+ * Fetches from the same page as the previous one skip the lookup.
+ * @param cpu Reference to the CPU structure
+ * @param pc  Address of the instruction
+ * @param tmp Scratch record for uncached instructions
+ * @return Predecoded instruction
+ */
+static inline cpu_op_t*
+cpu_fetch(cpu_t* cpu, uint32_t pc, cpu_op_t* tmp)
+{
+  cpu_op_t *op;
+  uint32_t addr;
+
+  /* Same page and word aligned */
+  if (__builtin_expect((pc & 0xFFFFF003) == cpu->fetch_base, 1))
+  {
+    op = &cpu->fetch_page[(pc >> 2) & (CPU_PAGE_OPS - 1)];
+    if (__builtin_expect(op->exec != NULL, 1))
+    {
+      return op;
+    }
+  }
+
+  addr = pc & 0x3FFFFFFF;
+  if (__builtin_expect((addr & 0x3) != 0 || addr + 3 >= cpu->emu->mem_size, 0))
+  {
+    cpu_decode(tmp, memory_read_dword_le(cpu->memory, pc));
+    return tmp;
+  }
+
+  op = predecode(cpu, addr);
+  cpu->fetch_page = cpu->icache[addr >> 12];
+  cpu->fetch_base = pc & ~0xFFF;
+  return op;
+}
+
+/**
+ * Fecthes, decodes and executed a single instruction
+ * @param cpu   Reference to the CPU structure
+ */
+void
+cpu_tick(cpu_t* cpu)
+{
+  cpu_op_t *op, tmp;
+  uint32_t pc;
+
+  /* Fetch a single instruction */
+  pc = cpu->regs.reg.pc;
+  op = cpu_fetch(cpu, pc, &tmp);
+  cpu->regs.reg.pc = pc + 4;
+
+  /* Check condition */
+  if (op->cond != CC_AL && !cpu_cond_passed(cpu, op->cond))
+  {
+    return;
+  }
+
+  op->exec(cpu, op);
+}
+
+/**
+ * Executes instructions until the budget runs out or the emulator stops
+ * @param cpu    Reference to the CPU structure
+ * @param budget Number of instructions
+ */
+void
+cpu_run(cpu_t* cpu, uint32_t budget)
+{
+  emulator_t *emu = cpu->emu;
+
+  while (budget-- && !emu->terminated)
+  {
+    cpu_tick(cpu);
   }
 }
 
@@ -1750,8 +2065,22 @@ cpu_tick(cpu_t* cpu)
  * @param cpu Reference to the CPU structure
  */
 void
-cpu_destroy(cpu_t *UNUSED(cpu))
+cpu_destroy(cpu_t *cpu)
 {
+  size_t i;
+
+  if (!cpu || !cpu->icache)
+  {
+    return;
+  }
+
+  for (i = 0; i < cpu->icache_pages; ++i)
+  {
+    free(cpu->icache[i]);
+  }
+
+  free(cpu->icache);
+  cpu->icache = NULL;
 }
 
 /**
@@ -1774,6 +2103,7 @@ cpu_dump(cpu_t* cpu)
   /* Increase the displayed PC by 4 */
   reg = cpu_read_register(cpu, PC);
   printf("PC  : %10d (0x%08x)\n", reg, reg);
+  cpu_sync_flags(cpu);
   reg = cpu->cpsr.r & (~0x1F);
   printf("CPSR: %10d (0x%08x)\n", reg, reg);
 }
@@ -65,15 +65,134 @@ typedef enum
   MODE_SYS = 0x1F
 } armMode_t;
 
+/**
+ * Number of predecoded instructions in a 4 KiB page
+ */
+#define CPU_PAGE_OPS 1024
+
+/**
+ * Fetch page address which no PC matches, since bits 2 to 11 are set
+ */
+#define CPU_FETCH_NONE 0xFFC
+
+typedef struct _cpu_t cpu_t;
+typedef struct _cpu_op_t cpu_op_t;
+
+/**
+ * Handler executing a predecoded instruction
+ */
+typedef void (*cpu_exec_t)(cpu_t*, const cpu_op_t*);
+
+/**
+ * Classes of predecoded instructions
+ */
+typedef enum
+{
+  OPK_GENERIC = 0x0,
+  OPK_HALT    = 0x1,
+  OPK_NOP     = 0x2,
+  OPK_DP_IMM  = 0x3,
+  OPK_DP_REG  = 0x4,
+  OPK_SDT_IMM = 0x5,
+  OPK_SDT_REG = 0x6,
+  OPK_BRANCH  = 0x7,
+  OPK_MUL     = 0x8,
+  OPK_BDT     = 0x9,
+  OPK_BX      = 0xA,
+  OPK_COUNT   = 0x10
+} cpu_op_kind_t;
+
+/**
+ * Instruction classes, each executed by one instr_* handler
+ */
+typedef enum
+{
+  CLS_DP       = 0x00,  /* Data processing */
+  CLS_MUL      = 0x01,  /* Multiply */
+  CLS_MULL     = 0x02,  /* Multiply long */
+  CLS_SWP      = 0x03,  /* Single data swap */
+  CLS_MRS      = 0x04,  /* Transfer PSR to register */
+  CLS_MSR      = 0x05,  /* Transfer register to PSR */
+  CLS_MSRF     = 0x06,  /* Transfer register or immediate to PSR flags */
+  CLS_HW       = 0x07,  /* Halfword and signed data transfer */
+  CLS_BX       = 0x08,  /* Branch and exchange */
+  CLS_UNDEF    = 0x09,  /* Undefined */
+  CLS_SDT      = 0x0A,  /* Single data transfer */
+  CLS_BDT      = 0x0B,  /* Block data transfer */
+  CLS_BRANCH   = 0x0C,  /* Branch and branch with link */
+  CLS_CP_TRANS = 0x0D,  /* Coprocessor data transfer */
+  CLS_CP_DP    = 0x0E,  /* Coprocessor data processing */
+  CLS_CP_REG   = 0x0F,  /* Coprocessor register transfer */
+  CLS_SWI      = 0x10,  /* Software interrupt */
+  CLS_MISC     = 0x11   /* Needs bits outside the table index, see
+                         * cpu_classify_misc */
+} cpu_class_t;
+
+/**
+ * Predecoded instruction. Fields are extracted once, when the word is first
+ * fetched, so the handler does not have to look at the raw encoding again.
+ */
+struct _cpu_op_t
+{
+  cpu_exec_t  exec;   /* Handler, NULL if the record is not decoded */
+  uint32_t    instr;  /* Raw instruction word */
+  uint32_t    imm;    /* Rotated immediate, transfer offset, branch offset or
+                       * register list */
+  uint8_t     cond;   /* Condition code */
+  uint8_t     rd;     /* Destination register */
+  uint8_t     rn;     /* First operand / base register */
+  uint8_t     rm;     /* Shifted register, multiplicand or branch target */
+  uint8_t     rs;     /* Multiplier */
+  uint8_t     alu;    /* Data processing opcode */
+  uint8_t     shift;  /* Immediate shift amount */
+  uint8_t     stype;  /* Shift type */
+  uint8_t     flags;  /* OP_* bits */
+  uint8_t     kind;   /* Instruction class */
+  uint8_t     run;    /* In blocks, number of instructions from this one on
+                       * sharing its condition */
+};
+
+/**
+ * Flags of a predecoded instruction
+ */
+#define OP_S 0x01   /* Set condition codes, or transfer user registers */
+#define OP_L 0x02   /* Load / link */
+#define OP_B 0x04   /* Byte transfer */
+#define OP_P 0x08   /* Pre-indexed */
+#define OP_U 0x10   /* Add offset */
+#define OP_W 0x20   /* Write back */
+#define OP_A 0x40   /* Accumulate */
+
+/**
+ * Operations whose carry and overflow flags are evaluated lazily
+ */
+typedef enum
+{
+  FLAGS_NONE = 0x0,
+  FLAGS_ADD  = 0x1,
+  FLAGS_SUB  = 0x2
+} cpu_flags_op_t;
+
 /**
  * CPU data - registers, flags etc
  */
-typedef struct
+struct _cpu_t
 {
   memory_t    *memory;
   emulator_t  *emu;
 
-  /* User mode registers */
+  /* Predecoded instructions, one lazily allocated page per 4 KiB of SDRAM */
+  cpu_op_t   **icache;
+  size_t       icache_pages;
+
+  /* Page of records the interpreter last fetched from and the address of
+   * that page, before aliases are masked out. Records are never freed while
+   * running, so the page stays valid until PC leaves it. */
+  cpu_op_t    *fetch_page;
+  uint32_t     fetch_base;
+
+  /* Registers of the current mode. Banked registers of the other modes are
+   * swapped in and out by cpu_switch_mode. */
   union
   {
     int32_t r[16];
@@ -96,6 +215,22 @@ typedef struct
       int32_t lr;
       int32_t pc;
     } reg;
+  } regs;
+
+  /* Banked USR/SYS, while another mode is active */
+  union
+  {
+    int32_t r[7];
+    struct
+    {
+      int32_t r8;
+      int32_t r9;
+      int32_t r10;
+      int32_t r11;
+      int32_t r12;
+      int32_t r13;
+      int32_t r14;
+    } reg;
   } r_usr;
 
   /* Banked FIQ */
@@ -185,13 +320,116 @@ typedef struct
       uint32_t n:1;
     } b;
   } cpsr;
-} cpu_t;
 
-uint32_t cpu_read_register(const cpu_t* cpu, armReg_t reg);
-void cpu_write_register(cpu_t* cpu, armReg_t reg, uint32_t value);
+  /* Flag updates not yet applied to cpsr, see cpu_sync_flags */
+  struct
+  {
+    int32_t   res;    /* Result giving N and Z */
+    int32_t   op1;    /* Operands giving C and V */
+    int32_t   op2;
+    uint8_t   nz;     /* Nonzero if N and Z are pending */
+    uint8_t   cv;     /* FLAGS_* operation if C and V are pending */
+    uint8_t   eager;  /* Apply every update immediately */
+  } flags;
+};
+
+extern const uint8_t cpu_decode_table[4096];
+extern const uint16_t cpu_cond_table[16];
+
+int check_cond(cpu_t* cpu, armCond_t cc);
+cpu_class_t cpu_classify_misc(uint32_t instr);
+void cpu_eval_flags(cpu_t* cpu);
+void cpu_switch_mode(cpu_t* cpu, armMode_t mode);
 void cpu_init(cpu_t*, emulator_t*);
 void cpu_tick(cpu_t*);
+void cpu_run(cpu_t*, uint32_t budget);
 void cpu_destroy(cpu_t*);
 void cpu_dump(cpu_t*);
+cpu_op_t* cpu_predecode(cpu_t*, uint32_t addr);
+void cpu_invalidate_op(cpu_t*, uint32_t addr);
+void cpu_flush_page(cpu_t*, uint32_t addr);
+void cpu_flush_code(cpu_t*);
+
+/**
+ * Reads the value of a register of the current mode
+ * @param cpu Reference to the CPU structure
+ * @param reg Register index
+ * @return Value of the register, PC reads 8 bytes ahead of the instruction
+ */
+static inline uint32_t
+cpu_read_register(const cpu_t* cpu, armReg_t reg)
+{
+  assert(cpu != NULL);
+  assert(reg <= 0xF);
+
+  if (reg == PC)
+  {
+    return cpu->regs.reg.pc + 4;
+  }
+
+  return cpu->regs.r[reg];
+}
+
+/**
+ * Writes a new value to a register of the current mode
+ * @param cpu   Reference to the CPU structure
+ * @param reg   Register index
+ * @param value Value to be written
+ */
+static inline void
+cpu_write_register(cpu_t* cpu, armReg_t reg, uint32_t value)
+{
+  assert(cpu != NULL);
+  assert(reg <= 0xF);
+
+  cpu->regs.r[reg] = value;
+}
+
+/**
+ * Applies pending flag updates to cpsr. Must be called before the flags
+ * are read or written directly.
+ * @param cpu Reference to the CPU structure
+ */
+static inline void
+cpu_sync_flags(cpu_t* cpu)
+{
+  if (cpu->flags.nz | cpu->flags.cv)
+  {
+    cpu_eval_flags(cpu);
+  }
+}
+
+/**
+ * Checks a condition against the flags through cpu_cond_table
+ * @param cpu Reference to the CPU structure
+ * @param cc  Condition code
+ * @return Nonzero if the condition passes
+ */
+static inline int
+cpu_cond_passed(cpu_t* cpu, armCond_t cc)
+{
+  cpu_sync_flags(cpu);
+  return (cpu_cond_table[cc] >> (cpu->cpsr.r >> 28)) & 1;
+}
+
+/**
+ * Finds the class of an instruction through the decode table, which is
+ * indexed by bits 27-20 and 7-4 of the instruction
+ * @param instr Instruction word
+ * @return Class of the instruction
+ */
+static inline cpu_class_t
+cpu_classify(uint32_t instr)
+{
+  cpu_class_t cls;
+
+  cls = cpu_decode_table[((instr >> 16) & 0xFF0) | ((instr >> 4) & 0xF)];
+  if (__builtin_expect(cls == CLS_MISC, 0))
+  {
+    return cpu_classify_misc(instr);
+  }
+
+  return cls;
+}
 
 #endif /* __CPU_H__ */
@@ -3,6 +3,9 @@
  * (C) 2014 The Team 28 Authors. All rights reserved.
  */
 #include "common.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 
 /**
@@ -13,55 +16,75 @@
 void
 emulator_init(emulator_t* emu)
 {
+  /* SDRAM is mapped in whole pages, the framebuffer is carved out of its top */
+  emu->mem_size = (emu->mem_size + 0xFFF) & ~(size_t)0xFFF;
+
+  /* The display thread stamps input with the system timer */
+  emu->system_timer_base = emulator_get_time() * 1000;
+
   cpu_init(&emu->cpu, emu);
+  block_init(&emu->blocks, emu);
+  if (emu->engine == ENGINE_JIT)
+  {
+    jit_init(&emu->jit, emu);
+  }
   vfp_init(&emu->vfp, emu);
   memory_init(&emu->memory, emu);
   gpio_init(&emu->gpio, emu);
   mbox_init(&emu->mbox, emu);
+  share_init(&emu->share, emu);
   fb_init(&emu->fb, emu);
   pr_init(&emu->pr, emu);
   nes_init(&emu->nes, emu);
   emu->terminated = 0;
-  emu->system_timer_base = emulator_get_time() * 1000;
   emu->last_refresh = 0;
 }
 
 /**
- * Loads a binary image into memory
+ * Loads a binary image into memory. Page aligned images are mapped instead
+ * of copied, so instances booting the same kernel share its pages.
  *
  * @param emu Reference to the emulator structure
  */
 void
 emulator_load(emulator_t* emu, const char *fname)
 {
-  FILE *finput;
+  struct stat st;
   size_t file_size;
+  ssize_t n;
+  int fd;
   void* memory_start = emu->memory.data + emu->start_addr;
 
   /* Throw error if file unopenable. */
-  if (!(finput = fopen(fname, "rb")))
+  if ((fd = open(fname, O_RDONLY)) < 0 || fstat(fd, &st) != 0)
   {
-    emulator_error(emu, "Cannot open file '%s'", fname);
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    emulator_fatal(emu, "Cannot open file '%s'", fname);
   }
 
-
-  fseek(finput, 0L, SEEK_END);
-  file_size = ftell(finput);
-  fseek(finput, 0L, SEEK_SET);
+  file_size = st.st_size;
 
   /* Check for buffer overflow */
   if(emu->start_addr + file_size > emu->mem_size)
   {
+    close(fd);
     emulator_fatal(emu, "Not enough memory for kernel");
   }
 
-  /* Copy instructions into memory and error if incomplete */
-  if (fread(memory_start, 1, file_size, finput) != file_size)
+  /* Otherwise copy instructions into memory and error if incomplete */
+  if (!memory_map_file(&emu->memory, emu->start_addr, fd, file_size))
   {
-    emulator_error(emu, "Could not read entire file '%s'", fname);
+    n = read(fd, memory_start, file_size);
+    if (n < 0 || (size_t)n != file_size)
+    {
+      emulator_error(emu, "Could not read entire file '%s'", fname);
+    }
   }
 
-  fclose(finput);
+  close(fd);
 }
 
 /**
@@ -99,22 +122,32 @@ emulator_get_system_timer(emulator_t* emu)
 }
 
 /**
- * Executes a single step
+ * Executes a batch of instructions, then services the display and input.
+ * The batch ends early if the emulator is stopped.
  *
- * @param emu Reference to the emulator structure
+ * @param emu    Reference to the emulator structure
+ * @param budget Number of instructions to execute
  */
 void
-emulator_tick(emulator_t* emu)
+emulator_run(emulator_t* emu, uint32_t budget)
 {
-  cpu_tick(&emu->cpu);
+  uint64_t now;
 
-  /* When graphics are emulated, we execute a screen refresh after 34ms has
-   * passed (30 frames per second) */
-  uint32_t frame_time = 20;
+  switch (emu->engine)
+  {
+    case ENGINE_INTERP: cpu_run(&emu->cpu, budget); break;
+    case ENGINE_BLOCK: case ENGINE_JIT: block_run(&emu->blocks, budget); break;
+  }
+
+  /* When graphics are emulated, input is applied after every batch and a
+   * frame is handed to the display after EMULATOR_FRAME_TIME has passed.
+   * Host time is only sampled here, once per batch. */
   if (emu->graphics)
   {
-    uint64_t now = emulator_get_time();
-    if ((now - emu->last_refresh) > frame_time)
+    fb_input(&emu->fb);
+
+    now = emulator_get_time();
+    if ((now - emu->last_refresh) > EMULATOR_FRAME_TIME)
     {
       fb_tick(&emu->fb);
       emu->last_refresh = now;
@@ -126,9 +159,12 @@ void
 emulator_destroy(emulator_t* emu)
 {
   fb_destroy(&emu->fb);
+  share_destroy(&emu->share);
   pr_destroy(&emu->pr);
   mbox_destroy(&emu->mbox);
   gpio_destroy(&emu->gpio);
+  block_destroy(&emu->blocks);
+  jit_destroy(&emu->jit);
   cpu_destroy(&emu->cpu);
   vfp_destroy(&emu->vfp);
   memory_destroy(&emu->memory);
@@ -6,6 +6,26 @@
 #ifndef __EMULATOR_H__
 #define __EMULATOR_H__
 
+/**
+ * Number of instructions executed between display and input updates
+ */
+#define EMULATOR_BATCH      65536
+
+/**
+ * Minimum time between two screen refreshes, in milliseconds
+ */
+#define EMULATOR_FRAME_TIME 20
+
+/**
+ * CPU execution engines
+ */
+typedef enum
+{
+  ENGINE_INTERP = 0,
+  ENGINE_BLOCK  = 1,
+  ENGINE_JIT    = 2
+} engine_t;
+
 /**
  * Emulator state
  */
@@ -28,11 +48,20 @@ struct _emulator_t
   int           quiet;
   int           nes_enabled;
   int           gpio_test_offset;
+  engine_t      engine;
+  int           eager_flags;
+  int           no_fastmem;
+  int           frame_hash;
+  uint32_t      frame_dump;
+  const char*   share_name;
 
   /* Modules */
   framebuffer_t fb;
+  share_t       share;
   memory_t      memory;
   cpu_t         cpu;
+  block_cache_t blocks;
+  jit_t         jit;
   gpio_t        gpio;
   mbox_t        mbox;
   peripheral_t  pr;
@@ -50,7 +79,7 @@ void emulator_init(emulator_t* );
 int emulator_is_running(emulator_t* );
 uint64_t emulator_get_time();
 uint64_t emulator_get_system_timer(emulator_t*);
-void emulator_tick(emulator_t* );
+void emulator_run(emulator_t*, uint32_t budget);
 void emulator_info(emulator_t*, const char *, ...);
 void emulator_error(emulator_t*, const char *, ...);
 void emulator_fatal(emulator_t*, const char *, ...) __attribute__((noreturn));
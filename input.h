@@ -0,0 +1,47 @@
+/* This file is part of the Team 28 Project
+ * Licensing information can be found in the LICENSE file
+ * (C) 2014 The Team 28 Authors. All rights reserved.
+ */
+#ifndef __INPUT_H__
+#define __INPUT_H__
+
+/**
+ * Kind of input event
+ */
+typedef enum
+{
+  INPUT_QUIT = 0,
+  INPUT_KEY_DOWN,
+  INPUT_KEY_UP
+} input_type_t;
+
+/**
+ * Keys understood by the emulator, independent of the window system
+ */
+typedef enum
+{
+  INPUT_KEY_NONE = 0,
+
+  /* GPIO test pins */
+  INPUT_KEY_1,
+  INPUT_KEY_2,
+  INPUT_KEY_3,
+  INPUT_KEY_4,
+  INPUT_KEY_5,
+  INPUT_KEY_6,
+  INPUT_KEY_7,
+  INPUT_KEY_8,
+  INPUT_KEY_9,
+
+  /* NES controller */
+  INPUT_KEY_SPACE,
+  INPUT_KEY_TAB,
+  INPUT_KEY_RETURN,
+  INPUT_KEY_P,
+  INPUT_KEY_W,
+  INPUT_KEY_A,
+  INPUT_KEY_S,
+  INPUT_KEY_D
+} input_key_t;
+
+#endif /* __INPUT_H__ */
@@ -0,0 +1,1385 @@
+/* This file is part of the Team 28 Project
+ * Licensing information can be found in the LICENSE file
+ * (C) 2014 The Team 28 Authors. All rights reserved.
+ */
+#include "common.h"
+
+#if defined(__x86_64__)
+#include <stddef.h>
+#include <sys/mman.h>
+
+/**
+ * Offsets of guest state in the CPU structure, addressed relative to rbx
+ */
+#define CPU_REG(reg) ((int32_t)offsetof(cpu_t, regs.r[0]) + 4 * (reg))
+#define CPU_CPSR     ((int32_t)offsetof(cpu_t, cpsr.r))
+#define CPU_FLAGS(f) ((int32_t)offsetof(cpu_t, flags.f))
+#define CPU_MEMORY   ((int32_t)offsetof(cpu_t, memory))
+
+/**
+ * Offsets of the memory system fields, addressed relative to rdx
+ */
+#define MEM(field)   ((int32_t)offsetof(memory_t, field))
+
+/**
+ * Host registers used by the generated code
+ */
+#define HOST_EAX 0x0
+#define HOST_ECX 0x1
+#define HOST_EDX 0x2
+
+/**
+ * Emits a sequence of bytes
+ */
+#define EMIT(jit, ...) \
+  emit_bytes((jit), (const uint8_t[]){ __VA_ARGS__ }, \
+             sizeof((const uint8_t[]){ __VA_ARGS__ }))
+
+/**
+ * Emits raw bytes into the code cache
+ * @param jit  Reference to the translator
+ * @param data Bytes to emit
+ * @param size Number of bytes
+ */
+static inline void
+emit_bytes(jit_t* jit, const uint8_t* data, size_t size)
+{
+  memcpy(jit->ptr, data, size);
+  jit->ptr += size;
+}
+
+/**
+ * Emits a 32 bit little endian value
+ * @param jit   Reference to the translator
+ * @param value Value to emit
+ */
+static inline void
+emit32(jit_t* jit, uint32_t value)
+{
+  memcpy(jit->ptr, &value, 4);
+  jit->ptr += 4;
+}
+
+/**
+ * Emits a 64 bit little endian value
+ * @param jit   Reference to the translator
+ * @param value Value to emit
+ */
+static inline void
+emit64(jit_t* jit, uint64_t value)
+{
+  memcpy(jit->ptr, &value, 8);
+  jit->ptr += 8;
+}
+
+/**
+ * Emits a jump with a 32 bit displacement which is patched later
+ * @param jit Reference to the translator
+ * @param cc  x86 condition code of the jump
+ * @return Address of the displacement
+ */
+static inline uint8_t*
+emit_jcc(jit_t* jit, uint8_t cc)
+{
+  EMIT(jit, 0x0F, 0x80 | cc);
+  emit32(jit, 0);
+  return jit->ptr - 4;
+}
+
+/**
+ * Emits an unconditional jump with a 32 bit displacement which is patched
+ * later
+ * @param jit Reference to the translator
+ * @return Address of the displacement
+ */
+static inline uint8_t*
+emit_jmp(jit_t* jit)
+{
+  EMIT(jit, 0xE9);
+  emit32(jit, 0);
+  return jit->ptr - 4;
+}
+
+/**
+ * Points a jump emitted by emit_jcc or emit_jmp to the current position
+ * @param jit Reference to the translator
+ * @param at  Address of the displacement
+ */
+static inline void
+patch(jit_t* jit, uint8_t* at)
+{
+  int32_t rel = jit->ptr - (at + 4);
+  memcpy(at, &rel, 4);
+}
+
+/**
+ * Loads a guest register into a host register. PC reads as the address of
+ * the instruction plus 8, which is known at translation time.
+ * @param jit  Reference to the translator
+ * @param host Host register
+ * @param reg  Guest register
+ * @param pc   Value of PC
+ */
+static inline void
+emit_load(jit_t* jit, uint8_t host, uint8_t reg, uint32_t pc)
+{
+  if (reg == PC)
+  {
+    /* mov host, pc */
+    EMIT(jit, 0xB8 | host);
+    emit32(jit, pc);
+  }
+  else
+  {
+    /* mov host, [rbx + reg] */
+    EMIT(jit, 0x8B, 0x83 | (host << 3));
+    emit32(jit, CPU_REG(reg));
+  }
+}
+
+/**
+ * Stores eax into a guest register
+ * @param jit Reference to the translator
+ * @param reg Guest register, R0 to LR
+ */
+static inline void
+emit_store(jit_t* jit, uint8_t reg)
+{
+  /* mov [rbx + reg], eax */
+  EMIT(jit, 0x89, 0x83);
+  emit32(jit, CPU_REG(reg));
+}
+
+/**
+ * Sets the guest PC
+ * @param jit   Reference to the translator
+ * @param value New value of PC
+ */
+static inline void
+emit_set_pc(jit_t* jit, uint32_t value)
+{
+  /* mov dword [rbx + pc], value */
+  EMIT(jit, 0xC7, 0x83);
+  emit32(jit, CPU_REG(PC));
+  emit32(jit, value);
+}
+
+/**
+ * Calls a C function taking the CPU as its first argument
+ * @param jit Reference to the translator
+ * @param fn  Function to call
+ */
+static inline void
+emit_call(jit_t* jit, const void* fn)
+{
+  /* mov rdi, rbx; mov rax, fn; call rax */
+  EMIT(jit, 0x48, 0x89, 0xDF);
+  EMIT(jit, 0x48, 0xB8);
+  emit64(jit, (uint64_t)fn);
+  EMIT(jit, 0xFF, 0xD0);
+}
+
+/**
+ * Returns from the translated block, handing the block back to block_run
+ * @param jit Reference to the translator
+ */
+static inline void
+emit_exit(jit_t* jit)
+{
+  /* mov rax, block; pop rbx; ret */
+  EMIT(jit, 0x48, 0xB8);
+  emit64(jit, (uint64_t)jit->block);
+  EMIT(jit, 0x5B, 0xC3);
+}
+
+/**
+ * Leaves the translated block through a jump which jit_chain can later point
+ * into the translated successor. Chained blocks return once the budget of
+ * the batch is used up.
+ * @param jit   Reference to the translator
+ * @param count Number of instructions in the block
+ * @return Address of the displacement of the jump
+ */
+static uint8_t*
+emit_chain(jit_t* jit, uint32_t count)
+{
+  uint8_t *slot;
+
+  /* mov rax, &budget; sub dword [rax], count; jle exit */
+  EMIT(jit, 0x48, 0xB8);
+  emit64(jit, (uint64_t)&jit->budget);
+  EMIT(jit, 0x83, 0x28, (uint8_t)count, 0x7E, 0x05);
+
+  /* jmp exit, until patched */
+  slot = emit_jmp(jit);
+  emit_exit(jit);
+
+  return slot;
+}
+
+/**
+ * Applies pending flag updates to cpsr, as cpu_sync_flags does
+ * @param jit Reference to the translator
+ */
+static void
+emit_sync(jit_t* jit)
+{
+  /* movzx eax, word [rbx + nz]; test eax, eax; jz +15;
+   * call cpu_eval_flags */
+  EMIT(jit, 0x0F, 0xB7, 0x83);
+  emit32(jit, CPU_FLAGS(nz));
+  EMIT(jit, 0x85, 0xC0, 0x74, 0x0F);
+  emit_call(jit, cpu_eval_flags);
+}
+
+/**
+ * Emits the condition check of an instruction. The outcome is looked up in
+ * the entry of cpu_cond_table for the condition, which is known here.
+ * @param jit  Reference to the translator
+ * @param cond Condition code
+ * @return Jump to patch to the instruction following this one
+ */
+static uint8_t*
+emit_cond(jit_t* jit, uint8_t cond)
+{
+  emit_sync(jit);
+
+  /* mov eax, [rbx + cpsr]; shr eax, 28; mov ecx, mask; bt ecx, eax;
+   * jnc skip */
+  EMIT(jit, 0x8B, 0x83);
+  emit32(jit, CPU_CPSR);
+  EMIT(jit, 0xC1, 0xE8, 0x1C, 0xB9);
+  emit32(jit, cpu_cond_table[cond]);
+  EMIT(jit, 0x0F, 0xA3, 0xC1);
+  return emit_jcc(jit, 0x3);
+}
+
+/**
+ * Checks whether a data processing instruction can be translated to native
+ * code. ADC, SBC and RSC setting flags, shifter carry outs, rotations and
+ * writes to PC are left to the interpreter.
+ * @param op Predecoded instruction
+ */
+static int
+jit_native_dp(const cpu_op_t* op)
+{
+  int test = op->alu >= 0x8 && op->alu <= 0xB;
+
+  if (op->alu >= 0x5 && op->alu <= 0x7 && (op->flags & OP_S))
+  {
+    return 0;
+  }
+  if (!test && op->rd == PC)
+  {
+    return 0;
+  }
+  if (OPK_UNCOND(op->kind) == OPK_DP_REG &&
+      op->shift != 0 && ((op->flags & OP_S) || op->stype == 0x3))
+  {
+    return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * Records the operands in eax and ecx for lazy flag evaluation
+ * @param jit Reference to the translator
+ */
+static inline void
+emit_operands(jit_t* jit)
+{
+  /* mov [rbx + op1], eax; mov [rbx + op2], ecx */
+  EMIT(jit, 0x89, 0x83);
+  emit32(jit, CPU_FLAGS(op1));
+  EMIT(jit, 0x89, 0x8B);
+  emit32(jit, CPU_FLAGS(op2));
+}
+
+/**
+ * Records the result in eax for lazy flag evaluation
+ * @param jit   Reference to the translator
+ * @param arith FLAGS_* operation giving C and V, FLAGS_NONE if only N and
+ *              Z are updated
+ */
+static void
+emit_flags(jit_t* jit, uint8_t arith)
+{
+  /* mov [rbx + res], eax; mov byte [rbx + nz], 1 or
+   * mov word [rbx + nz], 1 | (op << 8) */
+  EMIT(jit, 0x89, 0x83);
+  emit32(jit, CPU_FLAGS(res));
+  if (arith)
+  {
+    EMIT(jit, 0x66, 0xC7, 0x83);
+    emit32(jit, CPU_FLAGS(nz));
+    EMIT(jit, 0x01, arith);
+  }
+  else
+  {
+    EMIT(jit, 0xC6, 0x83);
+    emit32(jit, CPU_FLAGS(nz));
+    EMIT(jit, 0x01);
+  }
+
+  if (jit->emu->eager_flags)
+  {
+    emit_call(jit, cpu_eval_flags);
+  }
+}
+
+/**
+ * Translates a data processing instruction. Flag updates are recorded in
+ * the same lazy form data_processing uses.
+ * @param jit  Reference to the translator
+ * @param op   Predecoded instruction
+ * @param addr Address of the instruction
+ */
+static void
+jit_emit_dp(jit_t* jit, const cpu_op_t* op, uint32_t addr)
+{
+  int test, s;
+  uint8_t arith;
+
+  test = op->alu >= 0x8 && op->alu <= 0xB;
+  s = test || (op->flags & OP_S);
+  arith = FLAGS_NONE;
+
+  /* Carry is an input of ADC, SBC and RSC */
+  if (op->alu >= 0x5 && op->alu <= 0x7)
+  {
+    emit_sync(jit);
+  }
+
+  /* First operand in eax */
+  if (op->alu != 0xD && op->alu != 0xF)
+  {
+    emit_load(jit, HOST_EAX, op->rn, addr + 8);
+  }
+
+  /* Second operand in ecx */
+  if (OPK_UNCOND(op->kind) == OPK_DP_IMM)
+  {
+    EMIT(jit, 0xB8 | HOST_ECX);
+    emit32(jit, op->imm);
+  }
+  else
+  {
+    emit_load(jit, HOST_ECX, op->rm, addr + 8);
+    if (op->shift != 0)
+    {
+      /* shl/shr/sar ecx, shift */
+      static const uint8_t modrm[] = { 0xE1, 0xE9, 0xF9 };
+      EMIT(jit, 0xC1, modrm[op->stype], op->shift);
+    }
+  }
+
+  switch (op->alu)
+  {
+    case 0x0: case 0x8:
+    {
+      /* and eax, ecx */
+      EMIT(jit, 0x21, 0xC8);
+      break;
+    }
+    case 0x1: case 0x9:
+    {
+      /* xor eax, ecx */
+      EMIT(jit, 0x31, 0xC8);
+      break;
+    }
+    case 0xC:
+    {
+      /* or eax, ecx */
+      EMIT(jit, 0x09, 0xC8);
+      break;
+    }
+    case 0xD:
+    {
+      /* mov eax, ecx */
+      EMIT(jit, 0x89, 0xC8);
+      break;
+    }
+    case 0xE:
+    {
+      /* not ecx; and eax, ecx */
+      EMIT(jit, 0xF7, 0xD1, 0x21, 0xC8);
+      break;
+    }
+    case 0xF:
+    {
+      /* mov eax, ecx; not eax */
+      EMIT(jit, 0x89, 0xC8, 0xF7, 0xD0);
+      break;
+    }
+    case 0x2: case 0x3: case 0xA:
+    {
+      if (op->alu == 0x3)
+      {
+        /* xchg eax, ecx */
+        EMIT(jit, 0x91);
+      }
+
+      /* sub eax, ecx. Operands give C and V when flags are evaluated. */
+      if (s)
+      {
+        emit_operands(jit);
+      }
+      EMIT(jit, 0x29, 0xC8);
+      arith = FLAGS_SUB;
+      break;
+    }
+    case 0x4: case 0xB:
+    {
+      /* add eax, ecx */
+      if (s)
+      {
+        emit_operands(jit);
+      }
+      EMIT(jit, 0x01, 0xC8);
+      arith = FLAGS_ADD;
+      break;
+    }
+    case 0x5:
+    {
+      /* bt dword [rbx + cpsr], 29; adc eax, ecx */
+      EMIT(jit, 0x0F, 0xBA, 0xA3);
+      emit32(jit, CPU_CPSR);
+      EMIT(jit, 0x1D, 0x11, 0xC8);
+      break;
+    }
+    case 0x6: case 0x7:
+    {
+      if (op->alu == 0x7)
+      {
+        /* xchg eax, ecx */
+        EMIT(jit, 0x91);
+      }
+
+      /* Borrow is the inverted carry:
+       * bt dword [rbx + cpsr], 29; cmc; sbb eax, ecx */
+      EMIT(jit, 0x0F, 0xBA, 0xA3);
+      emit32(jit, CPU_CPSR);
+      EMIT(jit, 0x1D, 0xF5, 0x19, 0xC8);
+      break;
+    }
+  }
+
+  if (!test)
+  {
+    emit_store(jit, op->rd);
+  }
+
+  if (s)
+  {
+    emit_flags(jit, arith);
+  }
+}
+
+/**
+ * Translates a branch
+ * @param jit  Reference to the translator
+ * @param op   Predecoded instruction
+ * @param addr Address of the instruction
+ */
+static void
+jit_emit_branch(jit_t* jit, block_t* b, const cpu_op_t* op, uint32_t addr)
+{
+  if (op->flags & OP_L)
+  {
+    /* mov dword [rbx + lr], addr + 4 */
+    EMIT(jit, 0xC7, 0x83);
+    emit32(jit, CPU_REG(LR));
+    emit32(jit, addr + 4);
+  }
+
+  emit_set_pc(jit, addr + 8 + op->imm);
+  b->chain[0] = emit_chain(jit, b->count);
+}
+
+/**
+ * Emits a call to the interpreter handler of an instruction
+ * @param jit  Reference to the translator
+ * @param b    Block being translated
+ * @param op   Predecoded instruction
+ * @param addr Address of the instruction
+ */
+static void
+jit_emit_helper(jit_t* jit, block_t* b, const cpu_op_t* op, uint32_t addr)
+{
+  uint8_t *alive;
+
+  emit_set_pc(jit, addr + 4);
+
+  /* mov rsi, op; call op->exec */
+  EMIT(jit, 0x48, 0xBE);
+  emit64(jit, (uint64_t)op);
+  emit_call(jit, op->exec);
+
+  /* Stores might overwrite the block: leave if it was invalidated.
+   * mov rax, &b->dead; cmp dword [rax], 0; je alive; exit */
+  switch (OPK_UNCOND(op->kind))
+  {
+    case OPK_GENERIC:
+    case OPK_SDT_IMM:
+    case OPK_SDT_REG:
+    case OPK_BDT:
+    {
+      EMIT(jit, 0x48, 0xB8);
+      emit64(jit, (uint64_t)&b->dead);
+      EMIT(jit, 0x83, 0x38, 0x00);
+      alive = emit_jcc(jit, 0x4);
+      emit_exit(jit);
+      patch(jit, alive);
+      break;
+    }
+  }
+}
+
+/**
+ * Checks whether a single data transfer can be translated to native code.
+ * Loads to PC, writeback to PC and rotated offsets are left to the
+ * interpreter.
+ * @param op Predecoded instruction
+ */
+static int
+jit_native_sdt(const cpu_op_t* op)
+{
+  if ((op->flags & OP_L) && op->rd == PC)
+  {
+    return 0;
+  }
+  if (((op->flags & OP_W) || !(op->flags & OP_P)) && op->rn == PC)
+  {
+    return 0;
+  }
+  if (OPK_UNCOND(op->kind) == OPK_SDT_REG &&
+      op->shift != 0 && op->stype == 0x3)
+  {
+    return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * Records a store to SDRAM in the dirty bitmap if it lies in the watched
+ * range. Expects the physical address in eax and the memory system in rdx.
+ * @param jit Reference to the translator
+ */
+static void
+jit_emit_watch(jit_t* jit)
+{
+  uint8_t *unwatched;
+
+  /* mov ecx, eax; sub ecx, [rdx + watch_base]; cmp ecx, [rdx + watch_size];
+   * jae unwatched; shr ecx, shift; mov r8, [rdx + dirty]; bts [r8], ecx */
+  EMIT(jit, 0x89, 0xC1, 0x2B, 0x8A);
+  emit32(jit, MEM(watch_base));
+  EMIT(jit, 0x3B, 0x8A);
+  emit32(jit, MEM(watch_size));
+  unwatched = emit_jcc(jit, 0x3);
+  EMIT(jit, 0xC1, 0xE9, MEMORY_DIRTY_SHIFT);
+  EMIT(jit, 0x4C, 0x8B, 0x82);
+  emit32(jit, MEM(dirty));
+  EMIT(jit, 0x41, 0x0F, 0xAB, 0x08);
+  patch(jit, unwatched);
+}
+
+/**
+ * Translates a single data transfer. Aligned accesses to SDRAM are done
+ * inline, stores also record writes to the watched range. Everything else,
+ * peripherals and stores to pages holding code included, calls the
+ * interpreter handler.
+ *
+ * With fastmem, only the peripheral window is tested for: other accesses
+ * outside SDRAM fault and the SIGSEGV handler resumes them at the slow
+ * path, through a fixup registered with memory_add_fixup. Stores are done
+ * before the code check, which the interpreter then repeats.
+ * @param jit  Reference to the translator
+ * @param b    Block being translated
+ * @param op   Predecoded instruction
+ * @param addr Address of the instruction
+ */
+static void
+jit_emit_sdt(jit_t* jit, block_t* b, const cpu_op_t* op, uint32_t addr)
+{
+  uint8_t *slow[4], *done;
+  int byte, load, n = 0;
+#ifdef MEMORY_FASTMEM
+  uint8_t *fault;
+#endif
+
+  byte = (op->flags & OP_B) != 0;
+  load = (op->flags & OP_L) != 0;
+
+  /* Offset in ecx */
+  if (OPK_UNCOND(op->kind) == OPK_SDT_IMM)
+  {
+    EMIT(jit, 0xB8 | HOST_ECX);
+    emit32(jit, op->imm);
+  }
+  else
+  {
+    emit_load(jit, HOST_ECX, op->rm, addr + 8);
+    if (op->shift != 0)
+    {
+      /* shl/shr/sar ecx, shift */
+      static const uint8_t modrm[] = { 0xE1, 0xE9, 0xF9 };
+      EMIT(jit, 0xC1, modrm[op->stype], op->shift);
+    }
+  }
+
+  /* Base in eax, indexed base in edi, guest address in esi:
+   * mov edi, eax; add/sub edi, ecx; mov esi, edi/eax */
+  emit_load(jit, HOST_EAX, op->rn, addr + 8);
+  EMIT(jit, 0x89, 0xC7, (op->flags & OP_U) ? 0x01 : 0x29, 0xCF);
+  EMIT(jit, 0x89, (op->flags & OP_P) ? 0xFE : 0xC6);
+
+#ifdef MEMORY_FASTMEM
+  /* Guest address in eax: mov eax, esi */
+  EMIT(jit, 0x89, 0xF0);
+
+  if (!byte)
+  {
+    /* Unaligned words are rotated: test eax, 3; jnz slow */
+    EMIT(jit, 0xA9);
+    emit32(jit, 0x3);
+    slow[n++] = emit_jcc(jit, 0x5);
+  }
+
+  /* Peripherals are not mapped, as in memory_is_peripheral: mov ecx, eax;
+   * and ecx, 0x3F000000; cmp ecx, 0x20000000; je slow */
+  EMIT(jit, 0x89, 0xC1, 0x81, 0xE1);
+  emit32(jit, 0x3F000000);
+  EMIT(jit, 0x81, 0xF9);
+  emit32(jit, 0x20000000);
+  slow[n++] = emit_jcc(jit, 0x4);
+
+  /* mov rdx, [rbx + memory]; mov r9, [rdx + data] */
+  EMIT(jit, 0x48, 0x8B, 0x93);
+  emit32(jit, CPU_MEMORY);
+  EMIT(jit, 0x4C, 0x8B, 0x8A);
+  emit32(jit, MEM(data));
+
+  /* Anything else outside SDRAM faults and resumes at the slow path */
+  if (load)
+  {
+    /* movzx ecx, byte [r9 + rax] or mov ecx, [r9 + rax];
+     * mov [rbx + rd], ecx */
+    fault = jit->ptr;
+    if (byte)
+    {
+      EMIT(jit, 0x41, 0x0F, 0xB6, 0x0C, 0x01);
+    }
+    else
+    {
+      EMIT(jit, 0x41, 0x8B, 0x0C, 0x01);
+    }
+    EMIT(jit, 0x89, 0x8B);
+    emit32(jit, CPU_REG(op->rd));
+  }
+  else
+  {
+    /* mov [r9 + rax], cl or ecx */
+    emit_load(jit, HOST_ECX, op->rd, addr + 8);
+    fault = jit->ptr;
+    EMIT(jit, 0x41, byte ? 0x88 : 0x89, 0x0C, 0x01);
+
+    /* Physical address in eax: and eax, 0x3FFFFFFF */
+    EMIT(jit, 0x25);
+    emit32(jit, 0x3FFFFFFF);
+
+    /* Stores to code are done again by the interpreter, which invalidates
+     * it, as memory_written does after the store: mov ecx, eax; shr ecx, 12;
+     * mov r8, [rdx + code]; bt [r8], ecx; jc slow */
+    EMIT(jit, 0x89, 0xC1, 0xC1, 0xE9, 0x0C);
+    EMIT(jit, 0x4C, 0x8B, 0x82);
+    emit32(jit, MEM(code));
+    EMIT(jit, 0x41, 0x0F, 0xA3, 0x08);
+    slow[n++] = emit_jcc(jit, 0x2);
+
+    jit_emit_watch(jit);
+  }
+#else
+  /* Physical address in eax: mov eax, esi; and eax, 0x3FFFFFFF */
+  EMIT(jit, 0x89, 0xF0, 0x25);
+  emit32(jit, 0x3FFFFFFF);
+
+  if (!byte)
+  {
+    /* Unaligned words are rotated: test eax, 3; jnz slow */
+    EMIT(jit, 0xA9);
+    emit32(jit, 0x3);
+    slow[n++] = emit_jcc(jit, 0x5);
+  }
+
+  /* Only SDRAM is accessed inline: mov rdx, [rbx + memory];
+   * lea rcx, [rax + 3]; cmp rcx, [rdx + size]; jae slow */
+  EMIT(jit, 0x48, 0x8B, 0x93);
+  emit32(jit, CPU_MEMORY);
+  EMIT(jit, 0x48, 0x8D, 0x48, byte ? 0x00 : 0x03);
+  EMIT(jit, 0x48, 0x3B, 0x8A);
+  emit32(jit, MEM(size));
+  slow[n++] = emit_jcc(jit, 0x3);
+
+  if (!load)
+  {
+    /* Stores to code go through the interpreter, which invalidates it:
+     * mov ecx, eax; shr ecx, 12; mov r8, [rdx + code]; bt [r8], ecx;
+     * jc slow */
+    EMIT(jit, 0x89, 0xC1, 0xC1, 0xE9, 0x0C);
+    EMIT(jit, 0x4C, 0x8B, 0x82);
+    emit32(jit, MEM(code));
+    EMIT(jit, 0x41, 0x0F, 0xA3, 0x08);
+    slow[n++] = emit_jcc(jit, 0x2);
+
+    jit_emit_watch(jit);
+  }
+
+  /* mov rdx, [rdx + data] */
+  EMIT(jit, 0x48, 0x8B, 0x92);
+  emit32(jit, MEM(data));
+
+  if (load)
+  {
+    /* movzx ecx, byte [rdx + rax] or mov ecx, [rdx + rax];
+     * mov [rbx + rd], ecx */
+    if (byte)
+    {
+      EMIT(jit, 0x0F, 0xB6, 0x0C, 0x02);
+    }
+    else
+    {
+      EMIT(jit, 0x8B, 0x0C, 0x02);
+    }
+    EMIT(jit, 0x89, 0x8B);
+    emit32(jit, CPU_REG(op->rd));
+  }
+  else
+  {
+    /* mov [rdx + rax], cl or ecx */
+    emit_load(jit, HOST_ECX, op->rd, addr + 8);
+    EMIT(jit, byte ? 0x88 : 0x89, 0x0C, 0x02);
+  }
+#endif
+
+  /* Writeback after the load, as single_data_trans does:
+   * mov [rbx + rn], edi */
+  if ((op->flags & OP_W) || !(op->flags & OP_P))
+  {
+    EMIT(jit, 0x89, 0xBB);
+    emit32(jit, CPU_REG(op->rn));
+  }
+  done = emit_jmp(jit);
+
+  while (n > 0)
+  {
+    patch(jit, slow[--n]);
+  }
+#ifdef MEMORY_FASTMEM
+  memory_add_fixup(&jit->emu->memory, fault, jit->ptr);
+#endif
+  jit_emit_helper(jit, b, op, addr);
+  patch(jit, done);
+}
+
+/**
+ * Checks whether a multiply can be translated to native code. Multiplies
+ * involving PC are left to the interpreter.
+ * @param op Predecoded instruction
+ */
+static int
+jit_native_mul(const cpu_op_t* op)
+{
+  return op->rd != PC && op->rm != PC && op->rs != PC &&
+         (!(op->flags & OP_A) || op->rn != PC);
+}
+
+/**
+ * Translates MUL and MLA. Flag updates are recorded in the same lazy form
+ * multiply uses.
+ * @param jit  Reference to the translator
+ * @param op   Predecoded instruction
+ * @param addr Address of the instruction
+ */
+static void
+jit_emit_mul(jit_t* jit, const cpu_op_t* op, uint32_t addr)
+{
+  /* imul eax, ecx */
+  emit_load(jit, HOST_EAX, op->rm, addr + 8);
+  emit_load(jit, HOST_ECX, op->rs, addr + 8);
+  EMIT(jit, 0x0F, 0xAF, 0xC1);
+
+  if (op->flags & OP_A)
+  {
+    /* add eax, ecx */
+    emit_load(jit, HOST_ECX, op->rn, addr + 8);
+    EMIT(jit, 0x01, 0xC8);
+  }
+
+  emit_store(jit, op->rd);
+  if (op->flags & OP_S)
+  {
+    emit_flags(jit, FLAGS_NONE);
+  }
+}
+
+/**
+ * Checks whether a block data transfer can be translated to native code.
+ * User bank transfers and writeback to a base in the list are left to the
+ * interpreter.
+ * @param op Predecoded instruction
+ */
+static int
+jit_native_bdt(const cpu_op_t* op)
+{
+  if (op->imm == 0 || op->rn == PC || (op->flags & OP_S))
+  {
+    return 0;
+  }
+  if ((op->flags & OP_W) && (op->imm & (1 << op->rn)))
+  {
+    return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * Translates a block data transfer. When the whole range lies in SDRAM,
+ * registers are moved one word at a time. The range is checked once, before
+ * any register changes: it spans at most two pages and two dirty chunks, so
+ * the code bitmap and the watched range are tested at its ends. Everything
+ * else calls the interpreter handler.
+ * @param jit  Reference to the translator
+ * @param b    Block being translated
+ * @param op   Predecoded instruction
+ * @param addr Address of the instruction
+ */
+static void
+jit_emit_bdt(jit_t* jit, block_t* b, const cpu_op_t* op, uint32_t addr)
+{
+  uint8_t *slow[6], *done;
+  uint32_t size, reg;
+  int32_t start, i, n = 0;
+  int load;
+#ifdef MEMORY_FASTMEM
+  uint8_t *fault[2];
+#endif
+
+  load = (op->flags & OP_L) != 0;
+  size = __builtin_popcount(op->imm) << 2;
+  if (op->flags & OP_U)
+  {
+    start = (op->flags & OP_P) ? 4 : 0;
+  }
+  else
+  {
+    start = -(int32_t)size + ((op->flags & OP_P) ? 0 : 4);
+  }
+
+  /* Aligned base in eax, guest address in esi, writeback in edi:
+   * and eax, ~3; lea esi, [rax + start]; lea edi, [rax +/- size] */
+  emit_load(jit, HOST_EAX, op->rn, addr + 8);
+  EMIT(jit, 0x83, 0xE0, 0xFC);
+  EMIT(jit, 0x8D, 0xB0);
+  emit32(jit, start);
+  EMIT(jit, 0x8D, 0xB8);
+  emit32(jit, (op->flags & OP_U) ? size : -size);
+
+#ifdef MEMORY_FASTMEM
+  /* The range must not wrap around: mov eax, esi; cmp eax, -size; ja slow */
+  EMIT(jit, 0x89, 0xF0, 0x3D);
+  emit32(jit, -size);
+  slow[n++] = emit_jcc(jit, 0x7);
+
+  /* Neither end is in the peripheral window: mov ecx, eax;
+   * and ecx, 0x3F000000; cmp ecx, 0x20000000; je slow;
+   * lea ecx, [rax + size - 4]; and ecx, 0x3F000000; cmp ecx, 0x20000000;
+   * je slow */
+  for (i = 0; i < 2; ++i)
+  {
+    if (i == 0)
+    {
+      EMIT(jit, 0x89, 0xC1);
+    }
+    else
+    {
+      EMIT(jit, 0x8D, 0x88);
+      emit32(jit, size - 4);
+    }
+    EMIT(jit, 0x81, 0xE1);
+    emit32(jit, 0x3F000000);
+    EMIT(jit, 0x81, 0xF9);
+    emit32(jit, 0x20000000);
+    slow[n++] = emit_jcc(jit, 0x4);
+  }
+
+  /* Touching both ends faults if any part is outside SDRAM:
+   * mov rdx, [rbx + memory]; mov r9, [rdx + data];
+   * mov ecx, [r9 + rax]; mov ecx, [r9 + rax + size - 4] */
+  EMIT(jit, 0x48, 0x8B, 0x93);
+  emit32(jit, CPU_MEMORY);
+  EMIT(jit, 0x4C, 0x8B, 0x8A);
+  emit32(jit, MEM(data));
+  fault[0] = jit->ptr;
+  EMIT(jit, 0x41, 0x8B, 0x0C, 0x01);
+  fault[1] = jit->ptr;
+  EMIT(jit, 0x41, 0x8B, 0x4C, 0x01, size - 4);
+
+  /* SDRAM is also mapped at alias 0: and eax, 0x3FFFFFFF */
+  EMIT(jit, 0x25);
+  emit32(jit, 0x3FFFFFFF);
+#else
+  /* Physical address in eax: mov eax, esi; and eax, 0x3FFFFFFF */
+  EMIT(jit, 0x89, 0xF0, 0x25);
+  emit32(jit, 0x3FFFFFFF);
+
+  /* mov rdx, [rbx + memory]; lea rcx, [rax + size]; cmp rcx, [rdx + size];
+   * ja slow */
+  EMIT(jit, 0x48, 0x8B, 0x93);
+  emit32(jit, CPU_MEMORY);
+  EMIT(jit, 0x48, 0x8D, 0x88);
+  emit32(jit, size);
+  EMIT(jit, 0x48, 0x3B, 0x8A);
+  emit32(jit, MEM(size));
+  slow[n++] = emit_jcc(jit, 0x7);
+#endif
+
+  if (!load)
+  {
+    /* Stores to code go through the interpreter: mov ecx, eax;
+     * shr ecx, 12; mov r8, [rdx + code]; bt [r8], ecx; jc slow;
+     * lea ecx, [rsi + size - 4]; and ecx, 0x3FFFFFFF; shr ecx, 12;
+     * bt [r8], ecx; jc slow */
+    EMIT(jit, 0x89, 0xC1, 0xC1, 0xE9, 0x0C);
+    EMIT(jit, 0x4C, 0x8B, 0x82);
+    emit32(jit, MEM(code));
+    EMIT(jit, 0x41, 0x0F, 0xA3, 0x08);
+    slow[n++] = emit_jcc(jit, 0x2);
+    EMIT(jit, 0x8D, 0x8E);
+    emit32(jit, size - 4);
+    EMIT(jit, 0x81, 0xE1);
+    emit32(jit, 0x3FFFFFFF);
+    EMIT(jit, 0xC1, 0xE9, 0x0C);
+    EMIT(jit, 0x41, 0x0F, 0xA3, 0x08);
+    slow[n++] = emit_jcc(jit, 0x2);
+
+    /* Both ends in the watched range:
+     * lea eax, [rsi + size - 4]; and eax, 0x3FFFFFFF; ...;
+     * mov eax, esi; and eax, 0x3FFFFFFF; ... */
+    EMIT(jit, 0x8D, 0x86);
+    emit32(jit, size - 4);
+    EMIT(jit, 0x25);
+    emit32(jit, 0x3FFFFFFF);
+    jit_emit_watch(jit);
+    EMIT(jit, 0x89, 0xF0, 0x25);
+    emit32(jit, 0x3FFFFFFF);
+    jit_emit_watch(jit);
+  }
+
+#ifndef MEMORY_FASTMEM
+  /* mov r9, [rdx + data] */
+  EMIT(jit, 0x4C, 0x8B, 0x8A);
+  emit32(jit, MEM(data));
+#endif
+
+  /* Lowest register at the lowest address:
+   * mov ecx, [r9 + rax + offset]; mov [rbx + reg], ecx or
+   * mov ecx, reg; mov [r9 + rax + offset], ecx */
+  for (reg = 0, i = 0; reg < 16; ++reg)
+  {
+    if (!(op->imm & (1 << reg)))
+    {
+      continue;
+    }
+    if (load)
+    {
+      EMIT(jit, 0x41, 0x8B, 0x4C, 0x01, i);
+      EMIT(jit, 0x89, 0x8B);
+      emit32(jit, CPU_REG(reg));
+    }
+    else
+    {
+      emit_load(jit, HOST_ECX, reg, addr + 8);
+      EMIT(jit, 0x41, 0x89, 0x4C, 0x01, i);
+    }
+    i += 4;
+  }
+
+  /* mov [rbx + rn], edi */
+  if (op->flags & OP_W)
+  {
+    EMIT(jit, 0x89, 0xBB);
+    emit32(jit, CPU_REG(op->rn));
+  }
+  done = emit_jmp(jit);
+
+  while (n > 0)
+  {
+    patch(jit, slow[--n]);
+  }
+#ifdef MEMORY_FASTMEM
+  memory_add_fixup(&jit->emu->memory, fault[0], jit->ptr);
+  memory_add_fixup(&jit->emu->memory, fault[1], jit->ptr);
+#endif
+  jit_emit_helper(jit, b, op, addr);
+  patch(jit, done);
+}
+
+/**
+ * Changes the protection of the pages of the code cache overlapping a range.
+ * The cache is never writable and executable at the same time.
+ * @param jit  Reference to the translator
+ * @param from First byte of the range
+ * @param size Size of the range in bytes
+ * @param prot New protection
+ */
+static void
+jit_protect(jit_t* jit, uint8_t* from, size_t size, int prot)
+{
+  uintptr_t first, last;
+
+  first = (uintptr_t)from & ~(uintptr_t)0xFFF;
+  last = ((uintptr_t)from + size + 0xFFF) & ~(uintptr_t)0xFFF;
+  if (mprotect((void*)first, last - first, prot) != 0)
+  {
+    emulator_fatal(jit->emu, "Cannot change the protection of the code cache");
+  }
+}
+
+/**
+ * Checks whether the host can run translated code
+ * @return Nonzero on x86-64
+ */
+int
+jit_supported(void)
+{
+  return 1;
+}
+
+/**
+ * Allocates the code cache. It is mapped read only and executable, pages
+ * are only made writable while a block is translated into them.
+ * @param jit Reference to the translator
+ * @param emu Reference to the emulator structure
+ */
+void
+jit_init(jit_t* jit, emulator_t* emu)
+{
+  assert(jit);
+  assert(emu);
+
+  jit->emu = emu;
+  jit->size = JIT_CACHE_SIZE;
+  jit->base = (uint8_t*)mmap(NULL, jit->size, PROT_READ | PROT_EXEC,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jit->base == MAP_FAILED)
+  {
+    jit->base = NULL;
+    emulator_fatal(emu, "Cannot allocate JIT code cache");
+  }
+
+  jit->ptr = jit->base;
+  jit->block = NULL;
+  jit->budget = 0;
+  jit->chain_count = 0;
+  if (!(jit->chains = (uint8_t**)malloc(JIT_MAX_CHAINS * sizeof(uint8_t*))))
+  {
+    emulator_fatal(emu, "Cannot allocate JIT chain table");
+  }
+}
+
+/**
+ * Frees the code cache
+ * @param jit Reference to the translator
+ */
+void
+jit_destroy(jit_t* jit)
+{
+  if (!jit || !jit->base)
+  {
+    return;
+  }
+
+  munmap(jit->base, jit->size);
+  jit->base = NULL;
+  jit->ptr = NULL;
+
+  if (jit->chains)
+  {
+    free(jit->chains);
+    jit->chains = NULL;
+  }
+}
+
+/**
+ * Discards all translated code. Blocks referencing it must be reset.
+ * @param jit Reference to the translator
+ */
+void
+jit_reset(jit_t* jit)
+{
+  jit->ptr = jit->base;
+  jit->chain_count = 0;
+#ifdef MEMORY_FASTMEM
+  memory_clear_fixups(&jit->emu->memory);
+#endif
+}
+
+/**
+ * Points the exit jump of a translated block straight at the translated
+ * code of its successor, past the prologue since rbx already holds the CPU.
+ * Exits which are already chained are left alone.
+ * @param jit  Reference to the translator
+ * @param slot Displacement of the exit jump, see emit_chain
+ * @param code Translated successor
+ */
+void
+jit_chain(jit_t* jit, uint8_t* slot, jit_code_t code)
+{
+  int32_t rel;
+
+  memcpy(&rel, slot, 4);
+  if (rel || jit->chain_count >= JIT_MAX_CHAINS)
+  {
+    return;
+  }
+
+  rel = ((uint8_t*)code + 4) - (slot + 4);
+  jit_protect(jit, slot, 4, PROT_READ | PROT_WRITE);
+  memcpy(slot, &rel, 4);
+  jit_protect(jit, slot, 4, PROT_READ | PROT_EXEC);
+
+  jit->chains[jit->chain_count++] = slot;
+}
+
+/**
+ * Points every chained exit back at the return to block_run. Called when
+ * blocks are invalidated, since the successors might be gone.
+ * @param jit Reference to the translator
+ */
+void
+jit_unchain(jit_t* jit)
+{
+  size_t i;
+  int32_t rel = 0;
+
+  if (!jit->chain_count)
+  {
+    return;
+  }
+
+  jit_protect(jit, jit->base, jit->ptr - jit->base, PROT_READ | PROT_WRITE);
+  for (i = 0; i < jit->chain_count; ++i)
+  {
+    memcpy(jit->chains[i], &rel, 4);
+  }
+  jit_protect(jit, jit->base, jit->ptr - jit->base, PROT_READ | PROT_EXEC);
+
+  jit->chain_count = 0;
+}
+
+/**
+ * Translates a block into host code. Data processing instructions,
+ * multiplies, single and block data transfers and branches are translated
+ * directly, everything else calls the interpreter handler. Branch and fall through exits are left
+ * in b->chain, to be linked to the successors by jit_chain.
+ * @param jit Reference to the translator
+ * @param b   Block to translate
+ * @return Entry point, or NULL if the code cache is full
+ */
+jit_code_t
+jit_compile(jit_t* jit, block_t* b)
+{
+  uint8_t *code, *skip, *skip_run;
+  const cpu_op_t *op;
+  uint32_t i, addr, run_end;
+  int kind, last;
+  size_t size;
+
+  size = (b->count + 2) * JIT_MAX_OP_SIZE;
+  if (!jit->base || (size_t)(jit->base + jit->size - jit->ptr) < size)
+  {
+    return NULL;
+  }
+
+  /* The pages being written are not executable meanwhile */
+  code = jit->ptr;
+  jit_protect(jit, code, size, PROT_READ | PROT_WRITE);
+
+  jit->block = b;
+  b->chain[0] = NULL;
+  b->chain[1] = NULL;
+
+  /* push rbx; mov rbx, rdi */
+  EMIT(jit, 0x53, 0x48, 0x89, 0xFB);
+
+  skip_run = NULL;
+  run_end = 0;
+  for (i = 0; i < b->count; ++i)
+  {
+    op = &b->ops[i];
+    addr = b->addr + (i << 2);
+    kind = OPK_UNCOND(op->kind);
+    last = i + 1 == b->count;
+
+    /* When the first instruction of a run sharing a condition fails, the
+     * whole run is skipped */
+    skip = op->cond != CC_AL ? emit_cond(jit, op->cond) : NULL;
+    if (skip && !skip_run && op->run > 1)
+    {
+      skip_run = skip;
+      run_end = i + op->run - 1;
+      skip = NULL;
+    }
+    switch (kind)
+    {
+      case OPK_NOP:
+      {
+        break;
+      }
+      case OPK_BRANCH:
+      {
+        jit_emit_branch(jit, b, op, addr);
+        break;
+      }
+      case OPK_SDT_IMM:
+      case OPK_SDT_REG:
+      {
+        if (jit_native_sdt(op))
+        {
+          jit_emit_sdt(jit, b, op, addr);
+          break;
+        }
+        jit_emit_helper(jit, b, op, addr);
+        if (last)
+        {
+          emit_exit(jit);
+        }
+        break;
+      }
+      case OPK_MUL:
+      {
+        if (jit_native_mul(op))
+        {
+          jit_emit_mul(jit, op, addr);
+          break;
+        }
+        jit_emit_helper(jit, b, op, addr);
+        if (last)
+        {
+          emit_exit(jit);
+        }
+        break;
+      }
+      case OPK_BDT:
+      {
+        if (jit_native_bdt(op))
+        {
+          jit_emit_bdt(jit, b, op, addr);
+          if ((op->flags & OP_L) && (op->imm & (1 << PC)))
+          {
+            emit_exit(jit);
+          }
+          break;
+        }
+        jit_emit_helper(jit, b, op, addr);
+        if (last)
+        {
+          /* Loads might have changed PC */
+          emit_exit(jit);
+        }
+        break;
+      }
+      case OPK_DP_IMM:
+      case OPK_DP_REG:
+      {
+        if (jit_native_dp(op))
+        {
+          jit_emit_dp(jit, op, addr);
+          break;
+        }
+      }
+      /* fallthrough */
+      default:
+      {
+        jit_emit_helper(jit, b, op, addr);
+        if (last)
+        {
+          /* The handler might have changed PC */
+          emit_exit(jit);
+        }
+        break;
+      }
+    }
+
+    if (skip)
+    {
+      patch(jit, skip);
+    }
+    if (skip_run && i == run_end)
+    {
+      patch(jit, skip_run);
+      skip_run = NULL;
+    }
+  }
+
+  /* Fall through to the next block */
+  emit_set_pc(jit, b->addr + (b->count << 2));
+  b->chain[1] = emit_chain(jit, b->count);
+
+  jit_protect(jit, code, size, PROT_READ | PROT_EXEC);
+
+  return (jit_code_t)code;
+}
+
+#else
+
+/**
+ * Checks whether the host can run translated code
+ * @return Zero, the translator only targets x86-64
+ */
+int
+jit_supported(void)
+{
+  return 0;
+}
+
+void
+jit_init(jit_t* jit, emulator_t* emu)
+{
+  jit->emu = emu;
+  jit->base = NULL;
+  jit->ptr = NULL;
+  jit->size = 0;
+}
+
+void
+jit_destroy(jit_t* UNUSED(jit))
+{
+}
+
+void
+jit_reset(jit_t* UNUSED(jit))
+{
+}
+
+jit_code_t
+jit_compile(jit_t* UNUSED(jit), block_t* UNUSED(b))
+{
+  return NULL;
+}
+
+void
+jit_chain(jit_t* UNUSED(jit), uint8_t* UNUSED(slot), jit_code_t UNUSED(code))
+{
+}
+
+void
+jit_unchain(jit_t* UNUSED(jit))
+{
+}
+
+#endif
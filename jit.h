@@ -0,0 +1,67 @@
+/* This file is part of the Team 28 Project
+ * Licensing information can be found in the LICENSE file
+ * (C) 2014 The Team 28 Authors. All rights reserved.
+ */
+#ifndef __JIT_H__
+#define __JIT_H__
+
+/**
+ * Size of the executable code cache
+ */
+#define JIT_CACHE_SIZE   (16 << 20)
+
+/**
+ * Number of executions after which a block is translated
+ */
+#define JIT_THRESHOLD    16
+
+/**
+ * Upper bound on the host code emitted for a single instruction
+ */
+#define JIT_MAX_OP_SIZE  640
+
+/**
+ * Maximum number of patched jumps between translated blocks
+ */
+#define JIT_MAX_CHAINS   (1 << 16)
+
+/**
+ * Translated block. Returns the last block it ran, which differs from the
+ * block called when execution was chained into its successors.
+ */
+typedef block_t* (*jit_code_t)(cpu_t*);
+
+/**
+ * Translator state
+ */
+typedef struct
+{
+  emulator_t  *emu;
+
+  /* Executable code cache */
+  uint8_t     *base;
+  size_t       size;
+
+  /* First free byte in the cache */
+  uint8_t     *ptr;
+
+  /* Block being translated */
+  block_t     *block;
+
+  /* Instructions left before chained blocks return to block_run */
+  int32_t      budget;
+
+  /* Jumps patched to enter a successor directly */
+  uint8_t    **chains;
+  size_t       chain_count;
+} jit_t;
+
+int jit_supported(void);
+void jit_init(jit_t*, emulator_t*);
+void jit_destroy(jit_t*);
+void jit_reset(jit_t*);
+jit_code_t jit_compile(jit_t*, block_t*);
+void jit_chain(jit_t*, uint8_t* slot, jit_code_t code);
+void jit_unchain(jit_t*);
+
+#endif /* __JIT_H__ */
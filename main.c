@@ -16,6 +16,16 @@ cmdline_usage(int argc, char **argv)
   printf("  --graphics      Emulate framebuffer\n");
   printf("  --memory=size   Specify memory size in bytes\n");
   printf("  --addr=addr     Specify kernel start address\n");
+  printf("  --engine=name   CPU engine: interp (default), block or jit\n");
+  printf("  --eager-flags   Evaluate condition flags after every instruction\n");
+  printf("  --share=name    Export the framebuffer to POSIX shared memory\n");
+#ifdef MEMORY_FASTMEM
+  printf("  --no-fastmem    Map SDRAM once, so the image can be mapped\n");
+#endif
+#ifdef PIEMU_HEADLESS
+  printf("  --frame-hash    Print a hash of every frame the guest draws\n");
+  printf("  --frame-dump=n  Write every n-th frame the guest draws to a PPM file\n");
+#endif
   printf("  --help          Print this message\n");
 }
 
@@ -35,9 +45,19 @@ cmdline_parse(emulator_t *emu, int argc, char **argv)
     { "help",      no_argument,        &emu->usage,        1 },
     { "quiet",     no_argument,        &emu->quiet,        1 },
     { "nes",       no_argument,        &emu->nes_enabled,  1 },
+    { "eager-flags", no_argument,      &emu->eager_flags,  1 },
+#ifdef MEMORY_FASTMEM
+    { "no-fastmem",  no_argument,      &emu->no_fastmem,   1 },
+#endif
+#ifdef PIEMU_HEADLESS
+    { "frame-hash",  no_argument,      &emu->frame_hash,   1 },
+    { "frame-dump",  required_argument, 0,                 'f' },
+#endif
     { "memory",    required_argument, 0,                 'm' },
     { "addr",      required_argument, 0,                 'a' },
     { "gpio-test", required_argument, 0,                 'i' },
+    { "engine",    required_argument, 0,                 'e' },
+    { "share",     required_argument, 0,                 'x' },
     { 0, 0, 0, 0 }
   };
 
@@ -91,6 +111,37 @@ cmdline_parse(emulator_t *emu, int argc, char **argv)
         sscanf(optarg, "%u", &emu->gpio_test_offset);
         break;
       }
+      case 'x':
+      {
+        emu->share_name = optarg;
+        break;
+      }
+      case 'f':
+      {
+        sscanf(optarg, "%u", &emu->frame_dump);
+        break;
+      }
+      case 'e':
+      {
+        if (!strcmp(optarg, "interp"))
+        {
+          emu->engine = ENGINE_INTERP;
+        }
+        else if (!strcmp(optarg, "block"))
+        {
+          emu->engine = ENGINE_BLOCK;
+        }
+        else if (!strcmp(optarg, "jit") && jit_supported())
+        {
+          emu->engine = ENGINE_JIT;
+        }
+        else
+        {
+          fprintf(stderr, "Unknown or unsupported engine '%s'.\n", optarg);
+          return 0;
+        }
+        break;
+      }
       case 0:
       {
         /* Flag set */
@@ -138,6 +189,27 @@ cmdline_check(emulator_t *emu, int argc, char **argv)
     return 0;
   }
 
+  /* Frames are only hashed and dumped when the framebuffer is emulated */
+  if ((emu->frame_hash || emu->frame_dump) && !emu->graphics)
+  {
+    fprintf(stderr, "Hashing or dumping frames requires --graphics.\n");
+    return 0;
+  }
+
+  /* Frames are exported by the display thread */
+  if (emu->share_name && !emu->graphics)
+  {
+    fprintf(stderr, "Sharing the framebuffer requires --graphics.\n");
+    return 0;
+  }
+
+  /* Larger memories would overlap the bus address aliases */
+  if (emu->mem_size > 0x40000000)
+  {
+    fprintf(stderr, "Must specify a maximum of 1gb of memory.\n");
+    return 0;
+  }
+
   return 1;
 }
 
@@ -177,7 +249,7 @@ main(int argc, char **argv)
 
   while (emulator_is_running(&emu))
   {
-    emulator_tick(&emu);
+    emulator_run(&emu, EMULATOR_BATCH);
   }
 
   if (!emu.quiet)
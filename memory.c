@@ -2,7 +2,240 @@
  * Licensing information can be found in the LICENSE file
  * (C) 2014 The Team 28 Authors. All rights reserved.
  */
+#define _GNU_SOURCE
 #include "common.h"
+#include <unistd.h>
+#include <sys/mman.h>
+
+/**
+ * Size of a transparent huge page
+ */
+#define MEMORY_HUGE_PAGE 0x200000
+
+/**
+ * Reserves address space aligned to a huge page, so that the kernel can
+ * back the whole range with huge pages
+ * @param size  Size of the range
+ * @param prot  Protection of the pages
+ * @param flags Flags passed to mmap
+ * @return Start of the range or NULL
+ */
+static uint8_t*
+memory_reserve(size_t size, int prot, int flags)
+{
+  uint8_t *ptr, *start;
+  size_t slack = MEMORY_HUGE_PAGE;
+
+  ptr = (uint8_t*)mmap(NULL, size + slack, prot, flags, -1, 0);
+  if (ptr == MAP_FAILED)
+  {
+    return NULL;
+  }
+
+  start = (uint8_t*)(((uintptr_t)ptr + slack - 1) & ~(uintptr_t)(slack - 1));
+  if (start != ptr)
+  {
+    munmap(ptr, start - ptr);
+  }
+  munmap(start + size, ptr + slack - start);
+
+  return start;
+}
+
+/**
+ * Asks for the hot working set to be kept in huge pages, where supported
+ * @param ptr  Start of the range
+ * @param size Size of the range
+ */
+static inline void
+memory_advise(uint8_t* ptr, size_t size)
+{
+#ifdef MADV_HUGEPAGE
+  madvise(ptr, size, MADV_HUGEPAGE);
+#else
+  (void)ptr;
+  (void)size;
+#endif
+}
+
+#ifdef MEMORY_FASTMEM
+#include <signal.h>
+#include <ucontext.h>
+
+/**
+ * Size of the reserved guest address space
+ */
+#define FASTMEM_SIZE (1ULL << 32)
+
+/**
+ * Record of a guest access which might fault, emitted by MEMORY_ACCESS.
+ * Both fields are relative to their own address.
+ */
+typedef struct
+{
+  int32_t insn;
+  int32_t fixup;
+} memory_fixup_t;
+
+/* Bounds of the memory_fixups section, provided by the linker */
+extern const memory_fixup_t __start_memory_fixups[] __attribute__((weak));
+extern const memory_fixup_t __stop_memory_fixups[] __attribute__((weak));
+
+/**
+ * Guest access of translated code which might fault, see memory_add_fixup
+ */
+typedef struct
+{
+  const uint8_t *insn;
+  const uint8_t *fixup;
+} memory_code_fixup_t;
+
+/* Reservation the SIGSEGV handler is responsible for */
+static uint8_t *fastmem_base = NULL;
+
+/* Fixups of translated code */
+static memory_code_fixup_t *fastmem_fixups = NULL;
+static size_t fastmem_fixup_count = 0;
+static size_t fastmem_fixup_size = 0;
+
+/**
+ * Resumes faulting guest accesses at their fixup, which makes the accessor
+ * take the slow path. Any other fault gets the default action.
+ */
+static void
+fastmem_segv(int sig, siginfo_t* info, void* context)
+{
+  ucontext_t *uc = (ucontext_t*)context;
+  const memory_fixup_t *f;
+  uint8_t *addr = (uint8_t*)info->si_addr;
+  uintptr_t ip = uc->uc_mcontext.gregs[REG_RIP];
+  size_t i;
+
+  if (fastmem_base && fastmem_base <= addr && addr < fastmem_base + FASTMEM_SIZE)
+  {
+    for (f = __start_memory_fixups; f < __stop_memory_fixups; ++f)
+    {
+      if ((uintptr_t)&f->insn + f->insn == ip)
+      {
+        uc->uc_mcontext.gregs[REG_RIP] = (uintptr_t)&f->fixup + f->fixup;
+        return;
+      }
+    }
+    for (i = 0; i < fastmem_fixup_count; ++i)
+    {
+      if ((uintptr_t)fastmem_fixups[i].insn == ip)
+      {
+        uc->uc_mcontext.gregs[REG_RIP] = (uintptr_t)fastmem_fixups[i].fixup;
+        return;
+      }
+    }
+  }
+
+  signal(sig, SIG_DFL);
+}
+
+/**
+ * Reserves the guest address space and maps SDRAM at each of the four
+ * aliases the VideoCore MMU provides. Everything else is left inaccessible.
+ *
+ * With --no-fastmem, SDRAM is private anonymous memory mapped at alias 0
+ * only, so that memory_map_file can map the image over it. Accesses to the
+ * other aliases then fault and take the slow path.
+ *
+ * @param m Reference to the memory structure
+ */
+static void
+fastmem_init(memory_t* m)
+{
+  struct sigaction sa;
+  uint64_t alias;
+
+  m->data = memory_reserve(FASTMEM_SIZE, PROT_NONE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE);
+  if (!m->data)
+  {
+    emulator_fatal(m->emu, "Cannot reserve the guest address space");
+  }
+
+  if (m->emu->no_fastmem)
+  {
+    /* Anonymous pages are zeroed by the kernel on first access */
+    if (mmap(m->data, m->size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+    {
+      emulator_fatal(m->emu, "Cannot allocate %zu bytes of SDRAM", m->size);
+    }
+    memory_advise(m->data, m->size);
+  }
+  else
+  {
+    if ((m->fd = memfd_create("piemu-sdram", 0)) < 0 ||
+        ftruncate(m->fd, m->size) != 0)
+    {
+      emulator_fatal(m->emu, "Cannot allocate %zu bytes of SDRAM", m->size);
+    }
+
+    /* The memory file is zeroed lazily, page by page */
+    for (alias = 0; alias < FASTMEM_SIZE; alias += 0x40000000)
+    {
+      if (mmap(m->data + alias, m->size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_FIXED, m->fd, 0) == MAP_FAILED)
+      {
+        emulator_fatal(m->emu, "Cannot map SDRAM at 0x%08llx", alias);
+      }
+      memory_advise(m->data + alias, m->size);
+    }
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = fastmem_segv;
+  sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGSEGV, &sa, NULL);
+  fastmem_base = m->data;
+}
+
+/**
+ * Registers a guest access of translated code which might fault, so that
+ * the SIGSEGV handler resumes it at its slow path
+ * @param m     Reference to the memory structure
+ * @param insn  Host instruction accessing guest memory
+ * @param fixup Code to resume at if it faults
+ */
+void
+memory_add_fixup(memory_t* m, const uint8_t* insn, const uint8_t* fixup)
+{
+  memory_code_fixup_t *fixups;
+  size_t size;
+
+  if (fastmem_fixup_count == fastmem_fixup_size)
+  {
+    size = fastmem_fixup_size ? fastmem_fixup_size * 2 : 1024;
+    fixups = (memory_code_fixup_t*)realloc(fastmem_fixups,
+                                           size * sizeof(*fixups));
+    if (!fixups)
+    {
+      emulator_fatal(m->emu, "Cannot allocate memory fixups");
+    }
+    fastmem_fixups = fixups;
+    fastmem_fixup_size = size;
+  }
+
+  fastmem_fixups[fastmem_fixup_count].insn = insn;
+  fastmem_fixups[fastmem_fixup_count].fixup = fixup;
+  fastmem_fixup_count++;
+}
+
+/**
+ * Drops the fixups of translated code, when the code cache is reused
+ * @param m Reference to the memory structure
+ */
+void
+memory_clear_fixups(memory_t* UNUSED(m))
+{
+  fastmem_fixup_count = 0;
+}
+#endif
 
 /**
  * Checks whether a port is a dma control port
@@ -13,6 +246,53 @@ dma_is_port(uint32_t addr)
   return 0x20007000 <= addr && addr < 0x20007FF4;
 }
 
+/**
+ * Reads the DMA registers, which are ignored
+ */
+static int
+dma_read(void* UNUSED(opaque), uint32_t addr, uint32_t* data)
+{
+  *data = 0;
+  return dma_is_port(addr);
+}
+
+/**
+ * Writes the DMA registers, which are ignored
+ */
+static int
+dma_write(void* UNUSED(opaque), uint32_t addr, uint32_t UNUSED(data))
+{
+  return dma_is_port(addr);
+}
+
+/**
+ * Reads the counter of the system timer
+ * @param opaque Reference to the emulator structure
+ * @param addr   Register address
+ * @param data   Value of the register
+ */
+static int
+timer_read(void* opaque, uint32_t addr, uint32_t* data)
+{
+  switch (addr)
+  {
+    case 0x20003004:
+    {
+      *data = emulator_get_system_timer((emulator_t*)opaque) & 0xffffffff;
+      return 1;
+    }
+    case 0x20003008:
+    {
+      *data = (emulator_get_system_timer((emulator_t*)opaque) >> 32) & 0xffffffff;
+      return 1;
+    }
+    default:
+    {
+      return 0;
+    }
+  }
+}
+
 /**
  * Initialises the memory module
  * @param m    Reference to the memory structure
@@ -23,9 +303,374 @@ void
 memory_init(memory_t* m, emulator_t* emu)
 {
   m->emu = emu;
-  m->data = (uint8_t*)malloc(emu->mem_size);
-  memset(m->data, 0, emu->mem_size);
-  assert(m->data);
+  m->size = emu->mem_size;
+  m->fd = -1;
+
+#ifdef MEMORY_FASTMEM
+  fastmem_init(m);
+#else
+  /* Anonymous pages are zeroed by the kernel on first access */
+  if (!(m->data = memory_reserve(m->size, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS)))
+  {
+    emulator_fatal(emu, "Cannot allocate %zu bytes of SDRAM", m->size);
+  }
+  memory_advise(m->data, m->size);
+#endif
+
+  m->code = (uint32_t*)calloc((emu->mem_size + 0x1FFFF) >> 17, sizeof(uint32_t));
+  assert(m->code);
+
+  m->watch_base = 0;
+  m->watch_size = 0;
+  m->dirty = NULL;
+
+  /* Region 0 has no handlers */
+  m->pages = (uint8_t*)calloc(MEMORY_PAGES, sizeof(uint8_t));
+  assert(m->pages);
+  memset(m->regions, 0, sizeof(m->regions));
+  m->region_count = 1;
+
+  /* Peripherals without a module of their own */
+  memory_register(m, 0x20003000, 0x1000, emu, timer_read, NULL, NULL);
+  memory_register(m, 0x20007000, 0x1000, NULL, dma_read, dma_write, NULL);
+}
+
+/**
+ * Maps the handlers of a peripheral on the pages covering a range of
+ * physical addresses. A peripheral registering the same handlers again
+ * reuses its region.
+ * @param m          Reference to the memory structure
+ * @param base       First address
+ * @param size       Size of the range in bytes
+ * @param opaque     Argument of the handlers
+ * @param read       Double word read handler or NULL
+ * @param write      Double word write handler or NULL
+ * @param write_word Word write handler or NULL
+ */
+void
+memory_register(memory_t* m, uint32_t base, uint32_t size, void* opaque,
+                memory_read_t read, memory_write_t write,
+                memory_write_t write_word)
+{
+  memory_region_t *r;
+  uint32_t i, page;
+
+  base &= 0x3FFFFFFF;
+  for (i = 1; i < m->region_count; ++i)
+  {
+    r = &m->regions[i];
+    if (r->opaque == opaque && r->read == read &&
+        r->write == write && r->write_word == write_word)
+    {
+      break;
+    }
+  }
+
+  if (i == m->region_count)
+  {
+    if (m->region_count == MEMORY_REGIONS)
+    {
+      emulator_fatal(m->emu, "Too many peripheral regions");
+    }
+
+    r = &m->regions[m->region_count++];
+    r->opaque = opaque;
+    r->read = read;
+    r->write = write;
+    r->write_word = write_word;
+  }
+
+  for (page = base >> 12; page < MEMORY_PAGES && page <= (base + size - 1) >> 12; ++page)
+  {
+    m->pages[page] = i;
+  }
+}
+
+/**
+ * Maps a file into SDRAM copy-on-write. Pages are read on demand and shared
+ * through the page cache until the guest writes them.
+ *
+ * With fastmem, SDRAM is a shared mapping seen at four bus aliases, which a
+ * private file mapping cannot join. The caller reads the file instead, so
+ * aliased accesses stay on the fast path and huge pages are not split.
+ * Running with --no-fastmem maps SDRAM at alias 0 only, and the file is
+ * mapped there.
+ *
+ * @param m    Reference to the memory structure
+ * @param addr Page aligned address inside SDRAM
+ * @param fd   Descriptor of the file
+ * @param size Size of the file in bytes
+ * @return Nonzero if the file was mapped
+ */
+int
+memory_map_file(memory_t* m, uint32_t addr, int fd, size_t size)
+{
+  size_t length = (size + 0xFFF) & ~(size_t)0xFFF;
+
+#ifdef MEMORY_FASTMEM
+  if (m->fd >= 0)
+  {
+    return 0;
+  }
+#endif
+
+  if ((addr & 0xFFF) || size == 0 || addr + length > m->size)
+  {
+    return 0;
+  }
+
+  if (mmap(m->data + addr, length, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+  {
+    return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * Removes the peripheral mapped on the pages covering a range
+ * @param m    Reference to the memory structure
+ * @param base First address
+ * @param size Size of the range in bytes
+ */
+void
+memory_unregister(memory_t* m, uint32_t base, uint32_t size)
+{
+  uint32_t page;
+
+  base &= 0x3FFFFFFF;
+  for (page = base >> 12; page < MEMORY_PAGES && page <= (base + size - 1) >> 12; ++page)
+  {
+    m->pages[page] = 0;
+  }
+}
+
+/**
+ * Drops the cached code covering a write to a code page
+ * @param m    Reference to the memory structure
+ * @param addr Physical address inside SDRAM
+ */
+void
+memory_write_code(memory_t* m, uint32_t addr)
+{
+  cpu_invalidate_op(&m->emu->cpu, addr);
+}
+
+/**
+ * Returns the number of bytes of a range which lie in SDRAM, starting at
+ * its first address
+ * @param m    Reference to the memory structure
+ * @param addr First address
+ * @param size Size of the range in bytes
+ */
+static inline size_t
+memory_block_sdram(const memory_t* m, uint32_t addr, size_t size)
+{
+  addr &= 0x3FFFFFFF;
+  if (addr >= m->size)
+  {
+    return 0;
+  }
+
+  return size < m->size - addr ? size : m->size - addr;
+}
+
+/**
+ * Drops the cached code covering a range of SDRAM written by a block copy
+ * and records the part of it which is watched. Only pages marked as code are
+ * scanned, a word at a time.
+ * @param m    Reference to the memory structure
+ * @param addr Physical address inside SDRAM
+ * @param size Size of the range in bytes
+ */
+static void
+memory_block_written(memory_t* m, uint32_t addr, size_t size)
+{
+  uint32_t page, end, first, last;
+
+  if (size == 0)
+  {
+    return;
+  }
+
+  end = addr + size;
+  first = addr > m->watch_base ? addr : m->watch_base;
+  last = end < m->watch_base + m->watch_size ? end : m->watch_base + m->watch_size;
+  for (first &= ~((1 << MEMORY_DIRTY_SHIFT) - 1); first < last;
+       first += 1 << MEMORY_DIRTY_SHIFT)
+  {
+    memory_set_dirty(m, first);
+  }
+
+  for (page = addr & ~0xFFF; page < end; page += 0x1000)
+  {
+    if (!memory_is_code(m, page))
+    {
+      continue;
+    }
+
+    first = page < addr ? addr & ~0x3 : page;
+    last = end < page + 0x1000 ? end : page + 0x1000;
+    for (; first < last; first += 4)
+    {
+      memory_write_code(m, first);
+    }
+  }
+}
+
+/**
+ * Starts recording writes to a range of SDRAM, replacing the previous one.
+ * The whole range starts out dirty.
+ * @param m    Reference to the memory structure
+ * @param base First address, aligned to a chunk
+ * @param size Size of the range in bytes, zero to stop recording
+ */
+void
+memory_watch(memory_t* m, uint32_t base, uint32_t size)
+{
+  size_t words = ((size >> MEMORY_DIRTY_SHIFT) + 32) >> 5;
+
+  assert((base & ((1 << MEMORY_DIRTY_SHIFT) - 1)) == 0);
+  free(m->dirty);
+  m->dirty = (uint32_t*)malloc(words * sizeof(uint32_t));
+  assert(m->dirty);
+  memset(m->dirty, 0xFF, words * sizeof(uint32_t));
+
+  m->watch_base = base;
+  m->watch_size = size;
+}
+
+/**
+ * Checks whether any chunk covering a part of the watched range was written
+ * since the last call to memory_clean
+ * @param m    Reference to the memory structure
+ * @param addr Physical address inside the watched range
+ * @param size Size of the part in bytes
+ * @return Nonzero if the part is dirty
+ */
+int
+memory_is_dirty(memory_t* m, uint32_t addr, uint32_t size)
+{
+  uint32_t chunk, last;
+
+  if (size == 0)
+  {
+    return 0;
+  }
+
+  chunk = (addr - m->watch_base) >> MEMORY_DIRTY_SHIFT;
+  last = (addr - m->watch_base + size - 1) >> MEMORY_DIRTY_SHIFT;
+  for (; chunk <= last; ++chunk)
+  {
+    if ((m->dirty[chunk >> 5] >> (chunk & 0x1F)) & 1)
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Forgets all writes recorded in the watched range
+ * @param m Reference to the memory structure
+ */
+void
+memory_clean(memory_t* m)
+{
+  if (!m->dirty)
+  {
+    return;
+  }
+
+  memset(m->dirty, 0,
+         (((m->watch_size >> MEMORY_DIRTY_SHIFT) + 32) >> 5) * sizeof(uint32_t));
+}
+
+/**
+ * Reads a range of guest memory. The part in SDRAM is copied at once,
+ * anything beyond goes through the accessors, a double word at a time.
+ * @param m    Reference to the memory structure
+ * @param addr First address
+ * @param dst  Destination buffer
+ * @param size Number of bytes
+ */
+void
+memory_read_block(memory_t* m, uint32_t addr, void* dst, size_t size)
+{
+  uint8_t *out = (uint8_t*)dst;
+  size_t n = memory_block_sdram(m, addr, size);
+  uint32_t data;
+
+  memcpy(out, m->data + (addr & 0x3FFFFFFF), n);
+
+  for (; n + 4 <= size && ((addr + n) & 0x3) == 0; n += 4)
+  {
+    data = memory_read_dword_le(m, addr + n);
+    memcpy(out + n, &data, sizeof(data));
+  }
+  for (; n < size; ++n)
+  {
+    out[n] = memory_read_byte(m, addr + n);
+  }
+}
+
+/**
+ * Writes a range of guest memory, invalidating any code it covers. The
+ * part in SDRAM is copied at once, anything beyond goes through the
+ * accessors, a double word at a time.
+ * @param m    Reference to the memory structure
+ * @param addr First address
+ * @param src  Source buffer
+ * @param size Number of bytes
+ */
+void
+memory_write_block(memory_t* m, uint32_t addr, const void* src, size_t size)
+{
+  const uint8_t *in = (const uint8_t*)src;
+  size_t n = memory_block_sdram(m, addr, size);
+  uint32_t data;
+
+  memcpy(m->data + (addr & 0x3FFFFFFF), in, n);
+  memory_block_written(m, addr & 0x3FFFFFFF, n);
+
+  for (; n + 4 <= size && ((addr + n) & 0x3) == 0; n += 4)
+  {
+    memcpy(&data, in + n, sizeof(data));
+    memory_write_dword_le(m, addr + n, data);
+  }
+  for (; n < size; ++n)
+  {
+    memory_write_byte(m, addr + n, in[n]);
+  }
+}
+
+/**
+ * Fills a range of guest memory with a byte, invalidating any code it
+ * covers
+ * @param m     Reference to the memory structure
+ * @param addr  First address
+ * @param value Byte to be written
+ * @param size  Number of bytes
+ */
+void
+memory_fill(memory_t* m, uint32_t addr, uint8_t value, size_t size)
+{
+  size_t n = memory_block_sdram(m, addr, size);
+
+  memset(m->data + (addr & 0x3FFFFFFF), value, n);
+  memory_block_written(m, addr & 0x3FFFFFFF, n);
+
+  for (; n + 4 <= size && ((addr + n) & 0x3) == 0; n += 4)
+  {
+    memory_write_dword_le(m, addr + n, value * 0x01010101u);
+  }
+  for (; n < size; ++n)
+  {
+    memory_write_byte(m, addr + n, value);
+  }
 }
 
 /**
@@ -35,15 +680,24 @@ memory_init(memory_t* m, emulator_t* emu)
 void
 memory_dump(memory_t* m)
 {
-  size_t i = 0;
+  uint32_t chunk[1024];
+  size_t i, j, size;
   printf("Non-zero memory:\n");
 
-  for (i = 0; i < m->emu->mem_size && i < 65535; i += 4)
+  /* Only the first 64 KiB are printed, read in chunks */
+  size = m->emu->mem_size < 65536 ? m->emu->mem_size & ~(size_t)3 : 65536;
+  for (i = 0; i < size; i += sizeof(chunk))
   {
-    uint32_t data = memory_read_dword_be(m, i);
-    if (data != 0)
+    j = size - i < sizeof(chunk) ? size - i : sizeof(chunk);
+    memory_read_block(m, i, chunk, j);
+
+    for (j = 0; j < sizeof(chunk) && i + j < size; j += 4)
     {
-      printf("0x%08zx: 0x%08x\n", i, data);
+      uint32_t data = __builtin_bswap32(chunk[j >> 2]);
+      if (data != 0)
+      {
+        printf("0x%08zx: 0x%08x\n", i + j, data);
+      }
     }
   }
 }
@@ -62,22 +716,51 @@ memory_destroy(memory_t* m)
 
   if (m->data)
   {
-    free(m->data);
+#ifdef MEMORY_FASTMEM
+    fastmem_base = NULL;
+    free(fastmem_fixups);
+    fastmem_fixups = NULL;
+    fastmem_fixup_count = fastmem_fixup_size = 0;
+    munmap(m->data, FASTMEM_SIZE);
+    if (m->fd >= 0)
+    {
+      close(m->fd);
+    }
+#else
+    munmap(m->data, m->size);
+#endif
+    m->data = NULL;
+  }
+
+  if (m->code)
+  {
+    free(m->code);
+  }
+
+  if (m->dirty)
+  {
+    free(m->dirty);
+    m->dirty = NULL;
+  }
+
+  if (m->pages)
+  {
+    free(m->pages);
   }
 }
 
 /**
- * Reads a byte from memory
+ * Reads a byte outside SDRAM
  * @param memory Reference to the memory structure
  * @param addr Memory location
  */
 uint8_t
-memory_read_byte(memory_t* m, uint32_t addr)
+memory_read_byte_slow(memory_t* m, uint32_t addr)
 {
   addr = addr & 0x3FFFFFFF;
 
   /* SDRAM */
-  if (__builtin_expect(addr < m->emu->mem_size, 1))
+  if (addr < m->size)
   {
     return m->data[addr];
   }
@@ -87,12 +770,12 @@ memory_read_byte(memory_t* m, uint32_t addr)
 }
 
 /**
- * Reads a word from memory (little endian)
+ * Reads a word which is unaligned or outside SDRAM (little endian)
  * @param memory Reference to the memory structure
  * @param address Memory location
  */
 uint16_t
-memory_read_word_le(memory_t* m, uint32_t addr)
+memory_read_word_slow(memory_t* m, uint32_t addr)
 {
   uint32_t base;
   uint8_t off;
@@ -100,7 +783,7 @@ memory_read_word_le(memory_t* m, uint32_t addr)
   addr = addr & 0x3FFFFFFF;
 
   /* SDRAM */
-  if (__builtin_expect(addr + 1 < m->emu->mem_size, 1))
+  if (addr + 1 < m->size)
   {
     base = addr & ~0x01;
     off = addr & 0x01;
@@ -114,14 +797,16 @@ memory_read_word_le(memory_t* m, uint32_t addr)
 }
 
 /**
- * Reads a double word from memory (little endian)
+ * Reads a double word which is unaligned or outside SDRAM (little endian).
+ * Unaligned reads return the aligned word rotated.
  * @param memory Reference to the memory structure
  * @param address Memory location
  */
 uint32_t
-memory_read_dword_le(memory_t* m, uint32_t addr)
+memory_read_dword_slow(memory_t* m, uint32_t addr)
 {
-  uint32_t base;
+  memory_region_t *r;
+  uint32_t base, data;
   uint8_t off;
 
   /* Apparently, SDRAM and IO peripherials are mapped to 4 different address
@@ -132,7 +817,7 @@ memory_read_dword_le(memory_t* m, uint32_t addr)
   addr = addr & 0x3FFFFFFF;
 
   /* SDRAM Read */
-  if (__builtin_expect(addr + 3 < m->emu->mem_size, 1))
+  if (addr + 3 < m->size)
   {
     base = addr & ~0x03;
     off = addr & 0x03;
@@ -143,40 +828,11 @@ memory_read_dword_le(memory_t* m, uint32_t addr)
            (m->data[base + ((off + 3) & 0x03)] << 24);
   }
 
-  /* System Timer */
-  if (addr == 0x20003004)
-  {
-    uint64_t timer_value = emulator_get_system_timer(m->emu);
-    return (uint32_t)(timer_value & 0xffffffff);
-  }
-  else if (addr == 0x20003008)
-  {
-    uint64_t timer_value = emulator_get_system_timer(m->emu);
-    return (uint32_t)((timer_value >> 32) & 0xffffffff);
-  }
-
-  /* GPIO registers */
-  if (gpio_is_port(addr))
-  {
-    return gpio_read_port(&m->emu->gpio, addr);
-  }
-
-  /* Mailbox interface */
-  if (mbox_is_port(addr))
-  {
-    return mbox_read(&m->emu->mbox, addr);
-  }
-
   /* Peripherals */
-  if (pr_is_aux_port(addr))
-  {
-    return pr_read(&m->emu->pr, addr);
-  }
-
-  /* DMA - just ignore it */
-  if (dma_is_port(addr))
+  r = &m->regions[m->pages[addr >> 12]];
+  if (r->read && r->read(r->opaque, addr, &data))
   {
-    return 0;
+    return data;
   }
 
   emulator_error(m->emu, "Out of bounds memory access at address 0x%08x", addr);
@@ -184,20 +840,21 @@ memory_read_dword_le(memory_t* m, uint32_t addr)
 }
 
 /**
- * Writes a single byte to memory
+ * Writes a single byte outside SDRAM
  * @param m    Reference to the memory structure
  * @param addr Memory location
  * @param data Data to be written
  */
 void
-memory_write_byte(memory_t* m, uint32_t addr, uint8_t data)
+memory_write_byte_slow(memory_t* m, uint32_t addr, uint8_t data)
 {
   addr = addr & 0x3FFFFFFF;
 
   /* SDRAM */
-  if (__builtin_expect(addr < m->emu->mem_size, 1))
+  if (addr < m->size)
   {
     m->data[addr] = data;
+    memory_written(m, addr);
     return;
   }
 
@@ -205,28 +862,32 @@ memory_write_byte(memory_t* m, uint32_t addr, uint8_t data)
 }
 
 /**
- * Writes a word to memory
+ * Writes a word which is unaligned or outside SDRAM
  * @param m    Reference to the memory structure
  * @param addr Memory location
  * @param data Data to be written
  */
 void
-memory_write_word_le(memory_t* m, uint32_t addr, uint16_t data)
+memory_write_word_slow(memory_t* m, uint32_t addr, uint16_t data)
 {
+  memory_region_t *r;
+
   addr = addr & 0x3FFFFFFF;
 
   /* SDRAM */
-  if (__builtin_expect(addr + 1 < m->emu->mem_size, 1))
+  if (addr + 1 < m->size)
   {
     m->data[addr + 0] = (data >> 0) & 0xFF;
     m->data[addr + 1] = (data >> 8) & 0xFF;
+    memory_written(m, addr);
+    memory_written(m, addr + 1);
     return;
   }
 
-  /* Framebuffer */
-  if (fb_is_buffer(&m->emu->fb, addr))
+  /* Peripherals */
+  r = &m->regions[m->pages[addr >> 12]];
+  if (r->write_word && r->write_word(r->opaque, addr, data))
   {
-    fb_write_word(&m->emu->fb, addr, data);
     return;
   }
 
@@ -234,56 +895,33 @@ memory_write_word_le(memory_t* m, uint32_t addr, uint16_t data)
 }
 
 /**
- * Writes a double word to memory
+ * Writes a double word which is unaligned or outside SDRAM
  * @param m    Reference to the memory structure
  * @param addr Memory location
  * @param data Data to be written
  */
 void
-memory_write_dword_le(memory_t* m, uint32_t addr, uint32_t data)
+memory_write_dword_slow(memory_t* m, uint32_t addr, uint32_t data)
 {
+  memory_region_t *r;
+
   addr = addr & 0x3FFFFFFF;
 
   /* SDRAM */
-  if (__builtin_expect(addr + 3 < m->emu->mem_size, 1))
+  if (addr + 3 < m->size)
   {
     m->data[addr + 0] = (data >>  0) & 0xFF;
     m->data[addr + 1] = (data >>  8) & 0xFF;
     m->data[addr + 2] = (data >> 16) & 0xFF;
     m->data[addr + 3] = (data >> 24) & 0xFF;
-    return;
-  }
-
-  /* GPIO registers */
-  if (gpio_is_port(addr))
-  {
-    gpio_write_port(&m->emu->gpio, addr, data);
-    return;
-  }
-
-  /* Mailbox interface */
-  if (mbox_is_port(addr))
-  {
-    mbox_write(&m->emu->mbox, addr, data);
-    return;
-  }
-
-  /* Framebuffer */
-  if (fb_is_buffer(&m->emu->fb, addr))
-  {
-    fb_write_dword(&m->emu->fb, addr, data);
+    memory_written(m, addr);
+    memory_written(m, addr + 3);
     return;
   }
 
   /* Peripherals */
-  if (pr_is_aux_port(addr))
-  {
-    pr_write(&m->emu->pr, addr, data);
-    return;
-  }
-
-  /* DMA - just ignore it */
-  if (dma_is_port(addr))
+  r = &m->regions[m->pages[addr >> 12]];
+  if (r->write && r->write(r->opaque, addr, data))
   {
     return;
   }
@@ -6,24 +6,417 @@
 #ifndef __MEMORY_H__
 #define __MEMORY_H__
 
+/**
+ * Guest accesses are plain host accesses into a reserved 4 GiB range.
+ * Peripherals are tested for inline, stray accesses to unmapped memory are
+ * caught by a SIGSEGV handler.
+ */
+#if defined(__x86_64__) && defined(__linux__)
+#  define MEMORY_FASTMEM
+#endif
+
+/**
+ * Maximum number of peripheral regions
+ */
+#define MEMORY_REGIONS 16
+
+/**
+ * Number of 4 KiB pages in the physical address space, after the two most
+ * significant bits are dropped
+ */
+#define MEMORY_PAGES   (1 << 18)
+
+/**
+ * Writes to the watched range are recorded in chunks of 1 << MEMORY_DIRTY_SHIFT
+ * bytes
+ */
+#define MEMORY_DIRTY_SHIFT 8
+
+/**
+ * Peripheral register handlers. They return zero if the address is not a
+ * register, in which case the access is reported as out of bounds.
+ */
+typedef int (*memory_read_t)(void* opaque, uint32_t addr, uint32_t* data);
+typedef int (*memory_write_t)(void* opaque, uint32_t addr, uint32_t data);
+
+/**
+ * Peripheral mapped on one or more pages
+ */
+typedef struct
+{
+  void           *opaque;
+  memory_read_t   read;        /* Double word reads */
+  memory_write_t  write;       /* Double word writes */
+  memory_write_t  write_word;  /* Word writes */
+} memory_region_t;
+
 /**
  * Memory system
  */
 typedef struct _memory_t
 {
   uint8_t     *data;
+  size_t       size;
   emulator_t  *emu;
+
+  /* With fastmem, data is the start of the 4 GiB reservation and SDRAM is
+   * backed by a memory file mapped at each of the four aliases. With
+   * --no-fastmem there is no file, SDRAM is only mapped at alias 0. */
+  int          fd;
+
+  /* One bit per 4 KiB page which holds predecoded code */
+  uint32_t    *code;
+
+  /* Range of SDRAM whose writes are recorded, one bit per chunk, so that
+   * the framebuffer only presents what changed */
+  uint32_t     watch_base;
+  uint32_t     watch_size;
+  uint32_t    *dirty;
+
+  /* Region of each page outside SDRAM, 0 if nothing is mapped there */
+  uint8_t     *pages;
+  memory_region_t regions[MEMORY_REGIONS];
+  uint32_t     region_count;
 } memory_t;
 
 void      memory_init(memory_t*, emulator_t*);
 void      memory_dump(memory_t*);
 void      memory_destroy(memory_t*);
-uint8_t   memory_read_byte(memory_t*, uint32_t);
-uint16_t  memory_read_word_le(memory_t*, uint32_t);
-uint32_t  memory_read_dword_le(memory_t*, uint32_t);
-void      memory_write_byte(memory_t*, uint32_t, uint8_t);
-void      memory_write_word_le(memory_t*, uint32_t, uint16_t);
-void      memory_write_dword_le(memory_t*, uint32_t, uint32_t);
+uint8_t   memory_read_byte_slow(memory_t*, uint32_t);
+uint16_t  memory_read_word_slow(memory_t*, uint32_t);
+uint32_t  memory_read_dword_slow(memory_t*, uint32_t);
+void      memory_write_byte_slow(memory_t*, uint32_t, uint8_t);
+void      memory_write_word_slow(memory_t*, uint32_t, uint16_t);
+void      memory_write_dword_slow(memory_t*, uint32_t, uint32_t);
+void      memory_write_code(memory_t*, uint32_t);
+void      memory_register(memory_t*, uint32_t base, uint32_t size, void*,
+                          memory_read_t, memory_write_t, memory_write_t);
+void      memory_unregister(memory_t*, uint32_t base, uint32_t size);
+int       memory_map_file(memory_t*, uint32_t addr, int fd, size_t size);
+void      memory_watch(memory_t*, uint32_t base, uint32_t size);
+int       memory_is_dirty(memory_t*, uint32_t addr, uint32_t size);
+void      memory_clean(memory_t*);
+void      memory_read_block(memory_t*, uint32_t addr, void* dst, size_t size);
+void      memory_write_block(memory_t*, uint32_t addr, const void* src,
+                             size_t size);
+void      memory_fill(memory_t*, uint32_t addr, uint8_t value, size_t size);
+
+#ifdef MEMORY_FASTMEM
+/**
+ * Performs a host access to guest memory which might fault. The SIGSEGV
+ * handler finds the instruction in the memory_fixups section and resumes at
+ * the fixup, which sets fault and skips the access.
+ */
+#define MEMORY_ACCESS(fault, insn, ...)                                      \
+  __asm__ volatile("1: " insn "\n"                                           \
+                   "2:\n"                                                    \
+                   ".pushsection .text.unlikely, \"ax\"\n"                   \
+                   "3: movl $1, %[fault]\n"                                  \
+                   "   jmp 2b\n"                                             \
+                   ".popsection\n"                                           \
+                   ".pushsection memory_fixups, \"a\"\n"                     \
+                   ".balign 4\n"                                             \
+                   ".long 1b - ., 3b - .\n"                                  \
+                   ".popsection\n"                                           \
+                   __VA_ARGS__)
+
+/**
+ * Checks whether an address lies in the peripheral window, at any of the
+ * four bus aliases. Such accesses go straight to the slow path: faulting
+ * costs microseconds, which would make polling the timer or GPIO crawl.
+ * @param addr Memory location
+ * @return Nonzero if the access cannot be a plain host access
+ */
+static inline int
+memory_is_peripheral(uint32_t addr)
+{
+  return (addr & 0x3F000000) == 0x20000000;
+}
+
+void      memory_add_fixup(memory_t*, const uint8_t* insn, const uint8_t* fixup);
+void      memory_clear_fixups(memory_t*);
+#endif
+
+/**
+ * Checks whether a page of SDRAM holds predecoded code
+ * @param m    Reference to the memory structure
+ * @param addr Physical address inside SDRAM
+ * @return Nonzero if writes to the page must invalidate code
+ */
+static inline int
+memory_is_code(const memory_t* m, uint32_t addr)
+{
+  return (m->code[addr >> 17] >> ((addr >> 12) & 0x1F)) & 1;
+}
+
+/**
+ * Marks a page of SDRAM as holding predecoded code
+ * @param m    Reference to the memory structure
+ * @param addr Physical address inside SDRAM
+ */
+static inline void
+memory_set_code(memory_t* m, uint32_t addr)
+{
+  m->code[addr >> 17] |= 1u << ((addr >> 12) & 0x1F);
+}
+
+/**
+ * Marks a page of SDRAM as holding data only
+ * @param m    Reference to the memory structure
+ * @param addr Physical address inside SDRAM
+ */
+static inline void
+memory_clear_code(memory_t* m, uint32_t addr)
+{
+  m->code[addr >> 17] &= ~(1u << ((addr >> 12) & 0x1F));
+}
+
+/**
+ * Reads a byte from memory
+ * @param m    Reference to the memory structure
+ * @param addr Memory location
+ */
+static inline uint8_t
+memory_read_byte(memory_t* m, uint32_t addr)
+{
+#ifdef MEMORY_FASTMEM
+  uint32_t data;
+  int fault = 0;
+
+  if (__builtin_expect(!memory_is_peripheral(addr), 1))
+  {
+    MEMORY_ACCESS(fault, "movzbl %[mem], %[data]",
+      : [data] "=r" (data), [fault] "+r" (fault)
+      : [mem] "m" (m->data[addr]));
+    if (__builtin_expect(!fault, 1))
+    {
+      return data;
+    }
+  }
+#else
+  addr &= 0x3FFFFFFF;
+  if (__builtin_expect(addr < m->size, 1))
+  {
+    return m->data[addr];
+  }
+#endif
+
+  return memory_read_byte_slow(m, addr);
+}
+
+/**
+ * Reads a word from memory (little endian). Aligned SDRAM reads are a
+ * single host load, the rest is left to memory_read_word_slow.
+ * @param m    Reference to the memory structure
+ * @param addr Memory location
+ */
+static inline uint16_t
+memory_read_word_le(memory_t* m, uint32_t addr)
+{
+#ifdef MEMORY_FASTMEM
+  uint32_t data;
+  int fault = 0;
+
+  if (__builtin_expect((addr & 0x1) == 0 && !memory_is_peripheral(addr), 1))
+  {
+    MEMORY_ACCESS(fault, "movzwl %[mem], %[data]",
+      : [data] "=r" (data), [fault] "+r" (fault)
+      : [mem] "m" (*(uint16_t*)(m->data + addr)));
+    if (__builtin_expect(!fault, 1))
+    {
+      return data;
+    }
+  }
+#else
+  uint16_t data;
+
+  addr &= 0x3FFFFFFF;
+  if (__builtin_expect((addr & 0x1) == 0 && addr + 1 < m->size, 1))
+  {
+    memcpy(&data, m->data + addr, sizeof(data));
+    return data;
+  }
+#endif
+
+  return memory_read_word_slow(m, addr);
+}
+
+/**
+ * Reads a double word from memory (little endian). Aligned SDRAM reads are
+ * a single host load, the rest is left to memory_read_dword_slow.
+ * @param m    Reference to the memory structure
+ * @param addr Memory location
+ */
+static inline uint32_t
+memory_read_dword_le(memory_t* m, uint32_t addr)
+{
+  uint32_t data;
+
+#ifdef MEMORY_FASTMEM
+  int fault = 0;
+
+  if (__builtin_expect((addr & 0x3) == 0 && !memory_is_peripheral(addr), 1))
+  {
+    MEMORY_ACCESS(fault, "movl %[mem], %[data]",
+      : [data] "=r" (data), [fault] "+r" (fault)
+      : [mem] "m" (*(uint32_t*)(m->data + addr)));
+    if (__builtin_expect(!fault, 1))
+    {
+      return data;
+    }
+  }
+#else
+  addr &= 0x3FFFFFFF;
+  if (__builtin_expect((addr & 0x3) == 0 && addr + 3 < m->size, 1))
+  {
+    memcpy(&data, m->data + addr, sizeof(data));
+    return data;
+  }
+#endif
+
+  return memory_read_dword_slow(m, addr);
+}
+
+/**
+ * Records a write to the watched range
+ * @param m    Reference to the memory structure
+ * @param addr Physical address inside SDRAM
+ */
+static inline void
+memory_set_dirty(memory_t* m, uint32_t addr)
+{
+  uint32_t chunk = (addr - m->watch_base) >> MEMORY_DIRTY_SHIFT;
+
+  m->dirty[chunk >> 5] |= 1u << (chunk & 0x1F);
+}
+
+/**
+ * Invalidates the code overwritten by a store which went straight to SDRAM
+ * and records writes to the watched range
+ * @param m    Reference to the memory structure
+ * @param addr Memory location
+ */
+static inline void
+memory_written(memory_t* m, uint32_t addr)
+{
+  addr &= 0x3FFFFFFF;
+  if (addr - m->watch_base < m->watch_size)
+  {
+    memory_set_dirty(m, addr);
+  }
+  if (__builtin_expect(memory_is_code(m, addr), 0))
+  {
+    memory_write_code(m, addr);
+  }
+}
+
+/**
+ * Writes a single byte to memory
+ * @param m    Reference to the memory structure
+ * @param addr Memory location
+ * @param data Data to be written
+ */
+static inline void
+memory_write_byte(memory_t* m, uint32_t addr, uint8_t data)
+{
+#ifdef MEMORY_FASTMEM
+  int fault = 0;
+
+  if (__builtin_expect(!memory_is_peripheral(addr), 1))
+  {
+    MEMORY_ACCESS(fault, "movb %b[data], %[mem]",
+      : [mem] "=m" (m->data[addr]), [fault] "+r" (fault)
+      : [data] "r" (data));
+    if (__builtin_expect(!fault, 1))
+    {
+      memory_written(m, addr);
+      return;
+    }
+  }
+#else
+  addr &= 0x3FFFFFFF;
+  if (__builtin_expect(addr < m->size, 1))
+  {
+    m->data[addr] = data;
+    memory_written(m, addr);
+    return;
+  }
+#endif
+
+  memory_write_byte_slow(m, addr, data);
+}
+
+/**
+ * Writes a word to memory (little endian)
+ * @param m    Reference to the memory structure
+ * @param addr Memory location
+ * @param data Data to be written
+ */
+static inline void
+memory_write_word_le(memory_t* m, uint32_t addr, uint16_t data)
+{
+#ifdef MEMORY_FASTMEM
+  int fault = 0;
+
+  if (__builtin_expect((addr & 0x1) == 0 && !memory_is_peripheral(addr), 1))
+  {
+    MEMORY_ACCESS(fault, "movw %w[data], %[mem]",
+      : [mem] "=m" (*(uint16_t*)(m->data + addr)), [fault] "+r" (fault)
+      : [data] "r" (data));
+    if (__builtin_expect(!fault, 1))
+    {
+      memory_written(m, addr);
+      return;
+    }
+  }
+#else
+  addr &= 0x3FFFFFFF;
+  if (__builtin_expect((addr & 0x1) == 0 && addr + 1 < m->size, 1))
+  {
+    memcpy(m->data + addr, &data, sizeof(data));
+    memory_written(m, addr);
+    return;
+  }
+#endif
+
+  memory_write_word_slow(m, addr, data);
+}
+
+/**
+ * Writes a double word to memory (little endian)
+ * @param m    Reference to the memory structure
+ * @param addr Memory location
+ * @param data Data to be written
+ */
+static inline void
+memory_write_dword_le(memory_t* m, uint32_t addr, uint32_t data)
+{
+#ifdef MEMORY_FASTMEM
+  int fault = 0;
+
+  if (__builtin_expect((addr & 0x3) == 0 && !memory_is_peripheral(addr), 1))
+  {
+    MEMORY_ACCESS(fault, "movl %[data], %[mem]",
+      : [mem] "=m" (*(uint32_t*)(m->data + addr)), [fault] "+r" (fault)
+      : [data] "r" (data));
+    if (__builtin_expect(!fault, 1))
+    {
+      memory_written(m, addr);
+      return;
+    }
+  }
+#else
+  addr &= 0x3FFFFFFF;
+  if (__builtin_expect((addr & 0x3) == 0 && addr + 3 < m->size, 1))
+  {
+    memcpy(m->data + addr, &data, sizeof(data));
+    memory_written(m, addr);
+    return;
+  }
+#endif
+
+  memory_write_dword_slow(m, addr, data);
+}
 
 /**
  * Reads a word from memory (big endian)
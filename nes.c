@@ -15,14 +15,14 @@ nes_init(nes_t* nes, emulator_t* emu)
   memset(&nes->binding, 0, sizeof(nes->binding));
 
   /* Set up key bindings */
-  nes->binding[NES_A]      = SDLK_SPACE;
-  nes->binding[NES_B]      = SDLK_TAB;
-  nes->binding[NES_START]  = SDLK_RETURN;
-  nes->binding[NES_SELECT] = SDLK_p;
-  nes->binding[NES_LEFT]   = SDLK_a;
-  nes->binding[NES_RIGHT]  = SDLK_d;
-  nes->binding[NES_UP]     = SDLK_w;
-  nes->binding[NES_DOWN]   = SDLK_s;
+  nes->binding[NES_A]      = INPUT_KEY_SPACE;
+  nes->binding[NES_B]      = INPUT_KEY_TAB;
+  nes->binding[NES_START]  = INPUT_KEY_RETURN;
+  nes->binding[NES_SELECT] = INPUT_KEY_P;
+  nes->binding[NES_LEFT]   = INPUT_KEY_A;
+  nes->binding[NES_RIGHT]  = INPUT_KEY_D;
+  nes->binding[NES_UP]     = INPUT_KEY_W;
+  nes->binding[NES_DOWN]   = INPUT_KEY_S;
 }
 
 static inline void
@@ -66,9 +66,9 @@ nes_gpio_write(nes_t* nes, uint32_t port, uint32_t value)
 }
 
 void
-nes_on_key_down(nes_t* nes, SDLKey key)
+nes_on_key_down(nes_t* nes, input_key_t key)
 {
-  /* Search for the button bound to this SDLKey */
+  /* Search for the button bound to this key */
   for (int i = 0; i < NES_BUTTON_COUNT; ++i)
   {
     if (nes->binding[i] == key)
@@ -79,9 +79,9 @@ nes_on_key_down(nes_t* nes, SDLKey key)
 }
 
 void
-nes_on_key_up(nes_t* nes, SDLKey key)
+nes_on_key_up(nes_t* nes, input_key_t key)
 {
-  /* Search for the button bound to this SDLKey */
+  /* Search for the button bound to this key */
   for (int i = 0; i < NES_BUTTON_COUNT; ++i)
   {
     if (nes->binding[i] == key)
@@ -32,12 +32,12 @@ typedef struct
 
   /* Button States */
   uint32_t state[NES_BUTTON_COUNT];
-  SDLKey binding[NES_BUTTON_COUNT];
+  input_key_t binding[NES_BUTTON_COUNT];
 } nes_t;
 
 void nes_init(nes_t*, emulator_t*);
 void nes_gpio_write(nes_t*, uint32_t, uint32_t);
-void nes_on_key_down(nes_t*, SDLKey);
-void nes_on_key_up(nes_t*, SDLKey);
+void nes_on_key_down(nes_t*, input_key_t);
+void nes_on_key_up(nes_t*, input_key_t);
 
 #endif /* __NES_H__ */
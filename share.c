@@ -0,0 +1,144 @@
+/* This file is part of the Team 28 Project
+ * Licensing information can be found in the LICENSE file
+ * (C) 2014 The Team 28 Authors. All rights reserved.
+ */
+#define _GNU_SOURCE
+#include "common.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/**
+ * Creates the shared memory segment named on the command line. It is large
+ * enough for any framebuffer the guest can request, but pages are only
+ * allocated once they are written.
+ *
+ * @param share Reference to the export structure
+ * @param emu   Reference to the emulator structure
+ */
+void
+share_init(share_t* share, emulator_t* emu)
+{
+  assert(share);
+  assert(emu);
+
+  share->emu = emu;
+  share->fd = -1;
+  share->data = NULL;
+  share->header = NULL;
+  share->last = 0;
+
+  if (!emu->share_name)
+  {
+    return;
+  }
+
+  /* POSIX shared memory names start with a slash */
+  snprintf(share->name, sizeof(share->name), "%s%s",
+           emu->share_name[0] == '/' ? "" : "/", emu->share_name);
+
+  share->size = SHARE_PIXELS + emu->mem_size;
+  share->fd = shm_open(share->name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (share->fd < 0)
+  {
+    emulator_fatal(emu, "Cannot create shared memory '%s'", share->name);
+  }
+  if (ftruncate(share->fd, share->size) != 0)
+  {
+    emulator_fatal(emu, "Cannot resize shared memory '%s'", share->name);
+  }
+
+  share->data = mmap(NULL, share->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     share->fd, 0);
+  if (share->data == MAP_FAILED)
+  {
+    share->data = NULL;
+    emulator_fatal(emu, "Cannot map shared memory '%s'", share->name);
+  }
+
+  /* The segment starts out empty, as frame 0 */
+  share->header = (share_header_t*)share->data;
+  share->header->magic = SHARE_MAGIC;
+}
+
+/**
+ * Unmaps and removes the segment. Readers which still map it keep it
+ * until they unmap it.
+ *
+ * @param share Reference to the export structure
+ */
+void
+share_destroy(share_t* share)
+{
+  if (!share || !share->emu || share->fd < 0)
+  {
+    return;
+  }
+
+  if (share->data)
+  {
+    munmap(share->data, share->size);
+    share->data = NULL;
+    share->header = NULL;
+  }
+
+  shm_unlink(share->name);
+  close(share->fd);
+  share->fd = -1;
+}
+
+/**
+ * Writes a frame to the segment and wakes up readers waiting for it. Only
+ * rows which changed are copied, unless frames were skipped or the layout
+ * changed. Called by the display thread.
+ *
+ * @param share Reference to the export structure
+ * @param frame Frame to be exported
+ */
+void
+share_frame(share_t* share, const fb_frame_t* frame)
+{
+  share_header_t *header = share->header;
+  uint8_t *pixels = share->data + SHARE_PIXELS;
+  uint32_t seq, y;
+  int full;
+
+  if (!header || frame->pitch * frame->height > share->size - SHARE_PIXELS)
+  {
+    return;
+  }
+
+  full = frame->seq != share->last + 1 ||
+         header->width != frame->width ||
+         header->height != frame->height ||
+         header->depth != frame->bpp * 8 ||
+         header->pitch != frame->pitch;
+
+  /* Readers see an odd sequence number until the frame is complete. The
+   * acquire keeps the stores of the frame after the increment. */
+  seq = __atomic_fetch_add(&header->seq, 1, __ATOMIC_ACQ_REL);
+
+  header->width = frame->width;
+  header->height = frame->height;
+  header->depth = frame->bpp * 8;
+  header->pitch = frame->pitch;
+  header->size = frame->pitch * frame->height;
+  memcpy(header->palette, frame->palette, sizeof(header->palette));
+
+  for (y = 0; y < frame->height; ++y)
+  {
+    if (full || frame->rows[y])
+    {
+      memcpy(pixels + y * frame->pitch, frame->pixels + y * frame->pitch,
+             frame->pitch);
+    }
+  }
+
+  __atomic_store_n(&header->seq, seq + 2, __ATOMIC_RELEASE);
+  syscall(SYS_futex, &header->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  share->last = frame->seq;
+}
@@ -0,0 +1,64 @@
+/* This file is part of the Team 28 Project
+ * Licensing information can be found in the LICENSE file
+ * (C) 2014 The Team 28 Authors. All rights reserved.
+ */
+#ifndef __SHARE_H__
+#define __SHARE_H__
+
+/**
+ * Magic number at the start of the segment, "PiFB"
+ */
+#define SHARE_MAGIC   0x42466950
+
+/**
+ * Offset of the pixels in the segment
+ */
+#define SHARE_PIXELS  0x1000
+
+/**
+ * Header of the shared memory segment. The pixels follow at SHARE_PIXELS
+ * in the layout of the guest framebuffer.
+ *
+ * seq works as a sequence lock: it is odd while a frame is being written
+ * and even once the frame is complete, so seq / 2 is the frame number.
+ * Readers which copy a frame should check that seq was even and did not
+ * change meanwhile. The emulator wakes futex waiters on seq after every
+ * frame.
+ */
+typedef struct
+{
+  uint32_t      magic;
+  uint32_t      seq;
+  uint32_t      width;
+  uint32_t      height;
+  uint32_t      depth;
+  uint32_t      pitch;
+  uint32_t      size;
+  uint32_t      reserved;
+  uint16_t      palette[256];
+} share_header_t;
+
+/**
+ * Framebuffer export to shared memory
+ */
+typedef struct
+{
+  /* Emulator reference */
+  emulator_t*     emu;
+
+  /* Segment, NULL if frames are not exported */
+  char            name[256];
+  int             fd;
+  uint8_t*        data;
+  size_t          size;
+  share_header_t* header;
+
+  /* Last frame exported */
+  uint32_t        last;
+} share_t;
+
+void share_init(share_t*, emulator_t*);
+void share_destroy(share_t*);
+void share_frame(share_t*, const fb_frame_t* frame);
+
+#endif /* __SHARE_H__ */
@@ -319,7 +319,6 @@ static inline void
 dt_multiple_data_transfer(vfp_t* vfp, uint32_t Fd, uint32_t Rn, uint32_t offset,
                           uint32_t l, uint32_t mode)
 {
-  uint32_t i;
   uint32_t base;
 
   base = cpu_read_register(&vfp->emu->cpu, Rn) & 0xfffffffc;
@@ -335,20 +334,12 @@ dt_multiple_data_transfer(vfp_t* vfp, uint32_t Fd, uint32_t Rn, uint32_t offset,
   if (l)
   {
     /* Load registers from Fd to Fd + offset from memory */
-    for (i = 0; i < offset; ++i)
-    {
-      vfp->reg.s[Fd + i] =
-        memory_read_dword_le(&vfp->emu->memory, base + (i << 2));
-    }
+    memory_read_block(&vfp->emu->memory, base, &vfp->reg.s[Fd], offset << 2);
   }
   else
   {
     /* Write registers from Fd to Fd + offset to memory */
-    for (i = 0; i < offset; ++i)
-    {
-      memory_write_dword_le(
-        &vfp->emu->memory, base + (i << 2), vfp->reg.s[Fd + i]);
-    }
+    memory_write_block(&vfp->emu->memory, base, &vfp->reg.s[Fd], offset << 2);
   }
 
   /* In mode 1 - increment base and write back to Rn */
@@ -471,6 +462,7 @@ rt_status_reg_transfer(vfp_t* vfp, uint32_t Fn, uint32_t Rd, uint32_t l)
     {
       if (Fn == 0x2)
       {
+        cpu_sync_flags(&vfp->emu->cpu);
         vfp->emu->cpu.cpsr.r &= 0x0fffffff;
         vfp->emu->cpu.cpsr.r |= value & 0xf0000000;
       }